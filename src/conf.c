@@ -21,6 +21,9 @@
 #ifdef FWD
 #include "ext-fwd.h"
 #endif
+#ifdef DNS
+#include "ext-dns.h"
+#endif
 #ifdef __CYGWIN__
 #include "windows.h"
 #endif
@@ -66,7 +69,11 @@ const char *kadnode_usage_str = "KadNode - A P2P name resolution daemon.\n"
 "\n"
 " --value-id <id>[:<port>]	Add a value/domain to be announced every 30 minutes.\n"
 "				This option may occur multiple times.\n\n"
+" --value-file <file>		Add all values of a file with one <id>[:<port>] [<minutes>]\n"
+"				entry on each line. Comments start after '#'.\n\n"
 " --peerfile <file>		Import/Export peers from and to a file.\n\n"
+" --history-file <file>		Remember the most resolved names in this file and search\n"
+"				them again after a restart.\n\n"
 " --peer <addr>			Add a static peer address.\n"
 "				This option may occur multiple times.\n\n"
 " --user <user>			Change the UUID after start.\n\n"
@@ -84,6 +91,15 @@ const char *kadnode_usage_str = "KadNode - A P2P name resolution daemon.\n"
 "				Default: ipv4\n\n"
 " --query-tld <domain>		Top level domain to be handled by KadNode.\n"
 "				Default: "QUERY_TLD_DEFAULT"\n\n"
+" --probe-mode <tcp|udp>		Probe the port of found addresses and return\n"
+"				reachable addresses with low latency first.\n"
+"				Default: disabled\n\n"
+" --announce-batch		When an announcement search finishes, also announce\n"
+"				all values with ids close enough to be covered by\n"
+"				the nodes it found, instead of searching for each.\n\n";
+
+/* Options of the optional interfaces, kept apart to stay below the C99 string length limit */
+const char *kadnode_usage_ext_str = ""
 #ifdef LPD
 " --lpd-addr <addr>		Set multicast address for Local Peer Discovery.\n"
 "				Default: "LPD_ADDR4" / "LPD_ADDR6"\n\n"
@@ -97,6 +113,13 @@ const char *kadnode_usage_str = "KadNode - A P2P name resolution daemon.\n"
 " --auth-add-skey [<pat>:]<skey>	Assign a secret key to all values that match the pattern.\n"
 "				It is used to prove that you own the matching domain.\n"
 "				The other side needs to knows the public key.\n\n"
+" --auth-assert-lifetime <seconds>	Answer challenges for own addresses with a signed\n"
+"				assertion that is valid this long and reused meanwhile.\n"
+"				Default: 0 (disabled)\n\n"
+" --auth-rate-limit <packets>	Handle at most this many packets per second from a source address.\n"
+"				Default: "AUTH_RATE_LIMIT"\n\n"
+" --auth-workers <threads>	Sign and verify in this many threads.\n"
+"				Default: 0 (sign and verify in the main thread)\n\n"
 #endif
 #ifdef CMD
 " --cmd-disable-stdin		Disable the local control interface.\n\n"
@@ -107,11 +130,33 @@ const char *kadnode_usage_str = "KadNode - A P2P name resolution daemon.\n"
 " --dns-port <port>		Bind the DNS server interface to this local port.\n"
 "				Default: "DNS_PORT"\n\n"
 " --dns-server <ip_addr>	IP address of an external DNS server. Enables DNS proxy mode.\n"
+"				May occur multiple times, the fastest server is preferred.\n"
 "				Default: none\n\n"
+" --dns-timeout <seconds>	Wait this long for results before a query fails.\n"
+"				Default: "DNS_TIMEOUT"\n\n"
+" --dns-proxy-cache <entries>	Cache this many answers of external DNS servers.\n"
+"				Default: 0 (disabled)\n\n"
+" --dns-proxy-min-ttl <seconds>	Cache answers of external DNS servers at least this long.\n"
+"				Default: 0\n\n"
+" --dns-proxy-max-ttl <seconds>	Cache answers of external DNS servers at most this long.\n"
+"				Default: "DNS_PROXY_MAX_TTL"\n\n"
+" --dns-authoritative		Answer as the name server of the query TLD, including SOA and NS\n"
+"				records. Lets a local resolver forward only these queries.\n\n"
+" --dns-rate-limit <responses>	Send at most this many UDP responses per second to a client network\n"
+"				(IPv4 /24, IPv6 /56). Every second response over the limit is\n"
+"				sent truncated, the others are dropped. With --dns-workers, every\n"
+"				thread applies the limit on its own, so a client network spread\n"
+"				over all threads might get up to limit * (threads + 1) responses.\n"
+"				Default: 0 (no limit)\n\n"
+" --dns-search-limit <searches>	Start at most this many searches per second for a client network.\n"
+"				Default: 0 (no limit)\n\n"
+" --dns-workers <threads>	Answer cached DNS queries in this many threads.\n"
+"				Default: 0 (answer all queries in the main thread)\n\n"
 #endif
 #ifdef NSS
-" --nss-port <port>		Bind the Network Service Switch to this local port.\n"
-"				Default: "NSS_PORT"\n\n"
+" --nss-path <path>		Bind the Network Service Switch to this Unix socket.\n"
+"				A leading @ refers to the abstract namespace.\n"
+"				Default: "NSS_PATH"\n\n"
 #endif
 #ifdef WEB
 " --web-port <port>		Bind the web server to this local port.\n"
@@ -256,6 +301,12 @@ void conf_check( void ) {
 		gconf->dht_port = strdup( DHT_PORT );
 	}
 
+#ifdef AUTH
+	if( gconf->auth_rate_limit == 0 ) {
+		gconf->auth_rate_limit = atoi( AUTH_RATE_LIMIT );
+	}
+#endif
+
 #ifdef CMD
 	if( gconf->cmd_port == NULL )  {
 		gconf->cmd_port = strdup( CMD_PORT );
@@ -267,17 +318,23 @@ void conf_check( void ) {
 		gconf->dns_port = strdup( DNS_PORT );
 	}
 
-	if( gconf->dns_server ) {
-		if( addr_parse( &gconf->dns_server_addr, gconf->dns_server, "53", AF_UNSPEC ) != 0 ) {
-			log_err( "CFG: Failed to parse IP address '%s'.", gconf->dns_server );
-			exit( 1 );
-		}
+	if( gconf->dns_timeout == 0 ) {
+		gconf->dns_timeout = atoi( DNS_TIMEOUT );
+	}
+
+	if( gconf->dns_proxy_max_ttl == 0 ) {
+		gconf->dns_proxy_max_ttl = atoi( DNS_PROXY_MAX_TTL );
+	}
+
+	if( gconf->dns_proxy_min_ttl > gconf->dns_proxy_max_ttl ) {
+		log_err( "CFG: Minimum TTL of the DNS proxy cache exceeds the maximum TTL." );
+		exit( 1 );
 	}
 #endif
 
 #ifdef NSS
-	if( gconf->nss_port == NULL ) {
-		gconf->nss_port = strdup( NSS_PORT );
+	if( gconf->nss_path == NULL ) {
+		gconf->nss_path = strdup( NSS_PATH );
 	}
 #endif
 
@@ -306,12 +363,6 @@ void conf_check( void ) {
 	}
 #endif
 
-#ifdef NSS
-	if( port_parse( gconf->nss_port, -1 ) < 0 ) {
-		log_err( "CFG: Invalid NSS port '%s'.", gconf->nss_port );
-		exit( 1 );
-	}
-#endif
 
 #ifdef WEB
 	if( port_parse( gconf->web_port, -1 ) < 0 ) {
@@ -392,14 +443,21 @@ void conf_info( void ) {
 
 	log_info( "Query TLD: %s", gconf->query_tld );
 	log_info( "Peer File: %s", gconf->peerfile ? gconf->peerfile : "None" );
+	if( gconf->history_file ) {
+		log_info( "History File: %s", gconf->history_file );
+	}
+	if( gconf->values_file ) {
+		log_info( "Value File: %s", gconf->values_file );
+	}
+	if( gconf->probe_protocol ) {
+		log_info( "Probe Mode: %s", (gconf->probe_protocol == IPPROTO_TCP) ? "TCP" : "UDP" );
+	}
+	if( gconf->announce_batch ) {
+		log_info( "Announce Batch: Enabled" );
+	}
 #ifdef LPD
 	log_info( "LPD Address: %s", (gconf->lpd_disable == 0) ? gconf->lpd_addr : "Disabled" );
 #endif
-#ifdef DNS
-	if (gconf->dns_server) {
-		log_info( "Forward foreign DNS requests to %s", gconf->dns_server );
-	}
-#endif
 }
 
 void conf_free( void ) {
@@ -409,9 +467,11 @@ void conf_free( void ) {
 	free( gconf->user );
 	free( gconf->pidfile );
 	free( gconf->peerfile );
+	free( gconf->history_file );
 	free( gconf->dht_port );
 	free( gconf->dht_ifname );
 	free( gconf->configfile );
+	free( gconf->values_file );
 
 #ifdef LPD
 	free( gconf->lpd_addr );
@@ -421,10 +481,9 @@ void conf_free( void ) {
 #endif
 #ifdef DNS
 	free( gconf->dns_port );
-	free( gconf->dns_server );
 #endif
 #ifdef NSS
-	free( gconf->nss_port );
+	free( gconf->nss_path );
 #endif
 #ifdef WEB
 	free( gconf->web_port );
@@ -469,6 +528,10 @@ int conf_handle_option( char opt[], char val[] ) {
 		conf_str( opt, &gconf->pidfile, val );
 	} else if( match( opt, "--peerfile" ) ) {
 		conf_str( opt, &gconf->peerfile, val );
+	} else if( match( opt, "--history-file" ) ) {
+		conf_str( opt, &gconf->history_file, val );
+	} else if( match( opt, "--value-file" ) ) {
+		conf_str( opt, &gconf->values_file, val );
 	} else if( match( opt, "--peer" ) ) {
 		if( val == NULL ) {
 			conf_arg_expected( opt );
@@ -499,11 +562,84 @@ int conf_handle_option( char opt[], char val[] ) {
 	} else if( match( opt, "--dns-port" ) ) {
 		conf_str( opt, &gconf->dns_port, val );
 	} else if( match( opt, "--dns-server" ) ) {
-		conf_str( opt, &gconf->dns_server, val );
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		}
+		dns_add_server( val );
+	} else if( match( opt, "--dns-timeout" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->dns_timeout != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->dns_timeout = atoi( val )) < 1 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--dns-proxy-cache" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->dns_proxy_cache != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->dns_proxy_cache = atoi( val )) < 0 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--dns-proxy-min-ttl" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( (gconf->dns_proxy_min_ttl = atoi( val )) < 0 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--dns-proxy-max-ttl" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->dns_proxy_max_ttl != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->dns_proxy_max_ttl = atoi( val )) < 1 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--dns-authoritative" ) ) {
+		if( val != NULL ) {
+			conf_no_arg_expected( opt );
+		} else {
+			gconf->dns_authoritative = 1;
+		}
+	} else if( match( opt, "--dns-rate-limit" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->dns_rate_limit != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->dns_rate_limit = atoi( val )) < 0 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--dns-search-limit" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->dns_search_limit != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->dns_search_limit = atoi( val )) < 0 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--dns-workers" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->dns_workers != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->dns_workers = atoi( val )) < 0 || gconf->dns_workers > DNS_MAX_WORKERS ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
 #endif
 #ifdef NSS
+	} else if( match( opt, "--nss-path" ) ) {
+		conf_str( opt, &gconf->nss_path, val );
 	} else if( match( opt, "--nss-port" ) ) {
-		conf_str( opt, &gconf->nss_port, val );
+		log_err( "CFG: %s has been replaced by --nss-path, NSS queries now use a Unix socket.", opt );
+		exit( 1 );
 #endif
 #ifdef WEB
 	} else if( match( opt, "--web-port" ) ) {
@@ -528,6 +664,23 @@ int conf_handle_option( char opt[], char val[] ) {
 		}
 	} else if( match( opt, "--port" ) ) {
 		conf_str( opt, &gconf->dht_port, val );
+	} else if( match( opt, "--probe-mode" ) ) {
+		if( gconf->probe_protocol != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( val && match( val, "tcp" ) ) {
+			gconf->probe_protocol = IPPROTO_TCP;
+		} else if( val && match( val, "udp" ) ) {
+			gconf->probe_protocol = IPPROTO_UDP;
+		} else {
+			log_err("CFG: Invalid argument for %s. Use 'tcp' or 'udp'.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--announce-batch" ) ) {
+		if( val != NULL ) {
+			conf_no_arg_expected( opt );
+		} else {
+			gconf->announce_batch = 1;
+		}
 #ifdef LPD
 	} else if( match( opt, "--lpd-addr" ) ) {
 		conf_str( opt, &gconf->lpd_addr, val );
@@ -538,6 +691,35 @@ int conf_handle_option( char opt[], char val[] ) {
 			gconf->lpd_disable = 1;
 		}
 #endif
+#ifdef AUTH
+	} else if( match( opt, "--auth-assert-lifetime" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->auth_assert_lifetime != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->auth_assert_lifetime = atoi( val )) < 1 || gconf->auth_assert_lifetime > AUTH_ASSERT_MAX_LIFETIME ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--auth-rate-limit" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->auth_rate_limit != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->auth_rate_limit = atoi( val )) < 1 ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+	} else if( match( opt, "--auth-workers" ) ) {
+		if( val == NULL ) {
+			conf_arg_expected( opt );
+		} else if( gconf->auth_workers != 0 ) {
+			conf_duplicate_option( opt );
+		} else if( (gconf->auth_workers = atoi( val )) < 0 || gconf->auth_workers > AUTH_MAX_WORKERS ) {
+			log_err( "CFG: Invalid argument for %s.", opt );
+			exit( 1 );
+		}
+#endif
 #ifdef FWD
 	} else if( match( opt, "--fwd-disable" ) ) {
 		if( val != NULL ) {
@@ -577,7 +759,7 @@ int conf_handle_option( char opt[], char val[] ) {
 			gconf->is_daemon = 1;
 		}
 	} else if( match( opt, "-h" ) || match( opt, "--help" ) ) {
-		printf( "%s\n", kadnode_usage_str );
+		printf( "%s%s\n", kadnode_usage_str, kadnode_usage_ext_str );
 		exit( 0 );
 	} else if( match( opt, "-v" ) || match( opt, "--version" ) ) {
 		printf( "%s\n", kadnode_version_str );
@@ -42,9 +42,15 @@ struct gconf_t {
 	/* Import/Export peers from this file */
 	char *peerfile;
 
+	/* Import/Export names resolved by clients from this file */
+	char *history_file;
+
 	/* Path to configuration file */
 	char *configfile;
 
+	/* Load values to announce from this file */
+	char *values_file;
+
 	/* Start in Foreground / Background */
 	int is_daemon;
 
@@ -69,6 +75,12 @@ struct gconf_t {
 	/* KadNode startup time */
 	time_t startup_time;
 
+	/* Probe result addresses using IPPROTO_TCP or IPPROTO_UDP (0 = disabled) */
+	int probe_protocol;
+
+	/* Reuse recent announcement searches for nearby value ids */
+	int announce_batch;
+
 #ifdef __CYGWIN__
 	/* Start as windows service */
 	int service_start;
@@ -87,6 +99,17 @@ struct gconf_t {
 	int lpd_disable;
 #endif
 
+#ifdef AUTH
+	/* Seconds a signed assertion of an own address is valid (0 = disabled) */
+	int auth_assert_lifetime;
+
+	/* Packets per second accepted from a source address */
+	int auth_rate_limit;
+
+	/* Number of threads that sign and verify */
+	int auth_workers;
+#endif
+
 #ifdef CMD
 	char *cmd_port;
 	int cmd_disable_stdin;
@@ -95,13 +118,27 @@ struct gconf_t {
 #ifdef DNS
 	char *dns_port;
 
-	/* External DNS server */
-	char *dns_server;
-	IP dns_server_addr;
+	/* Seconds to wait for results of a query */
+	int dns_timeout;
+
+	/* Number of cached answers of external DNS servers and TTL limits */
+	int dns_proxy_cache;
+	int dns_proxy_min_ttl;
+	int dns_proxy_max_ttl;
+
+	/* Act as the name server of the query TLD */
+	int dns_authoritative;
+
+	/* Responses and new searches per second and client network */
+	int dns_rate_limit;
+	int dns_search_limit;
+
+	/* Number of threads that answer cached queries */
+	int dns_workers;
 #endif
 
 #ifdef NSS
-	char *nss_port;
+	char *nss_path;
 #endif
 
 #ifdef WEB
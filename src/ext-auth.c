@@ -5,12 +5,16 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <sodium.h>
 
 #include "main.h"
 #include "conf.h"
 #include "log.h"
+#include "sha1.h"
 #include "utils.h"
 #include "kad.h"
 #include "net.h"
@@ -19,10 +23,45 @@
 #include "ext-auth.h"
 
 
-/* Maximum packets to process per second */
+/* Maximum packets of all sources to process per second, for the main thread and each worker thread */
 #define MAX_AUTH_REQUESTS 100
+/* Number of sources with separate rate limits, a power of two */
+#define AUTH_SOURCES_SIZE 1024
+/* Jobs that can be passed to a worker thread, a power of two */
+#define AUTH_QUEUE_SIZE 256
 /* Maximum retries to send the challenge per address */
 #define MAX_AUTH_CHALLENGE_SEND 10
+/* Milliseconds until the first retransmission, doubles with every retry */
+#define AUTH_CHALLENGE_INTERVAL 250
+#define AUTH_CHALLENGE_MAX_INTERVAL 8000
+/* Number of remembered verified addresses, a power of two */
+#define AUTH_VERIFIED_SIZE 256
+/* Seconds a verified address does not need to be challenged again */
+#define AUTH_VERIFIED_LIFETIME (10*60)
+/* Number of cached signed assertions, a power of two */
+#define AUTH_ASSERT_SIZE 64
+/* Maximum number of remembered interface addresses */
+#define AUTH_LOCAL_ADDRS_MAX 32
+/* Seconds until the interface addresses are read again */
+#define AUTH_LOCAL_ADDRS_REFRESH 60
+
+/* Encoded address family, port and address */
+#define AUTH_ENDPOINT_LENGTH (1+2+16)
+/* Signed message of an assertion: id, endpoint and expiration time */
+#define AUTH_ASSERT_LENGTH (SHA1_BIN_LENGTH+AUTH_ENDPOINT_LENGTH+8)
+
+/* Number of memoized query ids per key list, a power of two */
+#define AUTH_MEMO_SIZE 256
+/* Longer queries are not memoized */
+#define AUTH_MEMO_QUERY_SIZE 64
+
+/* Packet sizes, all packets start with "AUTH" and the id */
+#define AUTH_CHALLENGE_PACKET (4+SHA1_BIN_LENGTH+CHALLENGE_BIN_LENGTH)
+#define AUTH_CHALLENGE_EXT_PACKET (AUTH_CHALLENGE_PACKET+AUTH_ENDPOINT_LENGTH)
+#define AUTH_ASSERT_PACKET (4+SHA1_BIN_LENGTH+AUTH_ASSERT_LENGTH+crypto_sign_BYTES)
+
+/* Largest signed message that is verified */
+#define AUTH_JOB_IN_SIZE (AUTH_ASSERT_LENGTH+crypto_sign_BYTES)
 
 
 struct key_t {
@@ -35,10 +74,126 @@ struct key_t {
 static struct key_t *g_secret_keys = NULL;
 static struct key_t *g_public_keys = NULL;
 
-static time_t g_send_challenges = 0;
+/*
+* Trie of the reversed patterns. A query is matched by walking
+* its characters from the end, so that the wildcard patterns
+* are found in the same pass as the exact patterns.
+*/
+struct key_node_t {
+	struct key_node_t *child;
+	struct key_node_t *next;
+	/* Pattern that is equal to the path to the node */
+	const struct key_t *exact;
+	/* Pattern that is '*' followed by the path to the node */
+	const struct key_t *wildcard;
+	char c;
+};
+
+static struct key_node_t g_secret_trie;
+static struct key_node_t g_public_trie;
+
+/* Query with the computed id and the matched key (if any) */
+struct auth_memo_t {
+	char query[AUTH_MEMO_QUERY_SIZE];
+	UCHAR id[SHA1_BIN_LENGTH];
+	const struct key_t *key;
+};
+
+/* Fixed size tables, a query that hashes to a used slot takes it over */
+static struct auth_memo_t g_secret_memo[AUTH_MEMO_SIZE];
+static struct auth_memo_t g_public_memo[AUTH_MEMO_SIZE];
+
+/* An address that has answered a challenge for a public key */
+struct auth_verified_t {
+	UCHAR pkey[crypto_sign_PUBLICKEYBYTES];
+	IP addr;
+	time_t expire;
+};
+
+/* Fixed size table, a pair that hashes to a used slot takes it over */
+static struct auth_verified_t g_auth_verified[AUTH_VERIFIED_SIZE];
+
+/* A signed assertion that a value id is reachable at an endpoint */
+struct auth_assert_t {
+	UCHAR id[SHA1_BIN_LENGTH];
+	UCHAR endpoint[AUTH_ENDPOINT_LENGTH];
+	time_t expire;
+	UCHAR sm[AUTH_ASSERT_LENGTH+crypto_sign_BYTES];
+};
+
+/* Assertions are signed once and served until half of the lifetime has passed */
+static struct auth_assert_t g_auth_asserts[AUTH_ASSERT_SIZE];
+
+/* Addresses of the local interfaces, only those are asserted */
+static IP g_local_addrs[AUTH_LOCAL_ADDRS_MAX];
+static size_t g_local_addrs_num = 0;
+static time_t g_local_addrs_updated = 0;
+
+/* Min heap of unanswered challenges, ordered by the time of the next send */
+static struct result_t **g_challenges = NULL;
+static size_t g_challenges_num = 0;
+static size_t g_challenges_size = 0;
 static size_t g_request_counter = 0;
 static time_t g_request_counter_started = 0;
 
+/* Packets received from a source address in the current second */
+struct auth_source_t {
+	IP addr;
+	time_t time;
+	int packets;
+};
+
+/* Fixed size table, a source that hashes to a used slot takes it over */
+static struct auth_source_t g_auth_sources[AUTH_SOURCES_SIZE];
+
+enum {
+	AUTH_JOB_SIGN,
+	AUTH_JOB_CHALLENGE,
+	AUTH_JOB_ASSERTION
+};
+
+/*
+* Sign a challenge and send the response (AUTH_JOB_SIGN) or
+* verify a challenge response or an assertion from addr.
+*/
+struct auth_job_t {
+	int type;
+	int sock;
+	IP addr;
+	UCHAR id[SHA1_BIN_LENGTH];
+	UCHAR key[crypto_sign_SECRETKEYBYTES];
+	UCHAR in[AUTH_JOB_IN_SIZE];
+	unsigned long long inlen;
+	/* Response packet or the verified message */
+	UCHAR out[AUTH_ASSERT_PACKET];
+	unsigned long long outlen;
+	int rc;
+};
+
+/*
+* A thread that signs and verifies. Jobs are passed in a ring that is
+* used in both directions: head is only written by the main thread when
+* a job is added, done only by the worker when a job is finished and tail
+* only by the main thread when a finished job was handled.
+*/
+struct auth_worker_t {
+	pthread_t thread;
+	int wakeup[2];
+	unsigned int head;
+	unsigned int done;
+	unsigned int tail;
+	struct auth_job_t jobs[AUTH_QUEUE_SIZE];
+};
+
+static struct auth_worker_t *g_auth_workers[AUTH_MAX_WORKERS];
+static int g_auth_workers_num = 0;
+static int g_auth_workers_next = 0;
+static int g_auth_workers_running = 0;
+
+/* Workers wake up the main thread by writing to this pipe */
+static int g_auth_wakeup[2] = { -1, -1 };
+static int g_auth_wakeup_pending = 0;
+
 
 /*
 * Use secret key to create the corresponding public key.
@@ -143,24 +298,136 @@ int is_pattern_conflict( const char p1[], const char p2[] ) {
 	}
 }
 
-int auth_find_key( UCHAR key[], const char query[], const struct key_t *keys ) {
-	const struct key_t *cur;
+/* Find the key of the pattern that matches the query */
+const struct key_t *auth_find_key( const char query[], const struct key_node_t *trie ) {
+	const struct key_node_t *node;
+	const struct key_node_t *child;
+	const struct key_t *found;
+	size_t i;
+
+	/* The '*' pattern matches every query */
+	node = trie;
+	found = node->wildcard;
+
+	i = strlen( query );
+	while( i > 0 ) {
+		i--;
+		child = node->child;
+		while( child && child->c != query[i] ) {
+			child = child->next;
+		}
 
-	cur = keys;
-	while( cur ) {
-		/* Match query against pattern */
-		if( (cur->pattern[0] == '*') && is_suffix( query, cur->pattern + 1 ) ) {
-			memcpy( key, cur->keybytes, cur->keysize );
-			return 1;
-		} else if( strcmp( query, cur->pattern ) == 0 ) {
-			memcpy( key, cur->keybytes, cur->keysize );
-			return 1;
+		if( child == NULL ) {
+			return found;
 		}
 
-		cur = cur->next;
+		node = child;
+		if( node->wildcard ) {
+			found = node->wildcard;
+		}
 	}
 
-	return 0;
+	return node->exact ? node->exact : found;
+}
+
+void auth_trie_insert( struct key_node_t *trie, const struct key_t *key ) {
+	struct key_node_t *node;
+	struct key_node_t *child;
+	const char *suffix;
+	size_t i;
+
+	suffix = (key->pattern[0] == '*') ? (key->pattern + 1) : key->pattern;
+
+	node = trie;
+	i = strlen( suffix );
+	while( i > 0 ) {
+		i--;
+		child = node->child;
+		while( child && child->c != suffix[i] ) {
+			child = child->next;
+		}
+
+		if( child == NULL ) {
+			child = (struct key_node_t*) calloc( 1, sizeof(struct key_node_t) );
+			child->c = suffix[i];
+			child->next = node->child;
+			node->child = child;
+		}
+
+		node = child;
+	}
+
+	if( key->pattern[0] == '*' ) {
+		node->wildcard = key;
+	} else {
+		node->exact = key;
+	}
+}
+
+void auth_trie_free( struct key_node_t *node ) {
+	struct key_node_t *child;
+	struct key_node_t *next;
+
+	child = node->child;
+	while( child ) {
+		next = child->next;
+		auth_trie_free( child );
+		free( child );
+		child = next;
+	}
+
+	memset( node, '\0', sizeof(struct key_node_t) );
+}
+
+/*
+* Get the key that matches the query and compute the id.
+* The public key is used as salt for the query.
+*/
+const struct key_t *auth_resolve_key( UCHAR id[], const char query[],
+		const struct key_node_t *trie, struct auth_memo_t memo[] ) {
+	char pkeyhex[2*crypto_sign_PUBLICKEYBYTES+1];
+	struct auth_memo_t *entry;
+	const struct key_t *key;
+	const UCHAR *pkey;
+	unsigned int hash;
+	SHA1_CTX ctx;
+	size_t len;
+	size_t i;
+
+	len = strlen( query );
+
+	hash = 2166136261U;
+	for( i = 0; i < len; i++ ) {
+		hash = (hash ^ (UCHAR) query[i]) * 16777619U;
+	}
+
+	entry = &memo[hash & (AUTH_MEMO_SIZE - 1)];
+	if( len > 0 && len < AUTH_MEMO_QUERY_SIZE && memcmp( entry->query, query, len + 1 ) == 0 ) {
+		memcpy( id, entry->id, SHA1_BIN_LENGTH );
+		return entry->key;
+	}
+
+	key = auth_find_key( query, trie );
+	if( key ) {
+		/* The public key is the second half of a secret key */
+		pkey = key->keybytes + key->keysize - crypto_sign_PUBLICKEYBYTES;
+		bytes_to_hex( pkeyhex, pkey, crypto_sign_PUBLICKEYBYTES );
+
+		SHA1_Init( &ctx );
+		SHA1_Update( &ctx, (const UCHAR *) pkeyhex, 2*crypto_sign_PUBLICKEYBYTES );
+		SHA1_Update( &ctx, (const UCHAR *) query, len );
+		SHA1_Final( &ctx, id );
+	} else {
+		id_compute( id, query );
+	}
+
+	if( len > 0 && len < AUTH_MEMO_QUERY_SIZE ) {
+		memcpy( entry->query, query, len + 1 );
+		memcpy( entry->id, id, SHA1_BIN_LENGTH );
+		entry->key = key;
+	}
+
+	return key;
 }
 
 void free_key( struct key_t *key ) {
@@ -213,7 +480,8 @@ int auth_parse_key( char pattern[], size_t patternsize, UCHAR key[], size_t keys
 	return 0;
 }
 
-void auth_add_key( const char pattern[], const UCHAR key[], size_t keysize, struct key_t **g_key_list ) {
+void auth_add_key( const char pattern[], const UCHAR key[], size_t keysize,
+		struct key_t **g_key_list, struct key_node_t *trie, struct auth_memo_t memo[] ) {
 	struct key_t* item;
 
 	/* Check for conflicting patterns */
@@ -235,6 +503,11 @@ void auth_add_key( const char pattern[], const UCHAR key[], size_t keysize, stru
 	/* Prepend to list */
 	item->next = *g_key_list;
 	*g_key_list = item;
+
+	auth_trie_insert( trie, item );
+
+	/* Memoized ids might be salted differently now */
+	memset( memo, '\0', AUTH_MEMO_SIZE * sizeof(struct auth_memo_t) );
 }
 
 void auth_add_pkey( const char arg[] ) {
@@ -242,7 +515,7 @@ void auth_add_pkey( const char arg[] ) {
 	char pattern[512];
 
 	if( auth_parse_key( pattern, sizeof(pattern), pkey, sizeof(pkey), arg ) == 0 ) {
-		auth_add_key( pattern, pkey, sizeof(pkey), &g_public_keys );
+		auth_add_key( pattern, pkey, sizeof(pkey), &g_public_keys, &g_public_trie, g_public_memo );
 	}
 }
 
@@ -252,11 +525,11 @@ void auth_add_skey( const char arg[] ) {
 	char pattern[512];
 
 	if( auth_parse_key( pattern, sizeof(pattern), skey, sizeof(skey), arg ) == 0 ) {
-		auth_add_key( pattern, skey, sizeof(skey), &g_secret_keys );
+		auth_add_key( pattern, skey, sizeof(skey), &g_secret_keys, &g_secret_trie, g_secret_memo );
 
 		/* Also add public key entry for each secret key */
 		auth_skey_to_pkey( skey, pkey );
-		auth_add_key( pattern, pkey, sizeof(pkey), &g_public_keys );
+		auth_add_key( pattern, pkey, sizeof(pkey), &g_public_keys, &g_public_trie, g_public_memo );
 	}
 }
 
@@ -267,6 +540,7 @@ void auth_add_skey( const char arg[] ) {
 UCHAR *auth_handle_skey( UCHAR skey[], UCHAR id[], const char query[] ) {
 	char pkeyhex[2*crypto_sign_PUBLICKEYBYTES+1];
 	UCHAR pkey[crypto_sign_PUBLICKEYBYTES];
+	const struct key_t *key;
 
 	if( auth_is_skey( query ) ) {
 		/* The query to announce is a secret key */
@@ -276,20 +550,14 @@ UCHAR *auth_handle_skey( UCHAR skey[], UCHAR id[], const char query[] ) {
 
 		id_compute( id, pkeyhex );
 		return skey;
-	} else if( auth_find_key( skey, query, g_secret_keys ) ) {
-		/* There is a secret key registered for this query */
-		auth_skey_to_pkey( skey, pkey );
-		bytes_to_hex( pkeyhex, pkey, crypto_sign_PUBLICKEYBYTES );
-
-		/* We use the public key as salt for the query */
-		char *str = malloc( strlen( pkeyhex ) + strlen( query ) +1 );
-		sprintf( str, "%s%s", pkeyhex, query );
-		id_compute( id, str );
-		free( str );
+	}
 
+	/* Check if there is a secret key registered for this query */
+	key = auth_resolve_key( id, query, &g_secret_trie, g_secret_memo );
+	if( key ) {
+		memcpy( skey, key->keybytes, key->keysize );
 		return skey;
 	} else {
-		id_compute( id, query );
 		return NULL;
 	}
 }
@@ -299,82 +567,646 @@ UCHAR *auth_handle_skey( UCHAR skey[], UCHAR id[], const char query[] ) {
 * Also computes the identifier.
 */
 UCHAR *auth_handle_pkey( UCHAR pkey[], UCHAR id[], const char query[] ) {
-	char pkeyhex[2*crypto_sign_PUBLICKEYBYTES+1];
+	const struct key_t *key;
 
 	if( auth_is_pkey( query ) ) {
 		bytes_from_hex( pkey, query, 2*crypto_sign_PUBLICKEYBYTES );
 		id_compute( id, query );
 		return pkey;
-	} else if( auth_find_key( pkey, query, g_public_keys ) ) {
-		bytes_to_hex( pkeyhex, pkey, crypto_sign_PUBLICKEYBYTES );
-
-		char *str = malloc( strlen( pkeyhex ) + strlen( query ) + 1 );
-		sprintf( str, "%s%s", pkeyhex, query );
-		id_compute( id, str );
-		free( str );
+	}
 
+	key = auth_resolve_key( id, query, &g_public_trie, g_public_memo );
+	if( key ) {
+		memcpy( pkey, key->keybytes, key->keysize );
 		return pkey;
 	} else {
-		id_compute( id, query );
 		return NULL;
 	}
 }
 
-/* Send challenges */
+/* Compare address and port */
+int auth_endpoint_equal( const IP *addr1, const IP *addr2 ) {
+	if( addr1->ss_family == AF_INET && addr2->ss_family == AF_INET ) {
+		return ((IP4 *)addr1)->sin_port == ((IP4 *)addr2)->sin_port
+			&& memcmp( &((IP4 *)addr1)->sin_addr, &((IP4 *)addr2)->sin_addr, 4 ) == 0;
+	} else if( addr1->ss_family == AF_INET6 && addr2->ss_family == AF_INET6 ) {
+		return ((IP6 *)addr1)->sin6_port == ((IP6 *)addr2)->sin6_port
+			&& memcmp( &((IP6 *)addr1)->sin6_addr, &((IP6 *)addr2)->sin6_addr, 16 ) == 0;
+	} else {
+		return 0;
+	}
+}
+
+struct auth_verified_t *auth_verified_slot( const UCHAR pkey[], const IP *addr ) {
+	unsigned int hash;
+	const UCHAR *p;
+	size_t len;
+	size_t i;
+
+	hash = 2166136261U;
+	for( i = 0; i < crypto_sign_PUBLICKEYBYTES; i++ ) {
+		hash = (hash ^ pkey[i]) * 16777619U;
+	}
+
+	if( addr->ss_family == AF_INET6 ) {
+		p = (const UCHAR *) &((IP6 *)addr)->sin6_addr;
+		len = 16;
+		hash = (hash ^ ((IP6 *)addr)->sin6_port) * 16777619U;
+	} else {
+		p = (const UCHAR *) &((IP4 *)addr)->sin_addr;
+		len = 4;
+		hash = (hash ^ ((IP4 *)addr)->sin_port) * 16777619U;
+	}
+
+	for( i = 0; i < len; i++ ) {
+		hash = (hash ^ p[i]) * 16777619U;
+	}
+
+	return &g_auth_verified[hash & (AUTH_VERIFIED_SIZE - 1)];
+}
+
+int auth_verified_find( const UCHAR pkey[], const IP *addr ) {
+	const struct auth_verified_t *entry;
+
+	entry = auth_verified_slot( pkey, addr );
+
+	return entry->expire > time_now_sec()
+		&& auth_endpoint_equal( &entry->addr, addr )
+		&& memcmp( entry->pkey, pkey, crypto_sign_PUBLICKEYBYTES ) == 0;
+}
+
+void auth_verified_add( const UCHAR pkey[], const IP *addr, time_t expire ) {
+	struct auth_verified_t *entry;
+
+	entry = auth_verified_slot( pkey, addr );
+	memcpy( entry->pkey, pkey, crypto_sign_PUBLICKEYBYTES );
+	memcpy( &entry->addr, addr, sizeof(IP) );
+	entry->expire = expire;
+}
+
+/* Encode an address and port independent of the platform */
+void auth_endpoint_pack( UCHAR buf[], const IP *addr ) {
+	memset( buf, '\0', AUTH_ENDPOINT_LENGTH );
+
+	if( addr->ss_family == AF_INET6 ) {
+		buf[0] = 6;
+		memcpy( buf+1, &((IP6 *)addr)->sin6_port, 2 );
+		memcpy( buf+3, &((IP6 *)addr)->sin6_addr, 16 );
+	} else {
+		buf[0] = 4;
+		memcpy( buf+1, &((IP4 *)addr)->sin_port, 2 );
+		memcpy( buf+3, &((IP4 *)addr)->sin_addr, 4 );
+	}
+}
+
+int auth_endpoint_unpack( IP *addr, const UCHAR buf[] ) {
+	memset( addr, '\0', sizeof(IP) );
+
+	if( buf[0] == 6 ) {
+		addr->ss_family = AF_INET6;
+		memcpy( &((IP6 *)addr)->sin6_port, buf+1, 2 );
+		memcpy( &((IP6 *)addr)->sin6_addr, buf+3, 16 );
+		return 0;
+	} else if( buf[0] == 4 ) {
+		addr->ss_family = AF_INET;
+		memcpy( &((IP4 *)addr)->sin_port, buf+1, 2 );
+		memcpy( &((IP4 *)addr)->sin_addr, buf+3, 4 );
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+/* Read the addresses of all interfaces */
+void auth_local_addrs_update( void ) {
+	const struct ifaddrs *cur;
+	struct ifaddrs *addrs;
+
+	g_local_addrs_num = 0;
+	g_local_addrs_updated = time_now_sec();
+
+	if( getifaddrs( &addrs ) < 0 ) {
+		log_warn( "AUTH: Cannot get interface list." );
+		return;
+	}
+
+	cur = addrs;
+	while( cur != NULL && g_local_addrs_num < AUTH_LOCAL_ADDRS_MAX ) {
+		if( cur->ifa_addr && cur->ifa_addr->sa_family == gconf->af ) {
+			memset( &g_local_addrs[g_local_addrs_num], '\0', sizeof(IP) );
+			memcpy( &g_local_addrs[g_local_addrs_num], cur->ifa_addr,
+				(gconf->af == AF_INET6) ? sizeof(IP6) : sizeof(IP4) );
+			g_local_addrs_num++;
+		}
+		cur = cur->ifa_next;
+	}
+
+	freeifaddrs( addrs );
+}
+
+int auth_is_local_addr( const IP *addr ) {
+	size_t i;
+
+	if( time_now_sec() >= (g_local_addrs_updated + AUTH_LOCAL_ADDRS_REFRESH) ) {
+		auth_local_addrs_update();
+	}
+
+	for( i = 0; i < g_local_addrs_num; i++ ) {
+		if( addr_equal( &g_local_addrs[i], addr ) ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+* Get an assertion that the value is reachable at the endpoint.
+* The signature is reused until half of its lifetime has passed.
+*/
+const UCHAR *auth_assert_get( const struct value_t *value, const UCHAR endpoint[] ) {
+	struct auth_assert_t *entry;
+	UCHAR m[AUTH_ASSERT_LENGTH];
+	unsigned long long smlen;
+	unsigned int hash;
+	time_t expire;
+	time_t now;
+	size_t i;
+	int shift;
+
+	hash = 2166136261U;
+	for( i = 0; i < SHA1_BIN_LENGTH; i++ ) {
+		hash = (hash ^ value->id[i]) * 16777619U;
+	}
+	for( i = 0; i < AUTH_ENDPOINT_LENGTH; i++ ) {
+		hash = (hash ^ endpoint[i]) * 16777619U;
+	}
+
+	entry = &g_auth_asserts[hash & (AUTH_ASSERT_SIZE - 1)];
+	now = time_now_sec();
+
+	if( (entry->expire - now) > (gconf->auth_assert_lifetime / 2)
+			&& memcmp( entry->id, value->id, SHA1_BIN_LENGTH ) == 0
+			&& memcmp( entry->endpoint, endpoint, AUTH_ENDPOINT_LENGTH ) == 0 ) {
+		return entry->sm;
+	}
+
+	/* Sign a new assertion */
+	expire = now + gconf->auth_assert_lifetime;
+	memcpy( m, value->id, SHA1_BIN_LENGTH );
+	memcpy( m+SHA1_BIN_LENGTH, endpoint, AUTH_ENDPOINT_LENGTH );
+	for( i = 0, shift = 56; i < 8; i++, shift -= 8 ) {
+		m[SHA1_BIN_LENGTH+AUTH_ENDPOINT_LENGTH+i] = ((unsigned long long) expire >> shift) & 0xFF;
+	}
+
+	if( crypto_sign( entry->sm, &smlen, m, sizeof(m), value->skey ) != 0 ) {
+		entry->expire = 0;
+		return NULL;
+	}
+
+	memcpy( entry->id, value->id, SHA1_BIN_LENGTH );
+	memcpy( entry->endpoint, endpoint, AUTH_ENDPOINT_LENGTH );
+	entry->expire = expire;
+
+	return entry->sm;
+}
+
+long long auth_time_ms( void ) {
+	return (long long) gconf->time_now.tv_sec * 1000 + gconf->time_now.tv_usec / 1000;
+}
+
+void auth_heap_swap( size_t i, size_t j ) {
+	struct result_t *tmp;
+
+	tmp = g_challenges[i];
+	g_challenges[i] = g_challenges[j];
+	g_challenges[j] = tmp;
+	g_challenges[i]->challenge_idx = i;
+	g_challenges[j]->challenge_idx = j;
+}
+
+void auth_heap_up( size_t i ) {
+	size_t parent;
+
+	while( i > 0 ) {
+		parent = (i - 1) / 2;
+		if( g_challenges[parent]->challenge_due <= g_challenges[i]->challenge_due ) {
+			break;
+		}
+		auth_heap_swap( i, parent );
+		i = parent;
+	}
+}
+
+void auth_heap_down( size_t i ) {
+	size_t child;
+
+	while( (child = 2 * i + 1) < g_challenges_num ) {
+		if( (child + 1) < g_challenges_num
+				&& g_challenges[child + 1]->challenge_due < g_challenges[child]->challenge_due ) {
+			child++;
+		}
+		if( g_challenges[i]->challenge_due <= g_challenges[child]->challenge_due ) {
+			break;
+		}
+		auth_heap_swap( i, child );
+		i = child;
+	}
+}
+
+/* Send the challenge of a new result with the next call of auth_send_challenges() */
+void auth_challenge_schedule( struct result_t *result ) {
+	struct result_t **challenges;
+	size_t size;
+
+	if( g_challenges_num == g_challenges_size ) {
+		size = g_challenges_size ? (2 * g_challenges_size) : 64;
+		challenges = realloc( g_challenges, size * sizeof(struct result_t *) );
+		if( challenges == NULL ) {
+			return;
+		}
+		g_challenges = challenges;
+		g_challenges_size = size;
+	}
+
+	result->challenge_due = auth_time_ms();
+	result->challenge_idx = g_challenges_num;
+	g_challenges[g_challenges_num++] = result;
+	auth_heap_up( result->challenge_idx );
+
+	/* Do not wait for the next second */
+	net_wakeup_ms( result->challenge_due );
+}
+
+/* Stop sending the challenge of a result */
+void auth_challenge_cancel( struct result_t *result ) {
+	size_t i;
+
+	if( result->challenge_idx < 0 ) {
+		return;
+	}
+
+	i = result->challenge_idx;
+	result->challenge_idx = -1;
+	g_challenges_num--;
+
+	/* Move the last element into the gap */
+	if( i != g_challenges_num ) {
+		g_challenges[i] = g_challenges[g_challenges_num];
+		g_challenges[i]->challenge_idx = i;
+		auth_heap_up( i );
+		auth_heap_down( g_challenges[i]->challenge_idx );
+	}
+}
+
+/* Milliseconds until the next retransmission, with up to 50% jitter */
+long auth_challenge_interval( int sends ) {
+	long interval;
+
+	interval = AUTH_CHALLENGE_INTERVAL;
+	while( --sends > 0 && interval < AUTH_CHALLENGE_MAX_INTERVAL ) {
+		interval *= 2;
+	}
+
+	if( interval > AUTH_CHALLENGE_MAX_INTERVAL ) {
+		interval = AUTH_CHALLENGE_MAX_INTERVAL;
+	}
+
+	return interval + uint_random() % (interval / 2 + 1);
+}
+
+/*
+* Send challenges that are due. Every other challenge carries the
+* endpoint it was sent to, so the receiver can answer with an assertion.
+* Older nodes only answer the plain challenges.
+*/
 void auth_send_challenges( int sock ) {
-	UCHAR buf[4+SHA1_BIN_LENGTH+CHALLENGE_BIN_LENGTH];
-	struct results_t **results;
+	UCHAR buf[AUTH_CHALLENGE_EXT_PACKET];
+	struct result_t *result;
+	long long now;
+	size_t len;
+
+	now = auth_time_ms();
+
+	while( g_challenges_num > 0 && g_challenges[0]->challenge_due <= now ) {
+		result = g_challenges[0];
+
+		memcpy( buf, "AUTH", 4 );
+		memcpy( buf+4, result->bucket->id, SHA1_BIN_LENGTH );
+		memcpy( buf+4+SHA1_BIN_LENGTH, result->challenge, CHALLENGE_BIN_LENGTH );
+
+		if( (result->challenges_send % 2) == 0 ) {
+			auth_endpoint_pack( buf+AUTH_CHALLENGE_PACKET, &result->addr );
+			len = AUTH_CHALLENGE_EXT_PACKET;
+		} else {
+			len = AUTH_CHALLENGE_PACKET;
+		}
+
+		log_debug( "AUTH: Send challenge: %s", str_addr( &result->addr ) );
+		sendto( sock, buf, len, 0, (struct sockaddr*) &result->addr, sizeof(IP) );
+
+		result->challenges_send++;
+
+		if( result->challenges_send >= MAX_AUTH_CHALLENGE_SEND ) {
+			auth_challenge_cancel( result );
+		} else {
+			result->challenge_due = now + auth_challenge_interval( result->challenges_send );
+			auth_heap_down( 0 );
+		}
+	}
+
+	/* Retransmissions might be due before the next second */
+	if( g_challenges_num > 0 ) {
+		net_wakeup_ms( g_challenges[0]->challenge_due );
+	}
+}
+
+/* Count a packet of a source, returns 0 if the source exceeds the limit */
+int auth_source_allowed( const IP *addr, time_t now ) {
+	struct auth_source_t *entry;
+	unsigned int hash;
+	const UCHAR *p;
+	size_t len;
+	size_t i;
+
+	if( addr->ss_family == AF_INET6 ) {
+		p = (const UCHAR *) &((IP6 *)addr)->sin6_addr;
+		len = 16;
+	} else {
+		p = (const UCHAR *) &((IP4 *)addr)->sin_addr;
+		len = 4;
+	}
+
+	hash = 2166136261U;
+	for( i = 0; i < len; i++ ) {
+		hash = (hash ^ p[i]) * 16777619U;
+	}
+
+	entry = &g_auth_sources[hash & (AUTH_SOURCES_SIZE - 1)];
+
+	if( entry->time != now || !addr_equal( &entry->addr, addr ) ) {
+		memcpy( &entry->addr, addr, sizeof(IP) );
+		entry->time = now;
+		entry->packets = 0;
+	}
+
+	return (++entry->packets <= gconf->auth_rate_limit);
+}
+
+/* Sign or verify, called by the worker threads or the main thread */
+void auth_job_run( struct auth_job_t *job ) {
+	unsigned long long smlen;
+
+	if( job->type == AUTH_JOB_SIGN ) {
+		job->rc = crypto_sign( job->out+4+SHA1_BIN_LENGTH, &smlen, job->in, job->inlen, job->key );
+		if( job->rc == 0 ) {
+			memcpy( job->out, "AUTH", 4 );
+			memcpy( job->out+4, job->id, SHA1_BIN_LENGTH );
+			job->outlen = 4+SHA1_BIN_LENGTH+smlen;
+			sendto( job->sock, job->out, job->outlen, 0, (struct sockaddr*) &job->addr, sizeof(IP) );
+		}
+	} else {
+		job->rc = crypto_sign_open( job->out, &job->outlen, job->in, job->inlen, job->key );
+	}
+}
+
+/* Wake up the main thread, only the first job since it woke up writes to the pipe */
+void auth_worker_notify( void ) {
+	if( !__atomic_exchange_n( &g_auth_wakeup_pending, 1, __ATOMIC_SEQ_CST ) ) {
+		if( write( g_auth_wakeup[1], "", 1 ) < 0 ) {
+			/* The pipe is full, the main thread will wake up anyway */
+		}
+	}
+}
+
+void *auth_worker_loop( void *arg ) {
+	struct auth_worker_t *worker;
+	unsigned int done;
+	char buf[64];
+
+	worker = (struct auth_worker_t *) arg;
+	done = worker->done;
+
+	while( __atomic_load_n( &g_auth_workers_running, __ATOMIC_RELAXED ) ) {
+		if( done == __atomic_load_n( &worker->head, __ATOMIC_ACQUIRE ) ) {
+			/* Wait for the main thread to pass on more jobs */
+			if( read( worker->wakeup[0], buf, sizeof(buf) ) < 0 && errno != EINTR ) {
+				break;
+			}
+			continue;
+		}
+
+		auth_job_run( &worker->jobs[done & (AUTH_QUEUE_SIZE - 1)] );
+		done++;
+		__atomic_store_n( &worker->done, done, __ATOMIC_SEQ_CST );
+		auth_worker_notify();
+	}
+
+	return NULL;
+}
+
+/*
+* Get a free job slot, NULL if all queues are full.
+* Without worker threads, the job is run by auth_job_submit().
+*/
+struct auth_job_t *auth_job_get( void ) {
+	static struct auth_job_t job;
+	struct auth_worker_t *worker;
+	int i;
+
+	if( g_auth_workers_num == 0 ) {
+		return &job;
+	}
+
+	for( i = 0; i < g_auth_workers_num; i++ ) {
+		g_auth_workers_next = (g_auth_workers_next + 1) % g_auth_workers_num;
+		worker = g_auth_workers[g_auth_workers_next];
+		if( (worker->head - worker->tail) < AUTH_QUEUE_SIZE ) {
+			return &worker->jobs[worker->head & (AUTH_QUEUE_SIZE - 1)];
+		}
+	}
+
+	return NULL;
+}
+
+/* Check the verified challenge response, the result might be gone meanwhile */
+void auth_verify_challenge_done( struct auth_job_t *job ) {
+	struct results_t *results;
 	struct result_t *result;
+	IP *addr;
+
+	addr = &job->addr;
+
+	if( job->rc != 0 ) {
+		log_debug( "AUTH: Challenge response does not verify: %s", str_addr( addr ) );
+		return;
+	}
+
+	results = results_find( job->id );
+	if( results == NULL || results->pkey == NULL ) {
+		return;
+	}
+
+	result = results->entries;
+	while( result ) {
+		if( addr_equal( addr, &result->addr ) ) {
+			break;
+		}
+		result = result->next;
+	}
+
+	if( result == NULL || result->challenge == NULL ) {
+		return;
+	}
+
+	/* Check challenge */
+	if( job->outlen != CHALLENGE_BIN_LENGTH || memcmp( job->out, result->challenge, CHALLENGE_BIN_LENGTH ) != 0 ) {
+		log_debug(  "AUTH: Challenge response is invalid: %s", str_addr( addr ) );
+		return;
+	}
+
+	log_debug( "AUTH: Challenge response is valid: %s", str_addr( addr ) );
+
+	/* Other buckets and repeated searches can skip the challenge */
+	auth_verified_add( results->pkey, &result->addr, time_now_sec() + AUTH_VERIFIED_LIFETIME );
+
+	/* Mark result as verified (no challenge set) */
+	auth_challenge_cancel( result );
+	free( result->challenge );
+	result->challenge = NULL;
+	results_changed( results );
+}
+
+void auth_verify_assertion_done( struct auth_job_t *job ) {
+	struct results_t *results;
+	struct result_t *result;
+	unsigned long long expire;
+	IP endpoint;
+	UCHAR *m;
 	time_t now;
+	size_t i;
+
+	m = job->out;
+
+	if( job->rc != 0 ) {
+		log_debug( "AUTH: Assertion does not verify: %s", str_addr( &job->addr ) );
+		return;
+	}
+
+	if( job->outlen != AUTH_ASSERT_LENGTH || memcmp( m, job->id, SHA1_BIN_LENGTH ) != 0
+			|| auth_endpoint_unpack( &endpoint, m+SHA1_BIN_LENGTH ) < 0 ) {
+		log_debug( "AUTH: Assertion is invalid: %s", str_addr( &job->addr ) );
+		return;
+	}
+
+	expire = 0;
+	for( i = 0; i < 8; i++ ) {
+		expire = (expire << 8) | m[SHA1_BIN_LENGTH+AUTH_ENDPOINT_LENGTH+i];
+	}
 
 	now = time_now_sec();
+	if( expire <= (unsigned long long) now || expire > (unsigned long long) (now + AUTH_ASSERT_MAX_LIFETIME) ) {
+		log_debug( "AUTH: Assertion is expired: %s", str_addr( &job->addr ) );
+		return;
+	}
 
-	/* Send out challenges every second */
-	if( g_send_challenges < now ) {
-		g_send_challenges = now;
-	} else {
+	results = results_find( job->id );
+	if( results == NULL || results->pkey == NULL ) {
 		return;
 	}
 
-	results = results_get();
-	while( *results != NULL ) {
-		result = (*results)->entries;
-		while( result ) {
-			if( result->challenge && result->challenges_send < MAX_AUTH_CHALLENGE_SEND ) {
-				memcpy( buf, "AUTH", 4 );
-				memcpy( buf+4, (*results)->id, SHA1_BIN_LENGTH );
-				memcpy( buf+4+SHA1_BIN_LENGTH, result->challenge, CHALLENGE_BIN_LENGTH );
+	log_debug( "AUTH: Assertion is valid: %s", str_addr( &endpoint ) );
 
-				log_debug( "AUTH: Send challenge: %s", str_addr( &result->addr ) );
-				sendto( sock, buf, sizeof(buf), 0, (struct sockaddr*) &result->addr, sizeof(IP) );
+	/* Other buckets and repeated searches can skip the challenge until the assertion expires */
+	auth_verified_add( results->pkey, &endpoint, expire );
 
-				result->challenges_send++;
-			}
-			result = result->next;
+	result = results->entries;
+	while( result ) {
+		if( result->challenge && auth_endpoint_equal( &endpoint, &result->addr ) ) {
+			auth_challenge_cancel( result );
+			free( result->challenge );
+			result->challenge = NULL;
+			results_changed( results );
+			break;
 		}
-		results++;
+		result = result->next;
+	}
+}
+
+void auth_job_done( struct auth_job_t *job ) {
+	if( job->type == AUTH_JOB_CHALLENGE ) {
+		auth_verify_challenge_done( job );
+	} else if( job->type == AUTH_JOB_ASSERTION ) {
+		auth_verify_assertion_done( job );
 	}
 }
 
-/* Receive a solved challenge and verify it */
+/* Run the job of the last auth_job_get() call */
+void auth_job_submit( struct auth_job_t *job ) {
+	struct auth_worker_t *worker;
+
+	if( g_auth_workers_num == 0 ) {
+		auth_job_run( job );
+		auth_job_done( job );
+		return;
+	}
+
+	worker = g_auth_workers[g_auth_workers_next];
+	__atomic_store_n( &worker->head, worker->head + 1, __ATOMIC_RELEASE );
+
+	if( write( worker->wakeup[1], "", 1 ) < 0 ) {
+		/* The pipe is full, the worker is awake anyway */
+	}
+}
+
+/* Handle the jobs the workers have finished */
+void auth_worker_handler( int rc, int fd ) {
+	struct auth_worker_t *worker;
+	unsigned int done;
+	unsigned int tail;
+	char buf[64];
+	int i;
+
+	if( rc > 0 ) {
+		while( read( fd, buf, sizeof(buf) ) > 0 );
+	}
+
+	/*
+	* Reset before the queues are emptied, or a wakeup might get lost. Both
+	* sides store one variable and then read the other, that needs SEQ_CST.
+	*/
+	__atomic_store_n( &g_auth_wakeup_pending, 0, __ATOMIC_SEQ_CST );
+
+	for( i = 0; i < g_auth_workers_num; i++ ) {
+		worker = g_auth_workers[i];
+		done = __atomic_load_n( &worker->done, __ATOMIC_SEQ_CST );
+		tail = worker->tail;
+
+		while( tail != done ) {
+			auth_job_done( &worker->jobs[tail & (AUTH_QUEUE_SIZE - 1)] );
+			tail++;
+			__atomic_store_n( &worker->tail, tail, __ATOMIC_RELAXED );
+		}
+	}
+}
+
+/* Receive a solved challenge and pass it on to be verified */
 void auth_verify_challenge( int sock, UCHAR buf[], size_t buflen, IP *addr, time_t now ) {
-	UCHAR m[CHALLENGE_BIN_LENGTH+crypto_sign_BYTES];
-	unsigned long long smlen;
-	unsigned long long mlen;
 	struct results_t *results;
 	struct result_t *result;
-	UCHAR *id;
-	UCHAR *sm;
+	struct auth_job_t *job;
+	size_t smlen;
 
 	if( buflen < (4+SHA1_BIN_LENGTH) ) {
 		return;
 	}
 
-	id = buf+4;
-	sm = buf+4+SHA1_BIN_LENGTH;
 	smlen = buflen - (4+SHA1_BIN_LENGTH);
+	if( smlen > AUTH_JOB_IN_SIZE ) {
+		return;
+	}
 
-	results = results_find( id );
+	results = results_find( buf+4 );
 	if( results == NULL || results->pkey == NULL ) {
 		log_debug( "AUTH: No results bucket or public key found." );
 		return;
@@ -398,42 +1230,66 @@ void auth_verify_challenge( int sock, UCHAR buf[], size_t buflen, IP *addr, time
 		return;
 	}
 
-	if( crypto_sign_open( m, &mlen, sm, smlen, results->pkey ) != 0 ) {
-		log_debug(  "AUTH: Challenge response does not verify: %s", str_addr( addr ) );
+	job = auth_job_get();
+	if( job == NULL ) {
+		log_debug( "AUTH: Too many pending verifications." );
 		return;
 	}
 
-	/* Check challenge */
-	if( mlen != CHALLENGE_BIN_LENGTH || memcmp( m, result->challenge, CHALLENGE_BIN_LENGTH ) != 0 ) {
-		log_debug(  "AUTH: Challenge response is invalid: %s", str_addr( addr ) );
+	job->type = AUTH_JOB_CHALLENGE;
+	memcpy( &job->addr, addr, sizeof(IP) );
+	memcpy( job->id, buf+4, SHA1_BIN_LENGTH );
+	memcpy( job->key, results->pkey, crypto_sign_PUBLICKEYBYTES );
+	memcpy( job->in, buf+4+SHA1_BIN_LENGTH, smlen );
+	job->inlen = smlen;
+	auth_job_submit( job );
+}
+
+/*
+* Receive an assertion and pass it on to be verified. The assertion is
+* signed by the owner of the key and does not need to come from the endpoint.
+*/
+void auth_verify_assertion( int sock, UCHAR buf[], size_t buflen, IP *addr, time_t now ) {
+	struct results_t *results;
+	struct auth_job_t *job;
+
+	results = results_find( buf+4 );
+	if( results == NULL || results->pkey == NULL ) {
+		log_debug( "AUTH: No results bucket or public key found." );
 		return;
 	}
 
-	log_debug( "AUTH: Challenge response is valid: %s", str_addr( addr ) );
+	job = auth_job_get();
+	if( job == NULL ) {
+		log_debug( "AUTH: Too many pending verifications." );
+		return;
+	}
 
-	/* Mark result as verified (no challenge set) */
-	free( result->challenge );
-	result->challenge = NULL;
+	job->type = AUTH_JOB_ASSERTION;
+	memcpy( &job->addr, addr, sizeof(IP) );
+	memcpy( job->id, buf+4, SHA1_BIN_LENGTH );
+	memcpy( job->key, results->pkey, crypto_sign_PUBLICKEYBYTES );
+	memcpy( job->in, buf+4+SHA1_BIN_LENGTH, buflen-(4+SHA1_BIN_LENGTH) );
+	job->inlen = buflen-(4+SHA1_BIN_LENGTH);
+	auth_job_submit( job );
 }
 
 /* Receive a challenge and solve it using a secret key */
 void auth_receive_challenge( int sock, UCHAR buf[], size_t buflen, IP *addr, time_t now ) {
-	UCHAR outbuf[1500];
-	UCHAR sm[CHALLENGE_BIN_LENGTH+crypto_sign_BYTES];
-	UCHAR *m;
-	unsigned long long smlen;
-	unsigned long long mlen;
+	UCHAR outbuf[AUTH_ASSERT_PACKET];
 	struct value_t *value;
+	struct auth_job_t *job;
+	const UCHAR *asserted;
+	IP asserted_addr;
+	UCHAR *endpoint;
 	UCHAR *id;
 
 	/* Check if the challenge is too long */
-	if( buflen != (4+SHA1_BIN_LENGTH+CHALLENGE_BIN_LENGTH) ) {
+	if( buflen != AUTH_CHALLENGE_PACKET && buflen != AUTH_CHALLENGE_EXT_PACKET ) {
 		return;
 	}
 
 	id = buf + 4;
-	m = buf + 4 + SHA1_BIN_LENGTH;
-	mlen = CHALLENGE_BIN_LENGTH;
 
 	value = values_find( id );
 	if( value == NULL || value->skey == NULL ) {
@@ -441,17 +1297,43 @@ void auth_receive_challenge( int sock, UCHAR buf[], size_t buflen, IP *addr, tim
 		return;
 	}
 
-	/* Solve the challenge */
-	if( crypto_sign( sm, &smlen, m, mlen, value->skey ) != 0 ) {
+	/* Answer with an assertion if the endpoint is one of ours */
+	if( gconf->auth_assert_lifetime > 0 && buflen == AUTH_CHALLENGE_EXT_PACKET ) {
+		endpoint = buf + AUTH_CHALLENGE_PACKET;
+
+		if( auth_endpoint_unpack( &asserted_addr, endpoint ) == 0
+				&& ((endpoint[1] << 8) | endpoint[2]) == value->port
+				&& auth_is_local_addr( &asserted_addr ) ) {
+			asserted = auth_assert_get( value, endpoint );
+			if( asserted ) {
+				memcpy( outbuf, "AUTH", 4 );
+				memcpy( outbuf+4, id, SHA1_BIN_LENGTH );
+				memcpy( outbuf+4+SHA1_BIN_LENGTH, asserted, AUTH_ASSERT_LENGTH+crypto_sign_BYTES );
+
+				log_debug( "AUTH: Received challenge from %s and send back assertion.", str_addr( addr ) );
+				sendto( sock, outbuf, AUTH_ASSERT_PACKET, 0, (struct sockaddr*) addr, sizeof(IP) );
+				return;
+			}
+		}
+	}
+
+	/* Solve the challenge, the response is sent by the job */
+	job = auth_job_get();
+	if( job == NULL ) {
+		log_debug( "AUTH: Too many pending challenges." );
 		return;
 	}
 
-	memcpy( outbuf, "AUTH", 4 );
-	memcpy( outbuf+4, id, SHA1_BIN_LENGTH );
-	memcpy( outbuf+4+SHA1_BIN_LENGTH, sm, smlen );
+	job->type = AUTH_JOB_SIGN;
+	job->sock = sock;
+	memcpy( &job->addr, addr, sizeof(IP) );
+	memcpy( job->id, id, SHA1_BIN_LENGTH );
+	memcpy( job->key, value->skey, crypto_sign_SECRETKEYBYTES );
+	memcpy( job->in, buf + 4 + SHA1_BIN_LENGTH, CHALLENGE_BIN_LENGTH );
+	job->inlen = CHALLENGE_BIN_LENGTH;
 
 	log_debug( "AUTH: Received challenge from %s and send back response.", str_addr( addr ) );
-	sendto( sock, outbuf, 4+SHA1_BIN_LENGTH+smlen, 0, (struct sockaddr*) addr, sizeof(IP) );
+	auth_job_submit( job );
 }
 
 /*
@@ -467,23 +1349,32 @@ int auth_handle_challenges( int sock, UCHAR buf[], size_t buflen, IP *from ) {
 		return 1;
 	}
 
-	g_request_counter++;
 	now = time_now_sec();
 
+	/* Too many packets from this source */
+	if( !auth_source_allowed( from, now ) ) {
+		return 0;
+	}
+
+	/* Limit the time spent on all sources, worker threads raise the limit */
+	g_request_counter++;
+
 	/* Reset counter every second */
 	if( now > g_request_counter_started ) {
 		g_request_counter_started = now;
 		g_request_counter = 0;
 	}
 
-	/* Too many challenges */
-	if( g_request_counter > MAX_AUTH_REQUESTS ) {
+	if( g_request_counter > MAX_AUTH_REQUESTS * (size_t) (g_auth_workers_num + 1) ) {
 		return 0;
 	}
 
-	if( buflen == (4+SHA1_BIN_LENGTH+CHALLENGE_BIN_LENGTH) ) {
+	if( buflen == AUTH_CHALLENGE_PACKET || buflen == AUTH_CHALLENGE_EXT_PACKET ) {
 		/* Receive plaintext challenge / request */
 		auth_receive_challenge( sock, buf, buflen, from, now );
+	} else if( buflen == AUTH_ASSERT_PACKET ) {
+		/* Receive signed assertion / reply */
+		auth_verify_assertion( sock, buf, buflen, from, now );
 	} else {
 		/* Receive encrypted challenge / reply */
 		auth_verify_challenge( sock, buf, buflen, from, now );
@@ -492,14 +1383,89 @@ int auth_handle_challenges( int sock, UCHAR buf[], size_t buflen, IP *from ) {
 	return 0;
 }
 
+void auth_workers_setup( void ) {
+	struct auth_worker_t *worker;
+	int i;
+
+	if( pipe( g_auth_wakeup ) < 0
+			|| net_set_nonblocking( g_auth_wakeup[0] ) < 0
+			|| net_set_nonblocking( g_auth_wakeup[1] ) < 0 ) {
+		log_err( "AUTH: Failed to create pipe: %s", strerror( errno ) );
+		exit( 1 );
+	}
+
+	net_add_handler( g_auth_wakeup[0], &auth_worker_handler );
+
+	g_auth_workers_running = 1;
+	for( i = 0; i < gconf->auth_workers; i++ ) {
+		worker = (struct auth_worker_t *) calloc( 1, sizeof(struct auth_worker_t) );
+
+		/* The worker blocks on the read end */
+		if( pipe( worker->wakeup ) < 0 || net_set_nonblocking( worker->wakeup[1] ) < 0 ) {
+			log_err( "AUTH: Failed to create pipe: %s", strerror( errno ) );
+			exit( 1 );
+		}
+
+		if( pthread_create( &worker->thread, NULL, &auth_worker_loop, worker ) != 0 ) {
+			log_err( "AUTH: Failed to start worker thread." );
+			exit( 1 );
+		}
+
+		g_auth_workers[g_auth_workers_num++] = worker;
+	}
+
+	log_info( "AUTH: Sign and verify in %d worker threads", g_auth_workers_num );
+}
+
+void auth_workers_free( void ) {
+	struct auth_worker_t *worker;
+	int i;
+
+	__atomic_store_n( &g_auth_workers_running, 0, __ATOMIC_RELAXED );
+
+	for( i = 0; i < g_auth_workers_num; i++ ) {
+		worker = g_auth_workers[i];
+		if( write( worker->wakeup[1], "", 1 ) < 0 ) {
+			/* The pipe is full, the worker is awake anyway */
+		}
+		pthread_join( worker->thread, NULL );
+		close( worker->wakeup[0] );
+		close( worker->wakeup[1] );
+		free( worker );
+		g_auth_workers[i] = NULL;
+	}
+	g_auth_workers_num = 0;
+
+	if( g_auth_wakeup[1] >= 0 ) {
+		close( g_auth_wakeup[1] );
+		g_auth_wakeup[1] = -1;
+	}
+}
+
 void auth_setup( void ) {
-	/* Nothing to do */
+	/* Needed before libsodium is used by several threads */
+	if( sodium_init() < 0 ) {
+		log_err( "AUTH: Failed to initialize libsodium." );
+		exit( 1 );
+	}
+
+	if( gconf->auth_workers > 0 ) {
+		auth_workers_setup();
+	}
 }
 
 void auth_free( void ) {
 	struct key_t *cur;
 	struct key_t *next;
 
+	/* Pending jobs are dropped */
+	auth_workers_free();
+
+	auth_trie_free( &g_secret_trie );
+	auth_trie_free( &g_public_trie );
+	memset( g_secret_memo, '\0', sizeof(g_secret_memo) );
+	memset( g_public_memo, '\0', sizeof(g_public_memo) );
+
 	cur = g_secret_keys;
 	while( cur ) {
 		next = cur->next;
@@ -515,4 +1481,12 @@ void auth_free( void ) {
 		cur = next;
 	}
 	g_public_keys = NULL;
+
+	/* The results are freed later */
+	while( g_challenges_num > 0 ) {
+		auth_challenge_cancel( g_challenges[g_challenges_num - 1] );
+	}
+	free( g_challenges );
+	g_challenges = NULL;
+	g_challenges_size = 0;
 }
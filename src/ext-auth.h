@@ -22,6 +22,23 @@ UCHAR *auth_handle_pkey( UCHAR pkey[], UCHAR id[], const char query[] );
 void auth_debug_skeys( int );
 void auth_debug_pkeys( int );
 
+/*
+* Check if an address has recently answered a
+* challenge for this public key.
+*/
+int auth_verified_find( const UCHAR pkey[], const IP *addr );
+
+/* Maximum number of threads that sign and verify */
+#define AUTH_MAX_WORKERS 16
+
+/* Maximum seconds a signed assertion is accepted */
+#define AUTH_ASSERT_MAX_LIFETIME (60*60)
+
+/* Schedule or stop sending the challenge of a result address */
+struct result_t;
+void auth_challenge_schedule( struct result_t *result );
+void auth_challenge_cancel( struct result_t *result );
+
 /* Functions that are hooked up the DHT socket */
 void auth_send_challenges( int sock );
 int auth_handle_challenges( int sock, UCHAR buf[], size_t buflen, IP *from );
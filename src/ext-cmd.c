@@ -24,6 +24,9 @@
 #ifdef FWD
 #include "ext-fwd.h"
 #endif
+#ifdef DNS
+#include "ext-dns.h"
+#endif
 #include "ext-cmd.h"
 
 
@@ -35,6 +38,7 @@ const char* cmd_usage =
 	"	lookup_node <id>\n"
 #endif
 	"	announce [<query>[:<port>] [<minutes>]]\n"
+	"	announce_file\n"
 	"	import <addr>\n"
 	"	export\n"
 	"	blacklist <addr>\n";
@@ -138,6 +142,9 @@ int cmd_import( struct Reply *r, const char *addr_str) {
 
 void cmd_print_status( struct Reply *r ) {
 	r->size += kad_status( r->data + r->size, REPLY_DATA_SIZE - r->size );
+#ifdef DNS
+	r->size += dns_status( r->data + r->size, REPLY_DATA_SIZE - r->size );
+#endif
 }
 
 int cmd_blacklist( struct Reply *r, const char *addr_str ) {
@@ -307,6 +314,24 @@ int cmd_exec( struct Reply *r, int argc, char **argv ) {
 			rc = 1;
 		}
 
+	} else if( match( argv[0], "announce_file" ) && argc == 1 ) {
+
+		/* The command socket is not authenticated, only the configured file may be read */
+		if( gconf->values_file == NULL ) {
+			r_printf( r ,"No value file configured.\n" );
+			rc = 1;
+			goto end;
+		}
+
+		p = gconf->values_file;
+		count = values_load_file( p );
+		if( count < 0 ) {
+			r_printf( r ,"Failed to read file: %s\n", p );
+			rc = 1;
+		} else {
+			r_printf( r ,"Loaded %d values from: %s\n", count, p );
+		}
+
 	} else if( match( argv[0], "blacklist" ) && argc == 2 ) {
 
 		rc = cmd_blacklist( r, argv[1] );
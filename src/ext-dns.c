@@ -3,9 +3,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "main.h"
 #include "conf.h"
@@ -13,18 +16,310 @@
 #include "utils.h"
 #include "kad.h"
 #include "net.h"
+#include "results.h"
+#include "history.h"
 #include "ext-dns.h"
 
+#ifdef SO_REUSEPORT
+/* Worker threads receive queries on their own sockets bound to the DNS port */
+#define DNS_WORKERS
+#include <pthread.h>
+#include <poll.h>
+#endif
+
 #define MAX_ADDR_RECORDS 32
 
+/* Results are searched again after half their lifetime, do not let others cache longer */
+#define DNS_MAX_TTL (MAX_SEARCH_LIFETIME / 2)
+
+/* Time resolvers may cache results of a search that is still running */
+#define DNS_SEARCH_TTL 10
+
+/* Time resolvers may cache negative answers, see SOA minimum */
+#define DNS_NEGATIVE_TTL 60
+
+/* Number of cached response packets, a power of two */
+#define DNS_CACHE_SIZE 256
+
+/* UDP payload size we announce and accept with EDNS0 */
+#define DNS_EDNS_SIZE 4096
+
+/* Size of response buffers, all answers fit over TCP */
+#define DNS_BUFFER_SIZE 16384
+
+/* Maximum number of DNS over TCP connections */
+#define DNS_TCP_MAX_CONNS 32
+
+/* Seconds an idle DNS over TCP connection is kept open */
+#define DNS_TCP_IDLE 10
+
+/* Maximum number of unsent response bytes per connection */
+#define DNS_TCP_MAX_OUTPUT (256 * 1024)
+
+/* Queries a worker can hand over to the main thread, a power of two */
+#define DNS_QUEUE_SIZE 1024
+
+/* Largest query a worker hands over to the main thread */
+#define DNS_QUEUE_MSG_SIZE 1232
+
 
 int g_sock4 = -1;
 int g_sock6 = -1;
 
-/* A simple ring buffer for DNS proxy. */
-unsigned short proxy_entries_id[16] = {0};
-IP proxy_entries_addr[16] = {{0}};
-unsigned proxy_entries_count = 0;
+/*
+* Encoded responses for (qName, qType) pairs. An entry is only used as
+* long as the results bucket it was created from has not changed.
+*/
+struct dns_cache_t {
+	char qName[300];
+	unsigned short qType;
+	/* Id and version of the results bucket */
+	UCHAR id[SHA1_BIN_LENGTH];
+	unsigned int version;
+	time_t expire;
+	UCHAR *data;
+	size_t data_len;
+	/* Positions of the TTL fields in data */
+	unsigned short ttl_offsets[MAX_ADDR_RECORDS*2 + 1];
+	size_t ttl_num;
+	/* Answered since the lookup was last counted, also set by worker threads */
+	int used;
+};
+
+static struct dns_cache_t g_dns_cache[DNS_CACHE_SIZE];
+
+/* Maximum number of queries waiting for results */
+#define DNS_MAX_PENDING 64
+
+/* A query waiting for search results */
+struct dns_pending_t {
+	int sock; /* -1 if the slot is unused */
+	IP clientaddr;
+	unsigned short id;
+	char qName[300];
+	unsigned short qType;
+	unsigned short qClass;
+	unsigned short rd;
+	unsigned short edns;
+	size_t limit;
+	time_t deadline;
+};
+
+static struct dns_pending_t g_dns_pending[DNS_MAX_PENDING];
+
+/* A DNS over TCP connection, messages are prefixed by their length */
+struct dns_tcp_t {
+	int fd; /* -1 if the slot is unused */
+	IP clientaddr;
+	time_t last;
+	UCHAR in[2 + DNS_EDNS_SIZE];
+	size_t in_len;
+	UCHAR *out;
+	size_t out_len;
+	size_t out_size;
+	/* Delay sending while a batch of queries is handled */
+	int busy;
+	/* Wait for the socket to become writable */
+	int writing;
+};
+
+static struct dns_tcp_t g_dns_tcp[DNS_TCP_MAX_CONNS];
+
+/* Listening DNS over TCP sockets */
+static int g_tcp_sock4 = -1;
+static int g_tcp_sock6 = -1;
+
+/* Number of responses sent for each response code */
+static unsigned long g_dns_rcode_count[6];
+
+/* Number of responses without error, but also without answers */
+static unsigned long g_dns_nodata_count;
+
+/* Number of responses with the extended response code BADVERS */
+static unsigned long g_dns_badvers_count;
+
+/* Number of client networks tracked for rate limiting, a power of two */
+#define DNS_RRL_SIZE 4096
+
+/* Every n-th response over the limit is sent truncated instead of being dropped */
+#define DNS_RRL_SLIP 2
+
+enum {
+	RRL_SEND,
+	RRL_DROP,
+	RRL_TRUNCATE
+};
+
+/* Rate limit state of a client network (IPv4 /24, IPv6 /56) */
+struct dns_rrl_t {
+	UCHAR prefix[8];
+	time_t time;
+	/* Responses and new searches left in this second */
+	int responses;
+	int searches;
+	unsigned int slip;
+};
+
+/*
+* Fixed size table, a network that hashes to a used slot takes it over.
+* Each table is only written by the thread that owns it, other threads
+* only read the counters.
+*/
+struct dns_rrl_table_t {
+	struct dns_rrl_t entries[DNS_RRL_SIZE];
+	unsigned long dropped;
+	unsigned long slipped;
+	unsigned long refused;
+};
+
+static struct dns_rrl_table_t g_dns_rrl;
+
+#ifdef DNS_WORKERS
+/* A query a worker could not answer from the caches */
+struct dns_queue_slot_t {
+	int sock;
+	IP clientaddr;
+	size_t len;
+	UCHAR data[DNS_QUEUE_MSG_SIZE];
+};
+
+/*
+* A thread that answers cached queries. Other queries are passed to the main
+* thread through a single producer, single consumer ring: head is only written
+* by the worker and tail only by the main thread.
+*/
+struct dns_worker_t {
+	pthread_t thread;
+	int sock4;
+	int sock6;
+	unsigned int head;
+	unsigned int tail;
+	struct dns_queue_slot_t slots[DNS_QUEUE_SIZE];
+	/* Rate limits for cached responses, separate from the main thread */
+	struct dns_rrl_table_t rrl;
+	/* Statistics, only written by the worker */
+	unsigned long queries;
+	unsigned long hits;
+	unsigned long forwarded;
+	unsigned long dropped;
+};
+
+static struct dns_worker_t *g_dns_workers[DNS_MAX_WORKERS];
+static int g_dns_workers_num = 0;
+static int g_dns_workers_running = 0;
+
+/* Workers wake up the main thread by writing to this pipe */
+static int g_dns_wakeup[2] = { -1, -1 };
+static int g_dns_wakeup_pending = 0;
+
+/* Queries per second received by all workers */
+static unsigned long g_dns_workers_qps = 0;
+
+/* Protects both caches, workers only read them */
+static pthread_rwlock_t g_dns_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/* Maximum number of external DNS servers */
+#define PROXY_MAX_SERVERS 8
+
+/* Maximum number of forwarded queries waiting for a response */
+#define PROXY_MAX_REQUESTS 4096
+
+/* Number of hash table buckets for forwarded queries, a power of two */
+#define PROXY_HASH_SIZE 4096
+
+/* Milliseconds to wait for an external DNS server before trying the next one */
+#define PROXY_TIMEOUT 1500
+
+/* Upper limit for the round trip time penalty of a server */
+#define PROXY_MAX_RTT (10 * PROXY_TIMEOUT)
+
+/* Maximum number of servers a query is sent to */
+#define PROXY_MAX_TRIES 3
+
+/* External DNS server */
+struct proxy_server_t {
+	IP addr;
+	/* Smoothed round trip time in milliseconds, 0 if not measured yet */
+	unsigned int srtt;
+	/* Time of the first query without response, zero if none */
+	struct timeval unanswered;
+	unsigned long sent;
+	unsigned long answered;
+	unsigned long timeouts;
+};
+
+/*
+* A query forwarded to an external DNS server. The query is sent
+* with a new id and found again by that id and the question name.
+*/
+struct proxy_request_t {
+	/* Next entry in the hash bucket */
+	struct proxy_request_t *next;
+	/* List ordered by deadline */
+	struct proxy_request_t *prev_sent;
+	struct proxy_request_t *next_sent;
+	unsigned short txid;
+	unsigned short id;
+	char qName[300];
+	unsigned short qType;
+	unsigned short qClass;
+	unsigned short rd;
+	int edns;
+	int sock;
+	IP clientaddr;
+	/* Index of the current server and bitmask of all tried servers */
+	int server;
+	unsigned int tried;
+	int tries;
+	struct timeval sent;
+	UCHAR *query;
+	size_t query_len;
+};
+
+static struct proxy_server_t g_proxy_servers[PROXY_MAX_SERVERS];
+static size_t g_proxy_servers_num = 0;
+
+static struct proxy_request_t *g_proxy_table[PROXY_HASH_SIZE];
+static struct proxy_request_t *g_proxy_oldest = NULL;
+static struct proxy_request_t *g_proxy_newest = NULL;
+static size_t g_proxy_count = 0;
+
+/*
+* Answers of external DNS servers for (qName, qType, qClass)
+* in a hash table and a least recently used list.
+*/
+struct proxy_cache_t {
+	/* Next entry in the hash bucket */
+	struct proxy_cache_t *next;
+	struct proxy_cache_t *prev_used;
+	struct proxy_cache_t *next_used;
+	char qName[300];
+	unsigned short qType;
+	unsigned short qClass;
+	/* The query had an EDNS0 record, so has the response */
+	int edns;
+	/* Set by cache hits */
+	int used;
+	time_t expire;
+	UCHAR *data;
+	size_t data_len;
+	/* Positions of the TTL fields in data */
+	unsigned short ttl_offsets[MAX_ADDR_RECORDS*2];
+	size_t ttl_num;
+};
+
+static struct proxy_cache_t **g_proxy_cache_table = NULL;
+static size_t g_proxy_cache_table_size = 0;
+static struct proxy_cache_t *g_proxy_cache_newest = NULL;
+static struct proxy_cache_t *g_proxy_cache_oldest = NULL;
+static size_t g_proxy_cache_count = 0;
+static unsigned long g_proxy_cache_hits = 0;
+static unsigned long g_proxy_cache_misses = 0;
+
+/* Sockets to talk to external DNS servers */
+static int g_proxy_sock4 = -1;
+static int g_proxy_sock6 = -1;
 
 /*
 * DNS-Server interface for KadNode.
@@ -37,7 +332,7 @@ enum {
 	AA_MASK = 0x0400,
 	TC_MASK = 0x0200,
 	RD_MASK = 0x0100,
-	RA_MASK = 0x8000,
+	RA_MASK = 0x0080,
 	RCODE_MASK = 0x000F
 };
 
@@ -61,7 +356,8 @@ enum {
 	MX_Resource_RecordType = 15,
 	TXT_Resource_RecordType = 16,
 	AAAA_Resource_RecordType = 28,
-	SRV_Resource_RecordType = 33
+	SRV_Resource_RecordType = 33,
+	OPT_Resource_RecordType = 41
 };
 
 /* Operation Code */
@@ -78,7 +374,8 @@ enum {
 	NoError_ResponseCode = 0,
 	FormatError_ResponseCode = 1,
 	ServerFailure_ResponseCode = 2,
-	NameError_ResponseCode = 3
+	NameError_ResponseCode = 3,
+	BadVersion_ResponseCode = 16 /* extended response code of EDNS0 */
 };
 
 /* Query Type */
@@ -121,6 +418,15 @@ union ResourceData {
 	struct {
 		unsigned char addr[16];
 	} aaaa_record;
+	struct {
+		const char *mname;
+		const char *rname;
+		unsigned int serial;
+		unsigned int refresh;
+		unsigned int retry;
+		unsigned int expire;
+		unsigned int minimum;
+	} soa_record;
 	struct {
 		unsigned short priority;
 		unsigned short weight;
@@ -134,7 +440,7 @@ struct ResourceRecord {
 	const char *name;
 	unsigned short type;
 	unsigned short class;
-	unsigned short ttl;
+	unsigned int ttl;
 	unsigned short rd_length;
 	union ResourceData rd_data;
 };
@@ -156,20 +462,28 @@ struct Message {
 	unsigned short nsCount; /* Authority Record Count */
 	unsigned short arCount; /* Additional Record Count */
 
+	/* The query has an EDNS0 record with the UDP payload size of the client */
+	unsigned short edns;
+	unsigned short edns_size;
+	unsigned short edns_version;
+
+	/* Maximum size of the response for the transport used */
+	size_t limit;
+
 	/* We only handle one question and multiple answers */
 	struct Question question;
-	struct ResourceRecord answers[MAX_ADDR_RECORDS*2];
+	/* Addresses and SRV records, one authority record */
+	struct ResourceRecord answers[MAX_ADDR_RECORDS*2 + 1];
 
 	/* Buffer for the qName part */
 	char qName_buffer[300];
 };
 
-/* Placeholder names to link together SRV and A/AAAA records */
-static const char g_names[MAX_ADDR_RECORDS][3] = {
-	"01", "02", "03", "04", "05", "06", "07", "08",
-	"09", "10", "11", "12", "13", "14", "15", "16",
-	"17", "18", "19", "20", "21", "22", "23", "24",
-	"25", "26", "27", "28", "29", "30", "31", "32"
+/* Names written to a message that later names can point to */
+struct dns_names_t {
+	const UCHAR *msg;
+	unsigned short offsets[4 * MAX_ADDR_RECORDS];
+	size_t num;
 };
 
 /*
@@ -184,13 +498,22 @@ size_t get16bits( const UCHAR** buffer ) {
 	return value;
 }
 
+unsigned int get32bits( const UCHAR** buffer ) {
+	unsigned int value;
+
+	value = ntohl( *((unsigned int *) *buffer) );
+	*buffer += 4;
+
+	return value;
+}
+
 void put16bits( UCHAR** buffer, unsigned short value ) {
 	*((unsigned short *) *buffer) = htons( value );
 	*buffer += 2;
 }
 
-void put32bits( UCHAR** buffer, unsigned long long value ) {
-	*((unsigned long long *) *buffer) = htonl( value );
+void put32bits( UCHAR** buffer, unsigned int value ) {
+	*((unsigned int *) *buffer) = htonl( value );
 	*buffer += 4;
 }
 
@@ -199,20 +522,45 @@ void put32bits( UCHAR** buffer, unsigned long long value ) {
 * Decoding/Encoding functions
 */
 
-/* 3foo3bar3com0 => foo.bar.com */
-int dns_decode_domain( char *domain, const UCHAR** buffer, size_t size ) {
+/* Skip a (compressed) name, returns NULL if it does not end before end */
+const UCHAR *dns_skip_domain( const UCHAR *p, const UCHAR *end ) {
+	while( p < end ) {
+		if( (*p & 0xC0) == 0xC0 ) {
+			return p + 2;
+		} else if( *p == 0 ) {
+			return p + 1;
+		}
+		p += *p + 1;
+	}
+	return NULL;
+}
+
+/* 3foo3bar3com0 => foo.bar.com, the name must end before end */
+int dns_decode_domain( char *domain, const UCHAR** buffer, size_t size, const UCHAR *end ) {
 	const UCHAR *p = *buffer;
 	size_t i = 0;
 	size_t len = 0;
 
-	while( *p != '\0' ) {
+	while( 1 ) {
+		if( p >= end ) {
+			return -1;
+		}
+
+		if( *p == '\0' ) {
+			break;
+		}
+
+		/* Labels are shorter than 64 bytes, larger values are compression flags */
+		len = *p;
+		if( len >= 64 || (p + 1 + len) > end ) {
+			return -1;
+		}
 
 		if( i != 0 ) {
 			domain[i] = '.';
 			i += 1;
 		}
 
-		len = *p;
 		p += 1;
 
 		if( (i + len) >= size ) {
@@ -232,37 +580,76 @@ int dns_decode_domain( char *domain, const UCHAR** buffer, size_t size ) {
 	return 1;
 }
 
-/* foo.bar.com => 3foo3bar3com0 */
-int dns_encode_domain( UCHAR** buffer, const char *domain ) {
-	char *buf = (char*) *buffer;
-	const char *beg = domain;
-	const char *pos = NULL;
-	size_t len = strlen( domain );
-	size_t plen = 0;
-	size_t i = 0;
+/* Compare the (compressed) name at offset of a message with a domain */
+int dns_name_match( const UCHAR *msg, size_t offset, const char *domain ) {
+	const UCHAR *p = msg + offset;
+	const char *dot;
+	size_t len;
+
+	while( 1 ) {
+		if( (*p & 0xC0) == 0xC0 ) {
+			/* Pointers of our own messages only point backwards */
+			p = msg + (((p[0] & 0x3F) << 8) | p[1]);
+			continue;
+		}
+
+		if( *p == 0 ) {
+			return (*domain == '\0');
+		}
 
-	while( (pos = strchr(beg, '.')) != NULL ) {
-		plen = pos - beg;
-		buf[i] = plen;
-		i += 1;
-		memcpy( buf + i, beg, plen );
-		i += plen;
+		dot = strchr( domain, '.' );
+		len = dot ? (dot - domain) : strlen( domain );
+		if( len != *p || strncasecmp( domain, (const char*) p + 1, len ) != 0 ) {
+			return 0;
+		}
 
-		beg = pos + 1;
+		domain += dot ? (len + 1) : len;
+		p += *p + 1;
 	}
+}
+
+/*
+* foo.bar.com => 3foo3bar3com0
+* The longest suffix that was already written to the message
+* is replaced by a pointer (RFC 1035 4.1.4).
+*/
+int dns_encode_domain( UCHAR** buffer, const char *domain, struct dns_names_t *names ) {
+	UCHAR *p = *buffer;
+	const char *label = domain;
+	const char *dot;
+	size_t offset;
+	size_t len;
+	size_t i;
 
-	plen = len - (beg - domain);
+	while( *label != '\0' ) {
+		for( i = 0; i < names->num; i++ ) {
+			if( dns_name_match( names->msg, names->offsets[i], label ) ) {
+				put16bits( &p, (3 << 14) + names->offsets[i] );
+				*buffer = p;
+				return 1;
+			}
+		}
 
-	buf[i] = plen;
-	i += 1;
+		/* Pointers can only reference the first 16K of a message */
+		offset = p - names->msg;
+		if( names->num < N_ELEMS(names->offsets) && offset < (1 << 14) ) {
+			names->offsets[names->num++] = offset;
+		}
 
-	memcpy( buf + i, beg, plen );
-	i += plen;
+		dot = strchr( label, '.' );
+		len = dot ? (dot - label) : strlen( label );
+		if( len == 0 || len > 63 ) {
+			return -1;
+		}
 
-	buf[i] = '\0';
-	i += 1;
+		*p++ = len;
+		memcpy( p, label, len );
+		p += len;
+		label += dot ? (len + 1) : len;
+	}
 
-	*buffer += i;
+	*p++ = '\0';
+	*buffer = p;
 
 	return 1;
 }
@@ -275,6 +662,10 @@ int dns_encode_header( UCHAR** buffer, const struct Message *msg ) {
 	/* Set Flags - Most fields are omitted */
 	fields = 0;
 	fields |= (msg->qr << 15) & QR_MASK;
+	fields |= (msg->opcode << 11) & OPCODE_MASK;
+	fields |= (msg->aa << 10) & AA_MASK;
+	fields |= (msg->rd << 8) & RD_MASK;
+	fields |= (msg->ra << 7) & RA_MASK;
 	fields |= (msg->rcode << 0) & RCODE_MASK;
 	put16bits( buffer, fields );
 
@@ -307,109 +698,167 @@ int dns_decode_header( struct Message *msg, const UCHAR** buffer ) {
 	return 1;
 }
 
+int dns_is_supported( int qType ) {
+	return qType == A_Resource_RecordType
+		|| qType == AAAA_Resource_RecordType
+		|| qType == SRV_Resource_RecordType
+		|| qType == PTR_Resource_RecordType;
+}
+
 /* Decode the message from a byte array into a message structure */
-int dns_decode_msg( struct Message *msg, const UCHAR *buffer ) {
+int dns_decode_msg( struct Message *msg, const UCHAR *buffer, size_t size ) {
+	const UCHAR *end = buffer + size;
+	char name[300];
+	size_t rrCount;
+	size_t rdLength;
+	unsigned int ttl;
+	int found;
+	int type;
 	size_t i;
 
-	if( dns_decode_header( msg, &buffer ) < 0 ) {
+	if( size < 12 || dns_decode_header( msg, &buffer ) < 0 ) {
 		return -1;
 	}
 
-	/* Parse questions - but stop after the first question we can handle */
+	if( msg->qdCount == 0 ) {
+		return -1;
+	}
+
+	/*
+	* Parse questions - but keep the first question we can handle.
+	* Otherwise keep the type of the first question.
+	*/
+	found = 0;
 	for( i = 0; i < msg->qdCount; ++i ) {
-		if( dns_decode_domain( msg->qName_buffer, &buffer, 300 ) < 0 ) {
+		if( dns_decode_domain( name, &buffer, sizeof(name), end ) < 0 || (buffer + 4) > end ) {
 			return -1;
 		}
 
 		int qType = get16bits( &buffer );
 		int qClass = get16bits( &buffer );
 
-		if( qType == A_Resource_RecordType
-			|| qType == AAAA_Resource_RecordType
-			|| qType == SRV_Resource_RecordType
-			|| qType == PTR_Resource_RecordType
-		) {
+		if( !found && (i == 0 || dns_is_supported( qType )) ) {
+			memcpy( msg->qName_buffer, name, sizeof(name) );
 			msg->question.qName = msg->qName_buffer;
 			msg->question.qType = qType;
 			msg->question.qClass = qClass;
-			return 1;
+			found = dns_is_supported( qType );
 		}
 	}
 
-	log_warn( "DNS: No question for A, AAAA, SRV or PTR resource found in query." );
-	return -1;
+	/* Skip answer and authority records, look for an OPT record in the additional section */
+	rrCount = msg->anCount + msg->nsCount + msg->arCount;
+	for( i = 0; i < rrCount; i++ ) {
+		if( (buffer = dns_skip_domain( buffer, end )) == NULL || (buffer + 10) > end ) {
+			return -1;
+		}
+
+		type = get16bits( &buffer );
+		if( type == OPT_Resource_RecordType && i >= (msg->anCount + msg->nsCount) ) {
+			msg->edns = 1;
+			msg->edns_size = get16bits( &buffer );
+			ttl = get32bits( &buffer );
+			msg->edns_version = (ttl >> 16) & 0xFF;
+		} else {
+			buffer += 6;
+		}
+
+		rdLength = get16bits( &buffer );
+		if( (buffer + rdLength) > end ) {
+			return -1;
+		}
+		buffer += rdLength;
+	}
+
+	if( !found ) {
+		log_debug( "DNS: No question for A, AAAA, SRV or PTR resource found in query." );
+	}
+
+	return 1;
 }
 
 /* Encode the message structure into a byte array */
 int dns_encode_msg( UCHAR *buffer, size_t size, const struct Message *msg ) {
-	const size_t qName_offset = 12;
 	const struct ResourceRecord *rr;
+	struct dns_names_t names;
+	UCHAR *rd_length;
 	UCHAR *beg;
 	size_t i;
 
 	beg = buffer;
+	names.msg = beg;
+	names.num = 0;
+
 	if( dns_encode_header( &buffer, msg ) < 0 ) {
 		return -1;
 	}
 
 	/* Attach a single question section. */
-	if( dns_encode_domain( &buffer, msg->question.qName ) < 0 ) {
-		return -1;
-	}
+	if( msg->qdCount > 0 ) {
+		if( dns_encode_domain( &buffer, msg->question.qName, &names ) < 0 ) {
+			return -1;
+		}
 
-	put16bits( &buffer, msg->question.qType );
-	put16bits( &buffer, msg->question.qClass );
+		put16bits( &buffer, msg->question.qType );
+		put16bits( &buffer, msg->question.qClass );
+	}
 
 	/* Attach multiple resource records. */
 	const size_t count = msg->anCount + msg->nsCount + msg->arCount;
 	for( i = 0; i < count; i++ ) {
 		rr = &msg->answers[i];
 
-		if( msg->question.qName == rr->name ) {
-			/* Reference qName in question section (message compression) */
-			put16bits( &buffer, (3 << 14) + qName_offset );
-		} else {
-			if( dns_encode_domain( &buffer, rr->name ) < 0 ) {
-				return -1;
-			}
+		if( dns_encode_domain( &buffer, rr->name, &names ) < 0 ) {
+			return -1;
 		}
 
 		put16bits( &buffer, rr->type );
 		put16bits( &buffer, rr->class );
 		put32bits( &buffer, rr->ttl );
-		put16bits( &buffer, rr->rd_length ); /* already accounts for encoded data */
+
+		/* Set below, names in the data might be compressed */
+		rd_length = buffer;
+		buffer += 2;
 
 		if( rr->type == SRV_Resource_RecordType ) {
 			put16bits( &buffer, rr->rd_data.srv_record.priority );
 			put16bits( &buffer, rr->rd_data.srv_record.weight );
 			put16bits( &buffer, rr->rd_data.srv_record.port );
-			if( dns_encode_domain( &buffer, rr->rd_data.srv_record.target ) < 0 ) {
+			if( dns_encode_domain( &buffer, rr->rd_data.srv_record.target, &names ) < 0 ) {
 				return -1;
 			}
 		} else if( rr->type == PTR_Resource_RecordType ) {
-			if( dns_encode_domain( &buffer, rr->rd_data.ptr_record.name ) < 0 ) {
+			if( dns_encode_domain( &buffer, rr->rd_data.ptr_record.name, &names ) < 0 ) {
+				return -1;
+			}
+		} else if( rr->type == NS_Resource_RecordType ) {
+			if( dns_encode_domain( &buffer, rr->rd_data.name_server_record.name, &names ) < 0 ) {
+				return -1;
+			}
+		} else if( rr->type == SOA_Resource_RecordType ) {
+			if( dns_encode_domain( &buffer, rr->rd_data.soa_record.mname, &names ) < 0 ) {
+				return -1;
+			}
+			if( dns_encode_domain( &buffer, rr->rd_data.soa_record.rname, &names ) < 0 ) {
 				return -1;
 			}
+			put32bits( &buffer, rr->rd_data.soa_record.serial );
+			put32bits( &buffer, rr->rd_data.soa_record.refresh );
+			put32bits( &buffer, rr->rd_data.soa_record.retry );
+			put32bits( &buffer, rr->rd_data.soa_record.expire );
+			put32bits( &buffer, rr->rd_data.soa_record.minimum );
 		} else {
 			/* Assume A/AAAA address record data */
 			memcpy( buffer, &rr->rd_data, rr->rd_length );
 			buffer += rr->rd_length;
 		}
+
+		put16bits( &rd_length, buffer - rd_length - 2 );
 	}
 
 	return (buffer - beg);
 }
 
-int kadnode_lookup_addr( const char hostname[], IP addr[], size_t addr_num ) {
-
-	/* Start lookup for one address */
-	if( kad_lookup_value( hostname, addr, &addr_num ) >= 0 && addr_num > 0 ) {
-		return addr_num;
-	} else {
-		return 0;
-	}
-}
-
 const char* dns_lookup_ptr( const char ptr_name[] ) {
 	typedef struct {
 		const char* ptr_name;
@@ -431,13 +880,13 @@ const char* dns_lookup_ptr( const char ptr_name[] ) {
 	return NULL;
 }
 
-void setAddressRecord( struct ResourceRecord *rr, const char name[], const IP *addr ) {
+void setAddressRecord( struct ResourceRecord *rr, const char name[], const IP *addr, int ttl ) {
 
 	if( addr->ss_family == AF_INET ) {
 		rr->name = name;
 		rr->type = A_Resource_RecordType;
 		rr->class = 1;
-		rr->ttl = 0; /* no caching */
+		rr->ttl = ttl;
 		rr->rd_length = 4;
 
 		memcpy( rr->rd_data.a_record.addr, &((IP4 *)addr)->sin_addr, 4 );
@@ -445,38 +894,110 @@ void setAddressRecord( struct ResourceRecord *rr, const char name[], const IP *a
 		rr->name = name;
 		rr->type = AAAA_Resource_RecordType;
 		rr->class = 1;
-		rr->ttl = 0; /* no caching */
+		rr->ttl = ttl;
 		rr->rd_length = 16;
 
 		memcpy( rr->rd_data.aaaa_record.addr, &((IP6 *)addr)->sin6_addr, 16 );
 	}
 }
 
-void setServiceRecord( struct ResourceRecord *rr, const char name[], const char target[], int port ) {
+void setServiceRecord( struct ResourceRecord *rr, const char name[], const char target[], int port, int priority, int weight, int ttl ) {
 	rr->name = name;
 	rr->type = SRV_Resource_RecordType;
 	rr->class = 1;
-	rr->ttl = 0; /* no caching */
-	rr->rd_length = 6 + strlen( target ) + 2; /* encoded target will be +2 longer */
+	rr->ttl = ttl;
+	rr->rd_length = 6 + strlen( target ) + 2; /* at most, the target might be compressed */
 
-	rr->rd_data.srv_record.priority = 0;
-	rr->rd_data.srv_record.weight = 0;
+	rr->rd_data.srv_record.priority = priority;
+	rr->rd_data.srv_record.weight = weight;
 	rr->rd_data.srv_record.port = port;
 	rr->rd_data.srv_record.target = target;
 }
 
-void setPointerRecord( struct ResourceRecord *rr, const char name[], const char domain[] ) {
+void setPointerRecord( struct ResourceRecord *rr, const char name[], const char domain[], int ttl ) {
 	rr->name = name;
 	rr->type = PTR_Resource_RecordType;
 	rr->class = 1;
-	rr->ttl = 0; /* no caching */
-	rr->rd_length = strlen( domain ) + 2; /* encoded target will be +2 longer */
+	rr->ttl = ttl;
+	rr->rd_length = strlen( domain ) + 2; /* at most, the domain might be compressed */
 
 	rr->rd_data.ptr_record.name = domain;
 }
 
-int dns_setup_msg( struct Message *msg, IP addrs[], size_t addrs_num, const char* hostname ) {
+/* Zone apex, e.g. "p2p" for ".p2p" */
+const char *dns_zone( void ) {
+	const char *tld = gconf->query_tld;
+	return (tld[0] == '.') ? (tld + 1) : tld;
+}
+
+/* The name server of the zone is always the local host */
+#define DNS_ZONE_NS "localhost"
+
+/* Synthesized SOA record of the zone, allows resolvers to cache negative answers */
+void setAuthorityRecord( struct ResourceRecord *rr ) {
+	static const char mname[] = DNS_ZONE_NS;
+	static char rname[300];
+	const char *zone;
+
+	zone = dns_zone();
+	snprintf( rname, sizeof(rname), "hostmaster.%s", zone );
+
+	rr->name = zone;
+	rr->type = SOA_Resource_RecordType;
+	rr->class = 1;
+	rr->ttl = DNS_NEGATIVE_TTL;
+	rr->rd_length = (strlen( mname ) + 2) + (strlen( rname ) + 2) + 5 * 4;
+
+	rr->rd_data.soa_record.mname = mname;
+	rr->rd_data.soa_record.rname = rname;
+	rr->rd_data.soa_record.serial = 1;
+	rr->rd_data.soa_record.refresh = 3600;
+	rr->rd_data.soa_record.retry = 600;
+	rr->rd_data.soa_record.expire = 86400;
+	rr->rd_data.soa_record.minimum = DNS_NEGATIVE_TTL;
+}
+
+/* NS record of the zone, only used in authoritative mode */
+void setNameServerRecord( struct ResourceRecord *rr ) {
+	rr->name = dns_zone();
+	rr->type = NS_Resource_RecordType;
+	rr->class = 1;
+	rr->ttl = DNS_MAX_TTL;
+	rr->rd_length = strlen( DNS_ZONE_NS ) + 2; /* at most */
+
+	rr->rd_data.name_server_record.name = DNS_ZONE_NS;
+}
+
+/*
+* Map the probe state of an address to SRV priority and weight.
+* Reachable addresses get the lowest priority value and a weight
+* that decreases with the round trip time.
+*/
+void dns_srv_rank( const IP *addr, int *priority, int *weight ) {
+	int state;
+	int rtt;
+
+	state = results_probe_state( addr, &rtt );
+
+	if( state == PROBE_ALIVE ) {
+		*priority = 0;
+		*weight = 10000 / (10 + ((rtt > 0) ? rtt : 0));
+	} else if( state == PROBE_DEAD ) {
+		*priority = 2;
+		*weight = 0;
+	} else {
+		*priority = 1;
+		*weight = 0;
+	}
+}
+
+int dns_setup_msg( struct Message *msg, IP addrs[], size_t addrs_num, const char* hostname, int ttl ) {
+	/* SRV targets like a.<qName> are encoded as one label and a pointer */
+	static const char labels[MAX_ADDR_RECORDS + 1] = "0123456789abcdefghijklmnopqrstuv";
+	static char targets[MAX_ADDR_RECORDS][300];
 	const char *qName;
+	int priority;
+	int weight;
 	size_t i, c;
 
 	/* Header: leave most values intact for response */
@@ -495,203 +1016,2274 @@ int dns_setup_msg( struct Message *msg, IP addrs[], size_t addrs_num, const char
 	if( msg->question.qType == SRV_Resource_RecordType ) {
 		for( i = 0; i < addrs_num; i++, c++ ) {
 			int port = addr_port( &addrs[i] );
-			setServiceRecord( &msg->answers[c], qName, g_names[i], port );
+			dns_srv_rank( &addrs[i], &priority, &weight );
+			snprintf( targets[i], sizeof(targets[i]), "%c.%s", labels[i], qName );
+			setServiceRecord( &msg->answers[c], qName, targets[i], port, priority, weight, ttl );
 			msg->anCount++;
 		}
 
 		for( i = 0; i < addrs_num; i++, c++ ) {
-			setAddressRecord( &msg->answers[c], g_names[i], &addrs[i] );
+			setAddressRecord( &msg->answers[c], targets[i], &addrs[i], ttl );
 			msg->anCount++;
 		}
 	} else if( msg->question.qType == PTR_Resource_RecordType ) {
-		setPointerRecord( &msg->answers[c], qName, hostname );
+		setPointerRecord( &msg->answers[c], qName, hostname, ttl );
 		msg->anCount++;
 		c++;
 	} else {
 		/* Assume AAAA or A Record Type */
 		for( i = 0; i < addrs_num; i++, c++ ) {
-			setAddressRecord( &msg->answers[c], qName, &addrs[i] );
+			setAddressRecord( &msg->answers[c], qName, &addrs[i], ttl );
 			msg->anCount++;
 		}
 	}
 
-	return (c == 0) ? -1 : 1;
-}
-
-/* Get a small string representation of the query type */
-const char* qtype_str( int qType ) {
-	switch( qType ) {
-		case A_Resource_RecordType:
-			return "A";
-		case AAAA_Resource_RecordType:
-			return "AAAA";
-		case SRV_Resource_RecordType:
-			return "SRV";
-		case PTR_Resource_RecordType:
-			return "PTR";
-		default:
-			return "???";
+	/* Name the authority of the zone */
+	if( gconf->dns_authoritative && c > 0 && msg->question.qType != PTR_Resource_RecordType ) {
+		setNameServerRecord( &msg->answers[c] );
+		msg->nsCount++;
+		c++;
 	}
+
+	return (c == 0) ? -1 : 1;
 }
 
-/* Forward request to external DNS server */
-void proxy_forward_request( UCHAR *buffer, ssize_t buflen, IP *clientaddr, unsigned short id ) {
-	int sock;
+/*
+* Time others may cache the answer. Results of a finished search
+* are valid until they are searched again, a running search might
+* still find more.
+*/
+int dns_results_ttl( const struct results_t *results ) {
+	time_t ttl;
 
-	sock = (gconf->dns_server_addr.ss_family == AF_INET) ? g_sock4 : g_sock6;
-	if( sendto( sock, buffer, buflen, 0, (struct sockaddr*) &gconf->dns_server_addr, sizeof(IP) ) < 0 ) {
-		log_warn( "DNS: Failed to send request to dns server %s", str_addr( &gconf->dns_server_addr ) );
-		return;
+	if( results == NULL ) {
+		return 0;
 	}
 
-	/* Remember DNS request id and client address */
-	proxy_entries_id[proxy_entries_count] = id;
-	proxy_entries_addr[proxy_entries_count] = *clientaddr;
-	proxy_entries_count = (proxy_entries_count + 1) % N_ELEMS(proxy_entries_id);
-}
+	if( !results->done ) {
+		return DNS_SEARCH_TTL;
+	}
 
-/* Forward DNS response back to client address */
-void proxy_forward_response( UCHAR *buffer, ssize_t buflen, unsigned short id ) {
-	int sock;
-	int i;
+	ttl = results->start_time + (MAX_SEARCH_LIFETIME / 2) - time_now_sec();
 
-	for ( i = 0; i < N_ELEMS(proxy_entries_id); ++i ) {
-		if( proxy_entries_id[i] == id ) {
-			sock = (proxy_entries_addr[i].ss_family == AF_INET) ? g_sock4 : g_sock6;
-			if( sendto( sock, buffer, buflen, 0, (struct sockaddr*) &proxy_entries_addr[i], sizeof(IP) ) < 0 ) {
-				/* Ignore failure, client may went down */
-			}
-			return;
-		}
+	if( ttl < 0 ) {
+		return 0;
+	} else if( ttl > DNS_MAX_TTL ) {
+		return DNS_MAX_TTL;
+	} else {
+		return ttl;
 	}
-
-	log_warn( "DNS: Failed to find client for request." );
 }
 
-void dns_handler( int rc, int sock ) {
-	struct Message msg;
-	IP clientaddr;
-	size_t addrs_num;
-	IP addrs[MAX_ADDR_RECORDS];
-	socklen_t addrlen_ret;
-	ssize_t buflen;
-	UCHAR buffer[1472];
-	const char *hostname;
-	const char *domain;
+/* Find the positions of all TTL fields in an encoded message, OPT records have none */
+int dns_find_ttls( const UCHAR *buffer, size_t size, unsigned short offsets[], size_t offsets_num ) {
+	const UCHAR *end = buffer + size;
+	const UCHAR *p = buffer;
+	size_t qdCount, rrCount;
+	size_t rdLength;
+	size_t ttl_num;
+	size_t i;
+	int type;
 
-	if( rc == 0 ) {
-		return;
+	if( size < 12 ) {
+		return -1;
 	}
 
-	memset( buffer, 0, sizeof(buffer) );
-	addrlen_ret = sizeof(IP);
-	buflen = recvfrom( sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &clientaddr, &addrlen_ret );
+	p += 4;
+	qdCount = get16bits( &p );
+	rrCount = get16bits( &p );
+	rrCount += get16bits( &p );
+	rrCount += get16bits( &p );
 
-	if( buflen < 0 ) {
-		return;
+	if( rrCount > offsets_num ) {
+		return -1;
 	}
 
-	/* Decode message */
-	if( dns_decode_msg( &msg, buffer ) < 0 ) {
-		return;
+	for( i = 0; i < qdCount; i++ ) {
+		if( (p = dns_skip_domain( p, end )) == NULL ) {
+			return -1;
+		}
+		/* qType and qClass */
+		p += 4;
 	}
 
-	hostname = msg.question.qName;
-
-	/* Got DNS response */
-	if( msg.qr == 1 ) {
-		if ( gconf->dns_server ) {
-			proxy_forward_response( buffer, buflen, msg.id);
+	ttl_num = 0;
+	for( i = 0; i < rrCount; i++ ) {
+		if( (p = dns_skip_domain( p, end )) == NULL || (p + 10) > end ) {
+			return -1;
 		}
-		return;
+		type = get16bits( &p );
+		/* Class */
+		p += 2;
+		if( type != OPT_Resource_RecordType ) {
+			offsets[ttl_num++] = p - buffer;
+		}
+		p += 4;
+		rdLength = get16bits( &p );
+		p += rdLength;
 	}
 
-	/* Got foreign DNS request */
-	if( !is_suffix( hostname, gconf->query_tld ) ) {
-		if ( gconf->dns_server ) {
-			proxy_forward_request( buffer, buflen, &clientaddr, msg.id);
-		}
-		return;
+	return (p == end) ? ttl_num : -1;
+}
+
+void dns_cache_lock( int write ) {
+#ifdef DNS_WORKERS
+	if( write ) {
+		pthread_rwlock_wrlock( &g_dns_cache_lock );
+	} else {
+		pthread_rwlock_rdlock( &g_dns_cache_lock );
+	}
+#endif
+}
+
+void dns_cache_unlock( void ) {
+#ifdef DNS_WORKERS
+	pthread_rwlock_unlock( &g_dns_cache_lock );
+#endif
+}
+
+struct dns_cache_t *dns_cache_entry( const char qName[], unsigned short qType ) {
+	unsigned int hash;
+	const char *c;
+
+	hash = 2166136261U ^ qType;
+	for( c = qName; *c; c++ ) {
+		hash = (hash ^ (UCHAR) *c) * 16777619U;
+	}
+
+	return &g_dns_cache[hash & (DNS_CACHE_SIZE - 1)];
+}
+
+/* Count answers from the cache as lookups of the name, workers cannot do that themselves */
+void dns_cache_count( struct dns_cache_t *entry ) {
+	char query[QUERY_MAX_SIZE];
+
+	if( entry->data && __atomic_exchange_n( &entry->used, 0, __ATOMIC_RELAXED )
+			&& query_sanitize( query, sizeof(query), entry->qName ) == 0 ) {
+		history_add( query );
+	}
+}
+
+/* Count all cached names that were used */
+void dns_cache_count_all( void ) {
+	size_t i;
+
+	if( gconf->history_file == NULL ) {
+		return;
+	}
+
+	for( i = 0; i < DNS_CACHE_SIZE; i++ ) {
+		dns_cache_count( &g_dns_cache[i] );
+	}
+}
+
+void dns_cache_clear( struct dns_cache_t *entry ) {
+	dns_cache_count( entry );
+	free( entry->data );
+	entry->data = NULL;
+	entry->data_len = 0;
+}
+
+/* Drop cached responses of results buckets that have changed or are gone */
+void dns_cache_sweep( void ) {
+	static unsigned int version = 0;
+	const struct results_t *results;
+	struct dns_cache_t *entry;
+	size_t i;
+
+	if( version == results_version() ) {
+		return;
+	}
+	version = results_version();
+
+	dns_cache_lock( 1 );
+	for( i = 0; i < DNS_CACHE_SIZE; i++ ) {
+		entry = &g_dns_cache[i];
+		if( entry->data == NULL ) {
+			continue;
+		}
+
+		results = results_find( entry->id );
+		if( results == NULL || results->version != entry->version ) {
+			dns_cache_clear( entry );
+		}
+	}
+	dns_cache_unlock();
+}
+
+/* Store an encoded response for the results bucket it was created from */
+void dns_cache_put( const UCHAR buffer[], size_t size, const struct Message *msg, const struct results_t *results, int ttl ) {
+	struct dns_cache_t *entry;
+	int ttl_num;
+
+	if( results == NULL || strlen( msg->question.qName ) >= sizeof(entry->qName) ) {
+		return;
+	}
+
+	dns_cache_lock( 1 );
+
+	entry = dns_cache_entry( msg->question.qName, msg->question.qType );
+	dns_cache_clear( entry );
+
+	ttl_num = dns_find_ttls( buffer, size, entry->ttl_offsets, N_ELEMS(entry->ttl_offsets) );
+	if( ttl_num < 0 ) {
+		dns_cache_unlock();
+		log_warn( "DNS: Failed to parse response for caching." );
+		return;
+	}
+
+	/* Only answers expire, the NS record of the zone keeps its TTL */
+	if( ttl_num > msg->anCount ) {
+		ttl_num = msg->anCount;
+	}
+
+	strcpy( entry->qName, msg->question.qName );
+	entry->qType = msg->question.qType;
+	memcpy( entry->id, results->id, SHA1_BIN_LENGTH );
+	entry->version = results->version;
+	entry->expire = time_now_sec() + ttl;
+	entry->data = memdup( buffer, size );
+	entry->data_len = size;
+	entry->ttl_num = ttl_num;
+	entry->used = 0;
+
+	dns_cache_unlock();
+}
+
+/*
+* Copy a cached response into buffer, patch the request id and TTLs.
+* Entries of changed results are removed by dns_cache_sweep().
+*/
+size_t dns_cache_get( UCHAR buffer[], size_t size, const struct Message *msg, time_t now ) {
+	struct dns_cache_t *entry;
+	size_t data_len;
+	UCHAR *p;
+	size_t i;
+
+	dns_cache_lock( 0 );
+
+	entry = dns_cache_entry( msg->question.qName, msg->question.qType );
+	if( entry->data == NULL || entry->qType != msg->question.qType
+			|| strcmp( entry->qName, msg->question.qName ) != 0
+			|| entry->expire < now || entry->data_len > size ) {
+		dns_cache_unlock();
+		return 0;
+	}
+
+	memcpy( buffer, entry->data, entry->data_len );
+	__atomic_store_n( &entry->used, 1, __ATOMIC_RELAXED );
+
+	p = buffer;
+	put16bits( &p, msg->id );
+
+	/* Recursion desired flag of this query */
+	buffer[2] = (buffer[2] & ~(RD_MASK >> 8)) | (msg->rd ? (RD_MASK >> 8) : 0);
+
+	for( i = 0; i < entry->ttl_num; i++ ) {
+		p = buffer + entry->ttl_offsets[i];
+		put32bits( &p, entry->expire - now );
+	}
+
+	data_len = entry->data_len;
+	dns_cache_unlock();
+
+	return data_len;
+}
+
+/* Get a small string representation of the query type */
+const char* qtype_str( int qType ) {
+	switch( qType ) {
+		case A_Resource_RecordType:
+			return "A";
+		case AAAA_Resource_RecordType:
+			return "AAAA";
+		case SRV_Resource_RecordType:
+			return "SRV";
+		case PTR_Resource_RecordType:
+			return "PTR";
+		default:
+			return "???";
+	}
+}
+
+/*
+* Setup a response without answers. NODATA (no error) and NXDOMAIN
+* responses carry the SOA record of the zone for negative caching.
+*/
+int dns_setup_error( struct Message *msg, int rcode ) {
+	msg->qr = 1;
+	msg->aa = (rcode != Refused_ResponseType); /* only authoritative for our zone */
+	msg->ra = 0;
+	msg->rcode = rcode;
+
+	msg->qdCount = (msg->question.qName != NULL) ? 1 : 0;
+	msg->anCount = 0;
+	msg->nsCount = 0;
+	msg->arCount = 0;
+
+	if( rcode == NoError_ResponseCode || rcode == NameError_ResponseCode ) {
+		setAuthorityRecord( &msg->answers[0] );
+		msg->nsCount = 1;
+	}
+
+	return 1;
+}
+
+/* Answer a query for the zone apex itself from the synthesized SOA and NS records */
+int dns_setup_apex( struct Message *msg ) {
+	dns_setup_error( msg, NoError_ResponseCode );
+
+	switch( msg->question.qType ) {
+		case SOA_Resource_RecordType:
+			msg->anCount = 1;
+			msg->nsCount = 1;
+			setNameServerRecord( &msg->answers[1] );
+			break;
+		case NS_Resource_RecordType:
+			msg->anCount = 1;
+			msg->nsCount = 0;
+			setNameServerRecord( &msg->answers[0] );
+			break;
+		case STAR_QueryType:
+			msg->anCount = 2;
+			msg->nsCount = 0;
+			setNameServerRecord( &msg->answers[1] );
+			break;
+		default:
+			/* NODATA, the SOA record is in the authority section */
+			break;
+	}
+
+	return 1;
+}
+
+/* Cut a response after the question and set the truncation flag */
+ssize_t dns_truncate( UCHAR buffer[], ssize_t buflen ) {
+	const UCHAR *qend;
+
+	qend = buffer + 12;
+	if( buffer[4] != 0 || buffer[5] != 0 ) {
+		if( (qend = dns_skip_domain( qend, buffer + buflen )) == NULL || (qend + 4) > (buffer + buflen) ) {
+			return -1;
+		}
+		/* qType and qClass */
+		qend += 4;
+	}
+
+	buffer[2] |= (TC_MASK >> 8);
+	memset( buffer + 6, 0, 6 );
+
+	return qend - buffer;
+}
+
+/*
+* Response rate limiting. Clients are grouped by network, each network
+* gets a number of responses and new searches per second.
+*/
+
+/* Slot of the network of a client, the buckets are refilled every second */
+struct dns_rrl_t *dns_rrl_entry( struct dns_rrl_table_t *table, const IP *addr, time_t now ) {
+	struct dns_rrl_t *entry;
+	UCHAR prefix[8];
+	unsigned int hash;
+	size_t i;
+
+	memset( prefix, 0, sizeof(prefix) );
+	if( addr->ss_family == AF_INET ) {
+		/* /24 */
+		prefix[0] = 4;
+		memcpy( prefix + 1, &((IP4 *)addr)->sin_addr, 3 );
+	} else {
+		/* /56 */
+		prefix[0] = 6;
+		memcpy( prefix + 1, &((IP6 *)addr)->sin6_addr, 7 );
+	}
+
+	hash = 2166136261U;
+	for( i = 0; i < sizeof(prefix); i++ ) {
+		hash = (hash ^ prefix[i]) * 16777619U;
+	}
+
+	entry = &table->entries[hash & (DNS_RRL_SIZE - 1)];
+
+	/* Another network takes over the slot */
+	if( memcmp( entry->prefix, prefix, sizeof(prefix) ) != 0 ) {
+		memcpy( entry->prefix, prefix, sizeof(prefix) );
+		entry->time = 0;
+		entry->slip = 0;
+	}
+
+	if( entry->time != now ) {
+		entry->time = now;
+		entry->responses = gconf->dns_rate_limit;
+		entry->searches = gconf->dns_search_limit;
+	}
+
+	return entry;
+}
+
+/* Decide if a UDP response to a client is sent, dropped or sent truncated */
+int dns_rrl_response( struct dns_rrl_table_t *table, const IP *clientaddr, time_t now ) {
+	struct dns_rrl_t *entry;
+
+	if( gconf->dns_rate_limit == 0 ) {
+		return RRL_SEND;
+	}
+
+	entry = dns_rrl_entry( table, clientaddr, now );
+	if( entry->responses > 0 ) {
+		entry->responses--;
+		return RRL_SEND;
+	}
+
+	/* Let real clients retry over TCP, spoofed clients cannot */
+	if( (++entry->slip % DNS_RRL_SLIP) == 0 ) {
+		__atomic_store_n( &table->slipped, table->slipped + 1, __ATOMIC_RELAXED );
+		return RRL_TRUNCATE;
+	}
+
+	__atomic_store_n( &table->dropped, table->dropped + 1, __ATOMIC_RELAXED );
+	return RRL_DROP;
+}
+
+/* Check if a client may start another search, take must be set when a search is started */
+int dns_rrl_search( struct dns_rrl_table_t *table, const IP *clientaddr, int take ) {
+	struct dns_rrl_t *entry;
+
+	if( gconf->dns_search_limit == 0 ) {
+		return 1;
+	}
+
+	entry = dns_rrl_entry( table, clientaddr, time_now_sec() );
+	if( entry->searches <= 0 ) {
+		return 0;
+	}
+
+	if( take ) {
+		entry->searches--;
+	}
+
+	return 1;
+}
+
+/*
+* Append an OPT record if the query had one. Responses that do not fit
+* are cut after the question and get the truncation flag, the client is
+* expected to ask again over TCP.
+*/
+ssize_t dns_fit_response( UCHAR buffer[], ssize_t buflen, size_t size, const struct Message *msg ) {
+	const size_t opt_len = msg->edns ? 11 : 0;
+	unsigned short arCount;
+	size_t limit;
+	UCHAR *p;
+
+	if( buflen < 12 ) {
+		return buflen;
+	}
+
+	limit = (msg->limit > 0) ? msg->limit : 512;
+	if( limit > size ) {
+		limit = size;
+	}
+
+	if( (buflen + opt_len) > limit ) {
+		log_debug( "DNS: Response of %ld bytes is too large, set truncation flag.", (long) buflen );
+		if( (buflen = dns_truncate( buffer, buflen )) < 0 ) {
+			return -1;
+		}
+	}
+
+	if( msg->edns ) {
+		p = buffer + buflen;
+		*p++ = 0; /* root domain */
+		put16bits( &p, OPT_Resource_RecordType );
+		put16bits( &p, DNS_EDNS_SIZE );
+		*p++ = msg->rcode >> 4; /* upper bits of the response code */
+		*p++ = 0; /* version */
+		put16bits( &p, 0 ); /* flags */
+		put16bits( &p, 0 ); /* no options */
+		buflen = p - buffer;
+
+		arCount = (buffer[10] << 8) + buffer[11] + 1;
+		p = buffer + 10;
+		put16bits( &p, arCount );
+	}
+
+	return buflen;
+}
+
+struct dns_tcp_t *dns_tcp_find( int fd ) {
+	size_t i;
+
+	for( i = 0; i < N_ELEMS(g_dns_tcp); i++ ) {
+		if( g_dns_tcp[i].fd == fd ) {
+			return &g_dns_tcp[i];
+		}
+	}
+
+	return NULL;
+}
+
+void dns_tcp_handler( int rc, int fd );
+void dns_tcp_write_handler( int rc, int fd );
+
+void dns_tcp_close( struct dns_tcp_t *conn ) {
+	struct proxy_request_t *request;
+	size_t i;
+
+	/* Drop queries still waiting for an answer */
+	for( i = 0; i < N_ELEMS(g_dns_pending); i++ ) {
+		if( g_dns_pending[i].sock == conn->fd ) {
+			g_dns_pending[i].sock = -1;
+		}
+	}
+
+	for( request = g_proxy_oldest; request; request = request->next_sent ) {
+		if( request->sock == conn->fd ) {
+			request->sock = -1;
+		}
+	}
+
+	net_remove_handler( conn->fd, &dns_tcp_handler );
+	if( conn->writing ) {
+		net_remove_handler( conn->fd, &dns_tcp_write_handler );
+	}
+
+	close( conn->fd );
+	free( conn->out );
+
+	conn->fd = -1;
+	conn->out = NULL;
+	conn->out_len = 0;
+	conn->out_size = 0;
+}
+
+/* Send buffered responses, returns -1 if the connection was closed */
+int dns_tcp_flush( struct dns_tcp_t *conn ) {
+	ssize_t rc;
+
+	if( conn->out_len > 0 ) {
+		rc = send( conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL );
+		if( rc < 0 ) {
+			if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+				log_debug( "DNS: Cannot send message to '%s': %s", str_addr( &conn->clientaddr ), strerror( errno ) );
+				dns_tcp_close( conn );
+				return -1;
+			}
+		} else {
+			memmove( conn->out, conn->out + rc, conn->out_len - rc );
+			conn->out_len -= rc;
+		}
+	}
+
+	/* Wait until the rest can be sent */
+	if( conn->out_len > 0 && !conn->writing ) {
+		net_add_write_handler( conn->fd, &dns_tcp_write_handler );
+		conn->writing = 1;
+	} else if( conn->out_len == 0 && conn->writing ) {
+		net_remove_handler( conn->fd, &dns_tcp_write_handler );
+		conn->writing = 0;
+	}
+
+	return 0;
+}
+
+/* Queue a response with length prefix */
+void dns_tcp_send( struct dns_tcp_t *conn, const UCHAR buffer[], size_t buflen ) {
+	size_t size;
+
+	if( (conn->out_len + 2 + buflen) > DNS_TCP_MAX_OUTPUT ) {
+		log_debug( "DNS: Client does not read responses, close connection to %s", str_addr( &conn->clientaddr ) );
+		dns_tcp_close( conn );
+		return;
+	}
+
+	if( (conn->out_len + 2 + buflen) > conn->out_size ) {
+		size = conn->out_size ? conn->out_size : 1024;
+		while( size < (conn->out_len + 2 + buflen) ) {
+			size *= 2;
+		}
+		conn->out = (UCHAR*) realloc( conn->out, size );
+		conn->out_size = size;
+	}
+
+	conn->out[conn->out_len] = buflen >> 8;
+	conn->out[conn->out_len + 1] = buflen & 0xFF;
+	memcpy( conn->out + conn->out_len + 2, buffer, buflen );
+	conn->out_len += 2 + buflen;
+	conn->last = time_now_sec();
+
+	if( !conn->busy ) {
+		dns_tcp_flush( conn );
+	}
+}
+
+/* Count a sent response by its response code, including the upper bits of an OPT record */
+void dns_count_response( const UCHAR buffer[], size_t size ) {
+	const UCHAR *end = buffer + size;
+	const UCHAR *p = buffer;
+	size_t qdCount, anCount, rrCount;
+	size_t rdLength;
+	size_t i;
+	int rcode;
+	int type;
+
+	if( size < 12 ) {
+		return;
+	}
+
+	rcode = buffer[3] & RCODE_MASK;
+
+	p += 4;
+	qdCount = get16bits( &p );
+	anCount = get16bits( &p );
+	rrCount = anCount;
+	rrCount += get16bits( &p );
+	rrCount += get16bits( &p );
+
+	for( i = 0; i < qdCount; i++ ) {
+		if( (p = dns_skip_domain( p, end )) == NULL ) {
+			break;
+		}
+		/* qType and qClass */
+		p += 4;
+	}
+
+	for( i = 0; p != NULL && i < rrCount; i++ ) {
+		if( (p = dns_skip_domain( p, end )) == NULL || (p + 10) > end ) {
+			break;
+		}
+		type = get16bits( &p );
+		/* Class */
+		p += 2;
+		if( type == OPT_Resource_RecordType ) {
+			rcode |= p[0] << 4;
+		}
+		p += 4;
+		rdLength = get16bits( &p );
+		p += rdLength;
+	}
+
+	if( rcode == BadVersion_ResponseCode ) {
+		g_dns_badvers_count++;
+	} else if( rcode < N_ELEMS(g_dns_rcode_count) ) {
+		g_dns_rcode_count[rcode]++;
+
+		/* No error, but no answers */
+		if( rcode == NoError_ResponseCode && anCount == 0 ) {
+			g_dns_nodata_count++;
+		}
+	}
+}
+
+void dns_send( int sock, const UCHAR buffer[], ssize_t buflen, const IP *clientaddr ) {
+	UCHAR truncated[DNS_EDNS_SIZE];
+	struct dns_tcp_t *conn;
+
+	/* The connection of the client was closed */
+	if( sock < 0 ) {
+		return;
+	}
+
+	if( buflen <= 0 ) {
+		log_err( "DNS: Failed to create response packet." );
+		return;
+	}
+
+	/* Responses over TCP are not limited, the client address cannot be spoofed */
+	if( (conn = dns_tcp_find( sock )) != NULL ) {
+		dns_count_response( buffer, buflen );
+		dns_tcp_send( conn, buffer, buflen );
+		return;
+	}
+
+	switch( dns_rrl_response( &g_dns_rrl, clientaddr, time_now_sec() ) ) {
+		case RRL_DROP:
+			return;
+		case RRL_TRUNCATE:
+			if( (size_t) buflen > sizeof(truncated) ) {
+				return;
+			}
+			memcpy( truncated, buffer, buflen );
+			if( (buflen = dns_truncate( truncated, buflen )) < 0 ) {
+				return;
+			}
+			buffer = truncated;
+			break;
+	}
+
+	/* Only count responses that are not dropped */
+	dns_count_response( buffer, buflen );
+
+	if( sendto( sock, buffer, buflen, 0, (struct sockaddr*) clientaddr, addr_len( clientaddr ) ) < 0 ) {
+		log_warn( "DNS: Cannot send message to '%s': %s", str_addr( clientaddr ), strerror( errno ) );
+	}
+}
+
+/* Send a response without answers */
+void dns_send_error( int sock, struct Message *msg, int rcode, const IP *clientaddr ) {
+	UCHAR buffer[512];
+	ssize_t buflen;
+
+	dns_setup_error( msg, rcode );
+	buflen = dns_encode_msg( buffer, sizeof(buffer), msg );
+	buflen = dns_fit_response( buffer, buflen, sizeof(buffer), msg );
+	dns_send( sock, buffer, buflen, clientaddr );
+}
+
+/*
+* Forward queries for foreign names to external DNS servers.
+*/
+
+void dns_add_server( const char addr_str[] ) {
+	struct proxy_server_t *server;
+
+	if( g_proxy_servers_num >= N_ELEMS(g_proxy_servers) ) {
+		log_err( "DNS: Too many external DNS servers." );
+		exit( 1 );
+	}
+
+	server = &g_proxy_servers[g_proxy_servers_num];
+	memset( server, 0, sizeof(struct proxy_server_t) );
+
+	if( addr_parse_full( &server->addr, addr_str, "53", AF_UNSPEC ) != 0 ) {
+		log_err( "DNS: Failed to parse IP address '%s'.", addr_str );
+		exit( 1 );
+	}
+
+	g_proxy_servers_num++;
+}
+
+/* Milliseconds from time a to time b */
+long proxy_time_diff( const struct timeval *a, const struct timeval *b ) {
+	return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_usec - a->tv_usec) / 1000;
+}
+
+/* Get a random id for queries to external servers */
+unsigned short proxy_random_id( void ) {
+	static unsigned short ids[64];
+	static size_t ids_left = 0;
+
+	if( ids_left == 0 ) {
+		bytes_random( (UCHAR*) ids, sizeof(ids) );
+		ids_left = N_ELEMS(ids);
+	}
+
+	return ids[--ids_left];
+}
+
+/* FNV-1a over the lower case name, resolvers may change the case */
+unsigned int proxy_hash_name( const char qName[] ) {
+	unsigned int hash;
+	const char *c;
+
+	hash = 2166136261U;
+	for( c = qName; *c; c++ ) {
+		hash = (hash ^ tolower( (unsigned char) *c )) * 16777619U;
+	}
+
+	return hash;
+}
+
+struct proxy_request_t **proxy_bucket( unsigned short txid, const char qName[] ) {
+	return &g_proxy_table[(proxy_hash_name( qName ) ^ txid) & (PROXY_HASH_SIZE - 1)];
+}
+
+struct proxy_request_t *proxy_find( unsigned short txid, const char qName[] ) {
+	struct proxy_request_t *request;
+
+	request = *proxy_bucket( txid, qName );
+	while( request ) {
+		if( request->txid == txid && strcasecmp( request->qName, qName ) == 0 ) {
+			return request;
+		}
+		request = request->next;
+	}
+
+	return NULL;
+}
+
+/* Append request to the deadline ordered list */
+void proxy_list_append( struct proxy_request_t *request ) {
+	request->prev_sent = g_proxy_newest;
+	request->next_sent = NULL;
+
+	if( g_proxy_newest ) {
+		g_proxy_newest->next_sent = request;
+	} else {
+		g_proxy_oldest = request;
+	}
+	g_proxy_newest = request;
+}
+
+void proxy_list_remove( struct proxy_request_t *request ) {
+	if( request->prev_sent ) {
+		request->prev_sent->next_sent = request->next_sent;
+	} else {
+		g_proxy_oldest = request->next_sent;
+	}
+
+	if( request->next_sent ) {
+		request->next_sent->prev_sent = request->prev_sent;
+	} else {
+		g_proxy_newest = request->prev_sent;
+	}
+}
+
+void proxy_remove( struct proxy_request_t *request ) {
+	struct proxy_request_t **pp;
+
+	pp = proxy_bucket( request->txid, request->qName );
+	while( *pp != request ) {
+		pp = &(*pp)->next;
+	}
+	*pp = request->next;
+
+	proxy_list_remove( request );
+	g_proxy_count--;
+
+	free( request->query );
+	free( request );
+}
+
+/*
+* Expected round trip time. A server that has not answered
+* for longer than its smoothed round trip time is slower.
+*/
+long proxy_server_rtt( const struct proxy_server_t *server ) {
+	long waiting;
+
+	if( server->unanswered.tv_sec == 0 ) {
+		return server->srtt;
+	}
+
+	waiting = proxy_time_diff( &server->unanswered, &gconf->time_now );
+	return (waiting > server->srtt) ? waiting : server->srtt;
+}
+
+/*
+* Select the server with the lowest round trip time that was not
+* tried yet. The round trip time of all other servers decays, so
+* that slow or failed servers are tried again after a while.
+*/
+int proxy_select_server( unsigned int tried ) {
+	struct proxy_server_t *server;
+	long best_rtt;
+	long rtt;
+	int best;
+	size_t i;
+
+	best = -1;
+	best_rtt = 0;
+	for( i = 0; i < g_proxy_servers_num; i++ ) {
+		if( tried & (1 << i) ) {
+			continue;
+		}
+		rtt = proxy_server_rtt( &g_proxy_servers[i] );
+		if( best < 0 || rtt < best_rtt ) {
+			best = i;
+			best_rtt = rtt;
+		}
+	}
+
+	for( i = 0; i < g_proxy_servers_num; i++ ) {
+		if( i != best ) {
+			server = &g_proxy_servers[i];
+			server->srtt -= server->srtt / 32;
+		}
+	}
+
+	return best;
+}
+
+/* Send query to the next server, returns -1 if there is none left */
+int proxy_send( struct proxy_request_t *request ) {
+	struct proxy_server_t *server;
+	int sock;
+	int idx;
+
+	while( request->tries < PROXY_MAX_TRIES ) {
+		if( (idx = proxy_select_server( request->tried )) < 0 ) {
+			break;
+		}
+
+		server = &g_proxy_servers[idx];
+		request->server = idx;
+		request->tried |= (1 << idx);
+		request->tries++;
+		request->sent = gconf->time_now;
+
+		sock = (server->addr.ss_family == AF_INET) ? g_proxy_sock4 : g_proxy_sock6;
+		if( sendto( sock, request->query, request->query_len, 0, (struct sockaddr*) &server->addr, addr_len( &server->addr ) ) < 0 ) {
+			log_warn( "DNS: Failed to send request to dns server %s: %s", str_addr( &server->addr ), strerror( errno ) );
+			continue;
+		}
+
+		if( server->unanswered.tv_sec == 0 ) {
+			server->unanswered = gconf->time_now;
+		}
+		server->sent++;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+* Time an answer of an external DNS server may be cached.
+* Negative answers need a SOA record, see RFC 2308.
+* Returns -1 if the answer must not be cached.
+*/
+long proxy_cache_ttl( const UCHAR *buffer, size_t size ) {
+	const UCHAR *end = buffer + size;
+	const UCHAR *p = buffer;
+	size_t qdCount, anCount, nsCount, arCount;
+	size_t rdLength;
+	long min_ttl, neg_ttl;
+	long ttl, minimum;
+	int rcode, type;
+	size_t i;
+
+	if( size < 12 ) {
+		return -1;
+	}
+
+	/* Truncated answers are incomplete */
+	if( buffer[2] & (TC_MASK >> 8) ) {
+		return -1;
+	}
+
+	rcode = buffer[3] & RCODE_MASK;
+	if( rcode != NoError_ResponseCode && rcode != NameError_ResponseCode ) {
+		return -1;
+	}
+
+	p += 4;
+	qdCount = get16bits( &p );
+	anCount = get16bits( &p );
+	nsCount = get16bits( &p );
+	arCount = get16bits( &p );
+
+	for( i = 0; i < qdCount; i++ ) {
+		if( (p = dns_skip_domain( p, end )) == NULL ) {
+			return -1;
+		}
+		/* qType and qClass */
+		p += 4;
+	}
+
+	min_ttl = -1;
+	neg_ttl = -1;
+	for( i = 0; i < (anCount + nsCount + arCount); i++ ) {
+		if( (p = dns_skip_domain( p, end )) == NULL || (p + 10) > end ) {
+			return -1;
+		}
+		type = get16bits( &p );
+		/* Class */
+		p += 2;
+		ttl = get32bits( &p );
+		rdLength = get16bits( &p );
+		if( (p + rdLength) > end ) {
+			return -1;
+		}
+
+		if( type != OPT_Resource_RecordType ) {
+			/* Values with the highest bit set are zero, see RFC 2181 */
+			if( ttl > 0x7FFFFFFF ) {
+				ttl = 0;
+			}
+
+			/* The minimum field is the last field of a SOA record in the authority section */
+			if( type == SOA_Resource_RecordType && i >= anCount && i < (anCount + nsCount) && rdLength >= 22 ) {
+				const UCHAR *q = p + rdLength - 4;
+				minimum = get32bits( &q );
+				neg_ttl = (minimum < ttl) ? minimum : ttl;
+			}
+
+			if( min_ttl < 0 || ttl < min_ttl ) {
+				min_ttl = ttl;
+			}
+		}
+
+		p += rdLength;
+	}
+
+	if( rcode == NameError_ResponseCode || anCount == 0 ) {
+		if( neg_ttl < 0 ) {
+			return -1;
+		}
+		return (min_ttl < neg_ttl) ? min_ttl : neg_ttl;
+	}
+
+	return min_ttl;
+}
+
+void proxy_cache_remove( struct proxy_cache_t *entry ) {
+	struct proxy_cache_t **pp;
+
+	pp = &g_proxy_cache_table[proxy_hash_name( entry->qName ) & (g_proxy_cache_table_size - 1)];
+	while( *pp != entry ) {
+		pp = &(*pp)->next;
+	}
+	*pp = entry->next;
+
+	if( entry->prev_used ) {
+		entry->prev_used->next_used = entry->next_used;
+	} else {
+		g_proxy_cache_newest = entry->next_used;
+	}
+
+	if( entry->next_used ) {
+		entry->next_used->prev_used = entry->prev_used;
+	} else {
+		g_proxy_cache_oldest = entry->prev_used;
+	}
+
+	g_proxy_cache_count--;
+
+	free( entry->data );
+	free( entry );
+}
+
+/* Move entry to the front of the least recently used list */
+void proxy_cache_use( struct proxy_cache_t *entry ) {
+	if( entry->prev_used ) {
+		entry->prev_used->next_used = entry->next_used;
+	} else {
+		g_proxy_cache_newest = entry->next_used;
+	}
+
+	if( entry->next_used ) {
+		entry->next_used->prev_used = entry->prev_used;
+	} else {
+		g_proxy_cache_oldest = entry->prev_used;
+	}
+
+	entry->prev_used = NULL;
+	entry->next_used = g_proxy_cache_newest;
+	if( g_proxy_cache_newest ) {
+		g_proxy_cache_newest->prev_used = entry;
+	} else {
+		g_proxy_cache_oldest = entry;
+	}
+	g_proxy_cache_newest = entry;
+}
+
+struct proxy_cache_t *proxy_cache_find( const char qName[], unsigned short qType, unsigned short qClass, int edns ) {
+	struct proxy_cache_t *entry;
+
+	entry = g_proxy_cache_table[proxy_hash_name( qName ) & (g_proxy_cache_table_size - 1)];
+	while( entry ) {
+		if( entry->qType == qType && entry->qClass == qClass && entry->edns == edns
+				&& strcasecmp( entry->qName, qName ) == 0 ) {
+			return entry;
+		}
+		entry = entry->next;
+	}
+
+	return NULL;
+}
+
+/* Store the answer of an external DNS server */
+void proxy_cache_put( const UCHAR buffer[], size_t size, const struct proxy_request_t *request ) {
+	struct proxy_cache_t **bucket;
+	struct proxy_cache_t *entry;
+	struct proxy_cache_t *old;
+	long ttl;
+	int ttl_num;
+
+	if( g_proxy_cache_table == NULL ) {
+		return;
+	}
+
+	if( (ttl = proxy_cache_ttl( buffer, size )) < 0 ) {
+		return;
+	}
+
+	if( ttl < gconf->dns_proxy_min_ttl ) {
+		ttl = gconf->dns_proxy_min_ttl;
+	}
+
+	if( ttl > gconf->dns_proxy_max_ttl ) {
+		ttl = gconf->dns_proxy_max_ttl;
+	}
+
+	if( ttl == 0 ) {
+		return;
+	}
+
+	entry = (struct proxy_cache_t*) calloc( 1, sizeof(struct proxy_cache_t) );
+
+	ttl_num = dns_find_ttls( buffer, size, entry->ttl_offsets, N_ELEMS(entry->ttl_offsets) );
+	if( ttl_num < 0 ) {
+		/* Too many records */
+		free( entry );
+		return;
+	}
+
+	dns_cache_lock( 1 );
+
+	old = proxy_cache_find( request->qName, request->qType, request->qClass, request->edns );
+	if( old ) {
+		proxy_cache_remove( old );
+	}
+
+	/* Entries used since they were moved to the front get a second chance */
+	while( g_proxy_cache_count >= (size_t) gconf->dns_proxy_cache ) {
+		old = g_proxy_cache_oldest;
+		if( __atomic_exchange_n( &old->used, 0, __ATOMIC_RELAXED ) && old->expire > time_now_sec() ) {
+			proxy_cache_use( old );
+		} else {
+			proxy_cache_remove( old );
+		}
+	}
+
+	strcpy( entry->qName, request->qName );
+	entry->qType = request->qType;
+	entry->qClass = request->qClass;
+	entry->edns = request->edns;
+	entry->expire = time_now_sec() + ttl;
+	entry->data = memdup( buffer, size );
+	entry->data_len = size;
+	entry->ttl_num = ttl_num;
+
+	bucket = &g_proxy_cache_table[proxy_hash_name( entry->qName ) & (g_proxy_cache_table_size - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	g_proxy_cache_count++;
+
+	proxy_cache_use( entry );
+
+	dns_cache_unlock();
+}
+
+/*
+* Copy a cached answer into buffer, patch the request id, question and TTLs.
+* Expired entries are replaced or dropped by proxy_cache_put().
+*/
+size_t proxy_cache_get( UCHAR buffer[], size_t size, const UCHAR query[], size_t query_len, const struct Message *msg, time_t now ) {
+	struct proxy_cache_t *entry;
+	const UCHAR *qend;
+	const UCHAR *aend;
+	size_t data_len;
+	UCHAR *p;
+	size_t i;
+
+	if( g_proxy_cache_table == NULL ) {
+		return 0;
+	}
+
+	dns_cache_lock( 0 );
+
+	entry = proxy_cache_find( msg->question.qName, msg->question.qType, msg->question.qClass, msg->edns );
+	if( entry == NULL || entry->expire <= now || entry->data_len > size ) {
+		dns_cache_unlock();
+		__atomic_fetch_add( &g_proxy_cache_misses, 1, __ATOMIC_RELAXED );
+		return 0;
+	}
+
+	memcpy( buffer, entry->data, entry->data_len );
+
+	p = buffer;
+	put16bits( &p, msg->id );
+
+	/* Recursion desired flag of this query, cached answers are not authoritative */
+	buffer[2] = (buffer[2] & ~(RD_MASK >> 8)) | (msg->rd ? (RD_MASK >> 8) : 0);
+	buffer[2] &= ~(AA_MASK >> 8);
+
+	/* Keep the letter case of the question name */
+	qend = dns_skip_domain( query + 12, query + query_len );
+	aend = dns_skip_domain( buffer + 12, buffer + entry->data_len );
+	if( qend && aend && (qend - query) == (aend - buffer) ) {
+		memcpy( buffer + 12, query + 12, qend - (query + 12) );
+	}
+
+	for( i = 0; i < entry->ttl_num; i++ ) {
+		p = buffer + entry->ttl_offsets[i];
+		put32bits( &p, entry->expire - now );
+	}
+
+	__atomic_store_n( &entry->used, 1, __ATOMIC_RELAXED );
+	data_len = entry->data_len;
+	dns_cache_unlock();
+
+	__atomic_fetch_add( &g_proxy_cache_hits, 1, __ATOMIC_RELAXED );
+
+	return data_len;
+}
+
+/* Answer a forwarded query with SERVFAIL and drop it */
+void proxy_fail( struct proxy_request_t *request ) {
+	struct Message msg;
+
+	memset( &msg, 0, sizeof(msg) );
+	msg.id = request->id;
+	strcpy( msg.qName_buffer, request->qName );
+	msg.question.qName = msg.qName_buffer;
+	msg.question.qType = request->qType;
+	msg.question.qClass = request->qClass;
+	msg.rd = request->rd;
+	msg.edns = request->edns;
+
+	dns_send_error( request->sock, &msg, ServerFailure_ResponseCode, &request->clientaddr );
+	proxy_remove( request );
+}
+
+/* Forward request to external DNS server, unless the answer is cached */
+void proxy_forward_request( int sock, const UCHAR buffer[], ssize_t buflen, struct Message *msg, const IP *clientaddr ) {
+	struct proxy_request_t **bucket;
+	struct proxy_request_t *request;
+	UCHAR answer[DNS_BUFFER_SIZE];
+	size_t answer_len;
+	unsigned short txid;
+
+	/* Cached answers must fit the transport of this query */
+	answer_len = (msg->limit < sizeof(answer)) ? msg->limit : sizeof(answer);
+	if( (answer_len = proxy_cache_get( answer, answer_len, buffer, buflen, msg, time_now_sec() )) > 0 ) {
+		log_debug( "DNS: Send back cached answer of external DNS server to: %s", str_addr( clientaddr ) );
+		dns_send( sock, answer, answer_len, clientaddr );
+		return;
+	}
+
+	if( g_proxy_count >= PROXY_MAX_REQUESTS || strlen( msg->question.qName ) >= sizeof(request->qName) ) {
+		log_debug( "DNS: Too many forwarded queries, reject query for: %s", msg->question.qName );
+		dns_send_error( sock, msg, ServerFailure_ResponseCode, clientaddr );
+		return;
+	}
+
+	/* Ids are unique per question name */
+	do {
+		txid = proxy_random_id();
+	} while( proxy_find( txid, msg->question.qName ) != NULL );
+
+	request = (struct proxy_request_t*) calloc( 1, sizeof(struct proxy_request_t) );
+	request->txid = txid;
+	request->id = msg->id;
+	strcpy( request->qName, msg->question.qName );
+	request->qType = msg->question.qType;
+	request->qClass = msg->question.qClass;
+	request->rd = msg->rd;
+	request->edns = msg->edns;
+	request->sock = sock;
+	request->clientaddr = *clientaddr;
+	request->query = memdup( buffer, buflen );
+	request->query_len = buflen;
+
+	/* Replace the client id */
+	request->query[0] = txid >> 8;
+	request->query[1] = txid & 0xFF;
+
+	bucket = proxy_bucket( txid, request->qName );
+	request->next = *bucket;
+	*bucket = request;
+	proxy_list_append( request );
+	g_proxy_count++;
+
+	if( proxy_send( request ) < 0 ) {
+		proxy_fail( request );
+	}
+}
+
+/* Forward DNS response back to client address */
+void proxy_handler( int rc, int sock ) {
+	struct proxy_request_t *request;
+	struct proxy_server_t *server;
+	struct Message msg;
+	UCHAR buffer[4096];
+	socklen_t addrlen_ret;
+	ssize_t buflen;
+	IP fromaddr;
+	long rtt;
+	size_t i;
+
+	if( rc == 0 ) {
+		return;
+	}
+
+	addrlen_ret = sizeof(IP);
+	buflen = recvfrom( sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &fromaddr, &addrlen_ret );
+
+	memset( &msg, 0, sizeof(msg) );
+	if( buflen < 12 || dns_decode_msg( &msg, buffer, buflen ) < 0 || msg.qr == 0 ) {
+		return;
+	}
+
+	request = proxy_find( msg.id, msg.question.qName );
+	if( request == NULL ) {
+		log_debug( "DNS: Failed to find client for response." );
+		return;
+	}
+
+	/* Only accept responses from servers the query was sent to */
+	for( i = 0; i < g_proxy_servers_num; i++ ) {
+		server = &g_proxy_servers[i];
+		if( (request->tried & (1 << i))
+				&& addr_equal( &server->addr, &fromaddr )
+				&& addr_port( &server->addr ) == addr_port( &fromaddr ) ) {
+			break;
+		}
+	}
+
+	if( i == g_proxy_servers_num ) {
+		log_warn( "DNS: Unexpected response from %s.", str_addr( &fromaddr ) );
+		return;
+	}
+
+	server->answered++;
+	server->unanswered.tv_sec = 0;
+
+	if( i == request->server ) {
+		rtt = proxy_time_diff( &request->sent, &gconf->time_now );
+		if( rtt < 1 ) {
+			rtt = 1;
+		}
+		server->srtt = server->srtt ? ((7 * server->srtt + rtt) / 8) : rtt;
+	}
+
+	if( msg.question.qType == request->qType && msg.question.qClass == request->qClass ) {
+		proxy_cache_put( buffer, buflen, request );
+	}
+
+	/* Restore the client id */
+	buffer[0] = request->id >> 8;
+	buffer[1] = request->id & 0xFF;
+
+	dns_send( request->sock, buffer, buflen, &request->clientaddr );
+	proxy_remove( request );
+}
+
+/* Try the next server for queries without response, fail if there is none left */
+void proxy_handle_timeouts( int _rc, int _sock ) {
+	struct proxy_request_t *request;
+	struct proxy_server_t *server;
+
+	while( (request = g_proxy_oldest) != NULL ) {
+		if( proxy_time_diff( &request->sent, &gconf->time_now ) < PROXY_TIMEOUT ) {
+			break;
+		}
+
+		server = &g_proxy_servers[request->server];
+		server->timeouts++;
+		server->unanswered.tv_sec = 0;
+		server->srtt += PROXY_TIMEOUT;
+		if( server->srtt > PROXY_MAX_RTT ) {
+			server->srtt = PROXY_MAX_RTT;
+		}
+
+		proxy_list_remove( request );
+		proxy_list_append( request );
+
+		if( proxy_send( request ) < 0 ) {
+			log_debug( "DNS: No response from external DNS servers for: %s", request->qName );
+			proxy_fail( request );
+		}
+	}
+}
+
+/*
+* Answer a .p2p query from the cache or the search results.
+* Returns the size of the response, 0 if there are no results yet,
+* -1 if the client is not allowed to start another search or -2 if
+* the search has finished without finding any address.
+* Only a newly arrived query (new_query set) may start or restart a search.
+*/
+ssize_t dns_answer_query( UCHAR buffer[], size_t size, struct Message *msg, const IP *clientaddr, int new_query ) {
+	IP addrs[MAX_ADDR_RECORDS];
+	struct results_t *results;
+	size_t addrs_num;
+	ssize_t buflen;
+	int search;
+	int ttl;
+	int rc;
+
+	if( (buflen = dns_cache_get( buffer, size, msg, time_now_sec() )) > 0 ) {
+		log_debug( "DNS: Send back cached answer to: %s",
+			str_addr( clientaddr )
+		);
+		return buflen;
+	}
+
+	/* Clients over their limit only get results of existing searches */
+	search = new_query ? dns_rrl_search( &g_dns_rrl, clientaddr, 0 ) : 0;
+
+	addrs_num = MAX_ADDR_RECORDS;
+	rc = kad_lookup_value_bucket( msg->question.qName, addrs, &addrs_num, &results, search );
+
+	if( rc == 1 ) {
+		/* A search was started */
+		dns_rrl_search( &g_dns_rrl, clientaddr, 1 );
+	} else if( rc < 0 && new_query && !search ) {
+		log_debug( "DNS: Too many searches from %s", str_addr( clientaddr ) );
+		g_dns_rrl.refused++;
+		return -1;
+	}
+
+	if( rc < 0 || addrs_num == 0 ) {
+		/* Unverified addresses might still be confirmed */
+		if( rc >= 0 && results && results->done && results->entries == NULL ) {
+			return -2;
+		}
+		return 0;
+	}
+
+	ttl = dns_results_ttl( results );
+
+	if( dns_setup_msg( msg, &addrs[0], addrs_num, NULL, ttl ) < 0 ) {
+		return 0;
+	}
+
+	log_debug( "DNS: Send back %lu addresses to: %s",
+		addrs_num, str_addr( clientaddr )
+	);
+
+	/* Encode message */
+	buflen = dns_encode_msg( buffer, size, msg );
+
+	if( buflen > 0 ) {
+		dns_cache_put( buffer, buflen, msg, results, ttl );
+	}
+
+	return buflen;
+}
+
+/*
+* Queries without results are kept until results arrive
+* or the timeout is reached.
+*/
+
+/* Restore the question of a pending query */
+void dns_pending_msg( struct Message *msg, const struct dns_pending_t *pending ) {
+	memset( msg, 0, sizeof(struct Message) );
+	msg->id = pending->id;
+	strcpy( msg->qName_buffer, pending->qName );
+	msg->question.qName = msg->qName_buffer;
+	msg->question.qType = pending->qType;
+	msg->question.qClass = pending->qClass;
+	msg->rd = pending->rd;
+	msg->edns = pending->edns;
+	msg->limit = pending->limit;
+}
+
+/* Returns 0 on success, -1 if the query cannot be parked */
+int dns_pending_add( int sock, const struct Message *msg, const IP *clientaddr ) {
+	struct dns_pending_t *pending;
+	struct dns_pending_t *free_slot;
+	size_t i;
+
+	free_slot = NULL;
+	for( i = 0; i < N_ELEMS(g_dns_pending); i++ ) {
+		pending = &g_dns_pending[i];
+		if( pending->sock < 0 ) {
+			if( free_slot == NULL ) {
+				free_slot = pending;
+			}
+		} else if( pending->sock == sock && pending->id == msg->id && addr_equal( &pending->clientaddr, clientaddr ) ) {
+			/* Retransmission of a query we already wait for */
+			return 0;
+		}
+	}
+
+	if( free_slot == NULL || strlen( msg->question.qName ) >= sizeof(free_slot->qName) ) {
+		return -1;
+	}
+
+	free_slot->sock = sock;
+	free_slot->id = msg->id;
+	strcpy( free_slot->qName, msg->question.qName );
+	free_slot->qType = msg->question.qType;
+	free_slot->qClass = msg->question.qClass;
+	free_slot->rd = msg->rd;
+	free_slot->edns = msg->edns;
+	free_slot->limit = msg->limit;
+	free_slot->clientaddr = *clientaddr;
+	free_slot->deadline = time_now_sec() + gconf->dns_timeout;
+
+	return 0;
+}
+
+/* Answer pending queries when results have changed, fail them after the timeout */
+void dns_handle_pending( int _rc, int _sock ) {
+	static unsigned int version = 0;
+	struct dns_pending_t *pending;
+	struct Message msg;
+	UCHAR buffer[DNS_BUFFER_SIZE];
+	ssize_t buflen;
+	int changed;
+	time_t now;
+	size_t i;
+
+	now = time_now_sec();
+	changed = (version != results_version());
+	version = results_version();
+
+	dns_cache_sweep();
+	dns_cache_count_all();
+
+	for( i = 0; i < N_ELEMS(g_dns_pending); i++ ) {
+		pending = &g_dns_pending[i];
+		if( pending->sock < 0 ) {
+			continue;
+		}
+
+		if( changed ) {
+			dns_pending_msg( &msg, pending );
+			/* Only check the results, the search was started when the query arrived */
+			buflen = dns_answer_query( buffer, sizeof(buffer), &msg, &pending->clientaddr, 0 );
+			if( buflen > 0 ) {
+				buflen = dns_fit_response( buffer, buflen, sizeof(buffer), &msg );
+				dns_send( pending->sock, buffer, buflen, &pending->clientaddr );
+				pending->sock = -1;
+				continue;
+			}
+
+			if( buflen == -2 ) {
+				log_debug( "DNS: No addresses found for: %s", pending->qName );
+				dns_send_error( pending->sock, &msg, NameError_ResponseCode, &pending->clientaddr );
+				pending->sock = -1;
+				continue;
+			}
+		}
+
+		if( pending->deadline <= now ) {
+			log_debug( "DNS: Failed to resolve hostname: %s", pending->qName );
+			dns_pending_msg( &msg, pending );
+			dns_send_error( pending->sock, &msg, ServerFailure_ResponseCode, &pending->clientaddr );
+			pending->sock = -1;
+		}
+	}
+}
+
+/* Size of the response the client can receive */
+size_t dns_response_limit( const struct Message *msg, int tcp ) {
+	if( tcp ) {
+		return DNS_BUFFER_SIZE;
+	} else if( msg->edns ) {
+		if( msg->edns_size < 512 ) {
+			return 512;
+		}
+		return (msg->edns_size > DNS_EDNS_SIZE) ? DNS_EDNS_SIZE : msg->edns_size;
+	} else {
+		return 512;
+	}
+}
+
+/* Answer a query received over UDP or TCP */
+void dns_handle_query( int sock, const UCHAR query[], size_t query_len, const IP *clientaddr, int tcp ) {
+	struct Message msg;
+	ssize_t buflen;
+	UCHAR buffer[DNS_BUFFER_SIZE];
+	const char *hostname;
+	const char *domain;
+	int rc;
+
+	/* Decode message */
+	memset( &msg, 0, sizeof(msg) );
+	rc = (query_len < 12) ? -1 : dns_decode_msg( &msg, query, query_len );
+
+	msg.limit = dns_response_limit( &msg, tcp );
+	dns_cache_sweep();
+
+	if( rc < 0 ) {
+		if( query_len >= 12 && msg.qr == 0 ) {
+			msg.question.qName = NULL;
+			msg.edns = 0;
+			dns_send_error( sock, &msg, FormatError_ResponseCode, clientaddr );
+		}
+		return;
+	}
+
+	hostname = msg.question.qName;
+
+	/* Ignore responses, external DNS servers answer on their own sockets */
+	if( msg.qr == 1 ) {
+		return;
+	}
+
+	if( msg.edns && msg.edns_version > 0 ) {
+		dns_send_error( sock, &msg, BadVersion_ResponseCode, clientaddr );
+		return;
+	}
+
+	/* Query for the zone itself, e.g. "p2p" */
+	if( gconf->dns_authoritative && strcasecmp( hostname, dns_zone() ) == 0 ) {
+		if( msg.opcode != QUERY_OperationCode ) {
+			dns_send_error( sock, &msg, NotImplemented_ResponseType, clientaddr );
+			return;
+		}
+
+		dns_setup_apex( &msg );
+		buflen = dns_encode_msg( buffer, sizeof(buffer), &msg );
+		buflen = dns_fit_response( buffer, buflen, sizeof(buffer), &msg );
+		dns_send( sock, buffer, buflen, clientaddr );
+		return;
+	}
+
+	/* Reverse lookups are outside the zone, only those of the loopback addresses are answered here */
+	if( msg.question.qType == PTR_Resource_RecordType && msg.opcode == QUERY_OperationCode
+			&& (domain = dns_lookup_ptr( hostname )) != NULL ) {
+		if( dns_setup_msg( &msg, NULL, 0, domain, DNS_MAX_TTL ) < 0 ) {
+			return;
+		}
+
+		log_debug( "DNS: Send back hostname '%s' to: %s",
+			domain, str_addr( clientaddr )
+		);
+
+		buflen = dns_encode_msg( buffer, sizeof(buffer), &msg );
+		buflen = dns_fit_response( buffer, buflen, sizeof(buffer), &msg );
+		dns_send( sock, buffer, buflen, clientaddr );
+		return;
+	}
+
+	/* Got foreign DNS request */
+	if( !is_suffix( hostname, gconf->query_tld ) ) {
+		if( g_proxy_servers_num > 0 ) {
+			proxy_forward_request( sock, query, query_len, &msg, clientaddr );
+		} else {
+			dns_send_error( sock, &msg, Refused_ResponseType, clientaddr );
+		}
+		return;
+	}
+
+	if( msg.opcode != QUERY_OperationCode ) {
+		dns_send_error( sock, &msg, NotImplemented_ResponseType, clientaddr );
+		return;
+	}
+
+	if ( !str_isValidHostname( hostname ) ) {
+		log_warn( "DNS: Invalid hostname for lookup: '%s'", hostname );
+		dns_send_error( sock, &msg, NameError_ResponseCode, clientaddr );
+		return;
+	}
+
+	/* Names of the zone have no PTR records */
+	if( !dns_is_supported( msg.question.qType ) || msg.question.qType == PTR_Resource_RecordType ) {
+		log_debug( "DNS: Received request for unsupported record type %d.", msg.question.qType );
+		dns_send_error( sock, &msg, NoError_ResponseCode, clientaddr );
+		return;
 	}
 
 	if( msg.question.qType == A_Resource_RecordType && gconf->af != AF_INET ) {
 		log_debug( "DNS: Received request for IPv4 record (A), but DHT uses IPv6." );
+		dns_send_error( sock, &msg, NoError_ResponseCode, clientaddr );
 		return;
 	}
 
 	if( msg.question.qType == AAAA_Resource_RecordType && gconf->af != AF_INET6 ) {
 		log_debug( "DNS: Received request for IPv6 record (AAAA), but DHT uses IPv4." );
-		return;
-	}
-
-	if ( !str_isValidHostname( hostname ) ) {
-		log_warn( "DNS: Invalid hostname for lookup: '%s'", hostname );
+		dns_send_error( sock, &msg, NoError_ResponseCode, clientaddr );
 		return;
 	}
 
 	log_debug( "DNS: Received %s query from %s for: %s",
 		qtype_str( msg.question.qType ),
-		str_addr( &clientaddr ),
+		str_addr( clientaddr ),
 		hostname
 	);
 
-	if( msg.question.qType == PTR_Resource_RecordType ) {
-		if( (domain = dns_lookup_ptr( hostname )) == NULL ) {
-			log_debug( "DNS: No domain found for PTR question." );
-			return;
+	buflen = dns_answer_query( buffer, sizeof(buffer), &msg, clientaddr, 1 );
+
+	if( buflen == -2 ) {
+		dns_send_error( sock, &msg, NameError_ResponseCode, clientaddr );
+		return;
+	}
+
+	if( buflen < 0 ) {
+		dns_send_error( sock, &msg, ServerFailure_ResponseCode, clientaddr );
+		return;
+	}
+
+	if( buflen == 0 ) {
+		/* No results yet, answer later */
+		if( dns_pending_add( sock, &msg, clientaddr ) < 0 ) {
+			log_debug( "DNS: Too many pending queries, fail query for: %s", hostname );
+			dns_send_error( sock, &msg, ServerFailure_ResponseCode, clientaddr );
 		}
+		return;
+	}
 
-		if( dns_setup_msg( &msg, NULL, 0, domain ) < 0 ) {
-			return;
+	buflen = dns_fit_response( buffer, buflen, sizeof(buffer), &msg );
+	dns_send( sock, buffer, buflen, clientaddr );
+}
+
+void dns_handler( int rc, int sock ) {
+	UCHAR buffer[DNS_EDNS_SIZE];
+	socklen_t addrlen_ret;
+	IP clientaddr;
+	ssize_t buflen;
+
+	if( rc == 0 ) {
+		return;
+	}
+
+	memset( buffer, 0, sizeof(buffer) );
+	addrlen_ret = sizeof(IP);
+	buflen = recvfrom( sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &clientaddr, &addrlen_ret );
+
+	if( buflen < 0 ) {
+		return;
+	}
+
+	dns_handle_query( sock, buffer, buflen, &clientaddr, 0 );
+}
+
+void dns_tcp_write_handler( int rc, int fd ) {
+	struct dns_tcp_t *conn;
+
+	if( rc == 0 || (conn = dns_tcp_find( fd )) == NULL ) {
+		return;
+	}
+
+	dns_tcp_flush( conn );
+}
+
+/* Handle all complete queries of a connection, answers are sent together */
+void dns_tcp_handler( int rc, int fd ) {
+	UCHAR query[DNS_EDNS_SIZE];
+	struct dns_tcp_t *conn;
+	size_t offset;
+	size_t len;
+	ssize_t n;
+
+	if( (conn = dns_tcp_find( fd )) == NULL ) {
+		return;
+	}
+
+	if( rc == 0 ) {
+		if( (conn->last + DNS_TCP_IDLE) < time_now_sec() ) {
+			log_debug( "DNS: Close idle connection to %s", str_addr( &conn->clientaddr ) );
+			dns_tcp_close( conn );
 		}
+		return;
+	}
 
-		log_debug( "DNS: Send back hostname '%s' to: %s",
-			domain, str_addr( &clientaddr )
-		);
-	} else {
-		/* Check if hostname ends with .p2p */
-		if( !is_suffix( hostname, gconf->query_tld ) ) {
+	n = recv( fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0 );
+	if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+		return;
+	}
+
+	if( n <= 0 ) {
+		dns_tcp_close( conn );
+		return;
+	}
+
+	conn->in_len += n;
+	conn->last = time_now_sec();
+	conn->busy = 1;
+
+	offset = 0;
+	while( (conn->in_len - offset) >= 2 ) {
+		len = (conn->in[offset] << 8) + conn->in[offset + 1];
+		if( len > sizeof(query) ) {
+			log_debug( "DNS: Query too large, close connection to %s", str_addr( &conn->clientaddr ) );
+			dns_tcp_close( conn );
 			return;
 		}
 
-		if( (addrs_num = kadnode_lookup_addr( hostname, addrs, MAX_ADDR_RECORDS )) == 0 ) {
-			log_debug( "DNS: Failed to resolve hostname: %s", hostname );
-			return;
+		if( (conn->in_len - offset - 2) < len ) {
+			break;
 		}
 
-		if( dns_setup_msg( &msg, &addrs[0], addrs_num, NULL ) < 0 ) {
+		memset( query, 0, sizeof(query) );
+		memcpy( query, conn->in + offset + 2, len );
+		offset += 2 + len;
+
+		dns_handle_query( fd, query, len, &conn->clientaddr, 1 );
+		if( conn->fd < 0 ) {
+			/* Connection was closed */
 			return;
 		}
+	}
 
-		log_debug( "DNS: Send back %lu addresses to: %s",
-			addrs_num, str_addr( &clientaddr )
-		);
+	memmove( conn->in, conn->in + offset, conn->in_len - offset );
+	conn->in_len -= offset;
+	conn->busy = 0;
+
+	dns_tcp_flush( conn );
+}
+
+void dns_tcp_accept_handler( int rc, int sock ) {
+	struct dns_tcp_t *conn;
+	socklen_t addrlen;
+	IP clientaddr;
+	int fd;
+
+	if( rc == 0 ) {
+		return;
 	}
 
-	/* Encode message */
-	buflen = dns_encode_msg( buffer, sizeof(buffer), &msg );
+	addrlen = sizeof(IP);
+	fd = accept( sock, (struct sockaddr *) &clientaddr, &addrlen );
+	if( fd < 0 ) {
+		return;
+	}
 
-	if( buflen > 0 ) {
-		if( sendto( sock, buffer, buflen, 0, (struct sockaddr*) &clientaddr, addr_len(&clientaddr) ) < 0 ) {
-			log_warn( "DNS: Cannot send message to '%s': %s", str_addr( &clientaddr ), strerror( errno ) );
+	if( (conn = dns_tcp_find( -1 )) == NULL ) {
+		log_debug( "DNS: Too many connections, reject %s", str_addr( &clientaddr ) );
+		close( fd );
+		return;
+	}
+
+	if( net_set_nonblocking( fd ) < 0 ) {
+		close( fd );
+		return;
+	}
+
+	conn->fd = fd;
+	conn->clientaddr = clientaddr;
+	conn->last = time_now_sec();
+	conn->in_len = 0;
+	conn->out_len = 0;
+	conn->busy = 0;
+	conn->writing = 0;
+
+	net_add_handler( fd, &dns_tcp_handler );
+}
+
+#ifdef DNS_WORKERS
+/* Answer a query from the caches, returns 0 if the main thread has to answer it */
+int dns_worker_answer( struct dns_rrl_table_t *rrl, int sock, const UCHAR query[], size_t query_len, const IP *clientaddr ) {
+	UCHAR buffer[DNS_EDNS_SIZE];
+	struct Message msg;
+	ssize_t buflen;
+	time_t now;
+
+	memset( &msg, 0, sizeof(msg) );
+	if( query_len < 12 || dns_decode_msg( &msg, query, query_len ) < 0 ) {
+		return 0;
+	}
+
+	if( msg.qr == 1 || msg.opcode != QUERY_OperationCode || (msg.edns && msg.edns_version > 0) ) {
+		return 0;
+	}
+
+	msg.limit = dns_response_limit( &msg, 0 );
+	now = time( NULL );
+
+	if( is_suffix( msg.question.qName, gconf->query_tld ) ) {
+		buflen = dns_cache_get( buffer, sizeof(buffer), &msg, now );
+		if( buflen > 0 ) {
+			buflen = dns_fit_response( buffer, buflen, sizeof(buffer), &msg );
 		}
+	} else if( g_proxy_cache_table ) {
+		buflen = proxy_cache_get( buffer, msg.limit, query, query_len, &msg, now );
 	} else {
-		log_err( "DNS: Failed to create response packet." );
+		buflen = 0;
+	}
+
+	if( buflen <= 0 ) {
+		return 0;
+	}
+
+	switch( dns_rrl_response( rrl, clientaddr, now ) ) {
+		case RRL_DROP:
+			return 1;
+		case RRL_TRUNCATE:
+			if( (buflen = dns_truncate( buffer, buflen )) < 0 ) {
+				return 1;
+			}
+			break;
+	}
+
+	sendto( sock, buffer, buflen, 0, (const struct sockaddr *) clientaddr, addr_len( clientaddr ) );
+
+	return 1;
+}
+
+/* Pass a query to the main thread, returns -1 if the queue is full */
+int dns_worker_enqueue( struct dns_worker_t *worker, int sock, const UCHAR query[], size_t query_len, const IP *clientaddr ) {
+	struct dns_queue_slot_t *slot;
+	unsigned int head;
+
+	head = worker->head;
+	if( query_len > DNS_QUEUE_MSG_SIZE
+			|| (head - __atomic_load_n( &worker->tail, __ATOMIC_ACQUIRE )) >= DNS_QUEUE_SIZE ) {
+		return -1;
+	}
+
+	slot = &worker->slots[head & (DNS_QUEUE_SIZE - 1)];
+	slot->sock = sock;
+	slot->clientaddr = *clientaddr;
+	slot->len = query_len;
+	memcpy( slot->data, query, query_len );
+	__atomic_store_n( &worker->head, head + 1, __ATOMIC_SEQ_CST );
+
+	/* Only the first query since the main thread woke up writes to the pipe */
+	if( !__atomic_exchange_n( &g_dns_wakeup_pending, 1, __ATOMIC_SEQ_CST ) ) {
+		if( write( g_dns_wakeup[1], "", 1 ) < 0 ) {
+			/* The pipe is full, the main thread will wake up anyway */
+		}
+	}
+
+	return 0;
+}
+
+/* Count an event, the main thread only reads the counters */
+void dns_worker_count( unsigned long *counter ) {
+	__atomic_store_n( counter, *counter + 1, __ATOMIC_RELAXED );
+}
+
+void *dns_worker_loop( void *arg ) {
+	struct dns_worker_t *worker;
+	UCHAR query[DNS_EDNS_SIZE];
+	struct pollfd fds[2];
+	socklen_t addrlen;
+	IP clientaddr;
+	ssize_t len;
+	int i;
+
+	worker = (struct dns_worker_t *) arg;
+
+	/* poll() ignores negative file descriptors */
+	fds[0].fd = worker->sock4;
+	fds[0].events = POLLIN;
+	fds[1].fd = worker->sock6;
+	fds[1].events = POLLIN;
+
+	while( __atomic_load_n( &g_dns_workers_running, __ATOMIC_RELAXED ) ) {
+		if( poll( fds, N_ELEMS(fds), 500 ) <= 0 ) {
+			continue;
+		}
+
+		for( i = 0; i < N_ELEMS(fds); i++ ) {
+			if( !(fds[i].revents & POLLIN) ) {
+				continue;
+			}
+
+			memset( query, 0, sizeof(query) );
+			addrlen = sizeof(IP);
+			len = recvfrom( fds[i].fd, query, sizeof(query), MSG_DONTWAIT, (struct sockaddr *) &clientaddr, &addrlen );
+			if( len < 0 ) {
+				continue;
+			}
+
+			dns_worker_count( &worker->queries );
+
+			if( dns_worker_answer( &worker->rrl, fds[i].fd, query, len, &clientaddr ) ) {
+				dns_worker_count( &worker->hits );
+			} else if( dns_worker_enqueue( worker, fds[i].fd, query, len, &clientaddr ) == 0 ) {
+				dns_worker_count( &worker->forwarded );
+			} else {
+				dns_worker_count( &worker->dropped );
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Answer queries the workers have passed on and update the statistics */
+void dns_worker_handler( int rc, int fd ) {
+	static unsigned long queries_last = 0;
+	static time_t time_last = 0;
+	struct dns_queue_slot_t *slot;
+	struct dns_worker_t *worker;
+	UCHAR query[DNS_EDNS_SIZE];
+	unsigned long queries;
+	unsigned int head;
+	unsigned int tail;
+	char buf[64];
+	time_t now;
+	int i;
+
+	if( rc > 0 ) {
+		while( read( fd, buf, sizeof(buf) ) > 0 );
+	}
+
+	/*
+	* Reset before the queues are emptied, or a wakeup might get lost. Both
+	* sides store one variable and then read the other, that needs SEQ_CST.
+	*/
+	__atomic_store_n( &g_dns_wakeup_pending, 0, __ATOMIC_SEQ_CST );
+
+	queries = 0;
+	for( i = 0; i < g_dns_workers_num; i++ ) {
+		worker = g_dns_workers[i];
+		head = __atomic_load_n( &worker->head, __ATOMIC_SEQ_CST );
+		tail = worker->tail;
+
+		while( tail != head ) {
+			slot = &worker->slots[tail & (DNS_QUEUE_SIZE - 1)];
+			memset( query, 0, sizeof(query) );
+			memcpy( query, slot->data, slot->len );
+			dns_handle_query( slot->sock, query, slot->len, &slot->clientaddr, 0 );
+			tail++;
+			__atomic_store_n( &worker->tail, tail, __ATOMIC_RELEASE );
+		}
+
+		queries += __atomic_load_n( &worker->queries, __ATOMIC_RELAXED );
+	}
+
+	now = time_now_sec();
+	if( now > time_last ) {
+		if( time_last > 0 ) {
+			g_dns_workers_qps = (queries - queries_last) / (now - time_last);
+		}
+		queries_last = queries;
+		time_last = now;
+	}
+}
+
+/* Create a UDP socket that shares the DNS port with the other workers */
+int dns_worker_socket( const char addr[] ) {
+	const int opt_on = 1;
+	IP sockaddr;
+	int sock;
+
+	if( addr_parse( &sockaddr, addr, gconf->dns_port, AF_UNSPEC ) != 0 ) {
+		return -1;
+	}
+
+	sock = socket( sockaddr.ss_family, SOCK_DGRAM, IPPROTO_UDP );
+	if( sock < 0 ) {
+		log_err( "DNS: Failed to create worker socket: %s", strerror( errno ) );
+		return -1;
+	}
+
+	if( setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &opt_on, sizeof(opt_on) ) < 0
+			|| (sockaddr.ss_family == AF_INET6 && setsockopt( sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt_on, sizeof(opt_on) ) < 0)
+			|| bind( sock, (struct sockaddr *) &sockaddr, addr_len( &sockaddr ) ) < 0 ) {
+		log_err( "DNS: Failed to bind worker socket to %s: %s", str_addr( &sockaddr ), strerror( errno ) );
+		close( sock );
+		return -1;
+	}
+
+	return sock;
+}
+
+void dns_workers_setup( void ) {
+	struct dns_worker_t *worker;
+	int i;
+
+	if( pipe( g_dns_wakeup ) < 0
+			|| net_set_nonblocking( g_dns_wakeup[0] ) < 0
+			|| net_set_nonblocking( g_dns_wakeup[1] ) < 0 ) {
+		log_err( "DNS: Failed to create pipe: %s", strerror( errno ) );
+		exit( 1 );
+	}
+
+	net_add_handler( g_dns_wakeup[0], &dns_worker_handler );
+
+	g_dns_workers_running = 1;
+	for( i = 0; i < gconf->dns_workers; i++ ) {
+		worker = (struct dns_worker_t *) calloc( 1, sizeof(struct dns_worker_t) );
+		worker->sock4 = dns_worker_socket( "0.0.0.0" );
+		worker->sock6 = dns_worker_socket( "::1" );
+
+		if( worker->sock4 < 0 && worker->sock6 < 0 ) {
+			exit( 1 );
+		}
+
+		if( pthread_create( &worker->thread, NULL, &dns_worker_loop, worker ) != 0 ) {
+			log_err( "DNS: Failed to start worker thread." );
+			exit( 1 );
+		}
+
+		g_dns_workers[g_dns_workers_num++] = worker;
+	}
+
+	log_info( "DNS: Answer cached queries in %d worker threads", g_dns_workers_num );
+}
+
+void dns_workers_free( void ) {
+	struct dns_worker_t *worker;
+	int i;
+
+	__atomic_store_n( &g_dns_workers_running, 0, __ATOMIC_RELAXED );
+
+	for( i = 0; i < g_dns_workers_num; i++ ) {
+		worker = g_dns_workers[i];
+		pthread_join( worker->thread, NULL );
+		if( worker->sock4 >= 0 ) {
+			close( worker->sock4 );
+		}
+		if( worker->sock6 >= 0 ) {
+			close( worker->sock6 );
+		}
+		free( worker );
+		g_dns_workers[i] = NULL;
 	}
+	g_dns_workers_num = 0;
+
+	if( g_dns_wakeup[1] >= 0 ) {
+		close( g_dns_wakeup[1] );
+		g_dns_wakeup[1] = -1;
+	}
+}
+#endif
+
+
+int dns_status( char *buf, int size ) {
+#ifdef DNS_WORKERS
+	struct dns_worker_t *worker;
+#endif
+	struct proxy_server_t *server;
+	unsigned long dropped;
+	unsigned long slipped;
+	int written;
+	size_t i;
+
+	written = snprintf( buf, size, "DNS Responses: %lu ok (%lu nodata), %lu formerr, %lu servfail, %lu nxdomain, %lu notimp, %lu refused, %lu badvers\n",
+		g_dns_rcode_count[NoError_ResponseCode], g_dns_nodata_count,
+		g_dns_rcode_count[FormatError_ResponseCode], g_dns_rcode_count[ServerFailure_ResponseCode],
+		g_dns_rcode_count[NameError_ResponseCode], g_dns_rcode_count[NotImplemented_ResponseType],
+		g_dns_rcode_count[Refused_ResponseType], g_dns_badvers_count
+	);
+
+	if( (gconf->dns_rate_limit > 0 || gconf->dns_search_limit > 0) && written < size ) {
+		dropped = g_dns_rrl.dropped;
+		slipped = g_dns_rrl.slipped;
+#ifdef DNS_WORKERS
+		for( i = 0; i < g_dns_workers_num; i++ ) {
+			dropped += __atomic_load_n( &g_dns_workers[i]->rrl.dropped, __ATOMIC_RELAXED );
+			slipped += __atomic_load_n( &g_dns_workers[i]->rrl.slipped, __ATOMIC_RELAXED );
+		}
+#endif
+		written += snprintf( buf + written, size - written, "DNS Rate Limit: %lu responses dropped, %lu truncated, %lu searches refused\n",
+			dropped, slipped, g_dns_rrl.refused
+		);
+	}
+
+	if( g_proxy_servers_num > 0 && written < size ) {
+		written += snprintf( buf + written, size - written, "DNS Proxy: %lu queries in flight\n", g_proxy_count );
+	}
+
+	if( g_proxy_cache_table && written < size ) {
+		written += snprintf( buf + written, size - written, "DNS Proxy Cache: %lu entries, %lu hits, %lu misses\n",
+			g_proxy_cache_count, g_proxy_cache_hits, g_proxy_cache_misses
+		);
+	}
+
+#ifdef DNS_WORKERS
+	if( g_dns_workers_num > 0 && written < size ) {
+		written += snprintf( buf + written, size - written, "DNS Workers: %d threads, %lu queries/s\n",
+			g_dns_workers_num, g_dns_workers_qps
+		);
+	}
+
+	for( i = 0; i < g_dns_workers_num && written < size; i++ ) {
+		worker = g_dns_workers[i];
+		written += snprintf( buf + written, size - written,
+			" worker %d: %lu queries, %lu from cache, %lu passed on, %lu dropped\n", (int) i,
+			__atomic_load_n( &worker->queries, __ATOMIC_RELAXED ), __atomic_load_n( &worker->hits, __ATOMIC_RELAXED ),
+			__atomic_load_n( &worker->forwarded, __ATOMIC_RELAXED ), __atomic_load_n( &worker->dropped, __ATOMIC_RELAXED )
+		);
+	}
+#endif
+
+	for( i = 0; i < g_proxy_servers_num && written < size; i++ ) {
+		server = &g_proxy_servers[i];
+		written += snprintf( buf + written, size - written,
+			" %s: %u ms, %lu sent, %lu answered, %lu timeouts\n",
+			str_addr( &server->addr ), server->srtt, server->sent, server->answered, server->timeouts
+		);
+	}
+
+	return (written < size) ? written : size - 1;
 }
 
 void dns_setup( void ) {
+	size_t i;
+
 	if( str_isZero( gconf->dns_port ) ) {
 		return;
 	}
 
-	g_sock4 = net_bind( "DNS", "0.0.0.0", gconf->dns_port, NULL, IPPROTO_UDP, AF_UNSPEC );
-	net_add_handler( g_sock4, &dns_handler );
+	if( gconf->dns_workers > 0 ) {
+#ifdef DNS_WORKERS
+		/* Started below, after the caches are set up */
+#else
+		log_err( "DNS: Worker threads are not supported on this system." );
+		exit( 1 );
+#endif
+	} else {
+		g_sock4 = net_bind( "DNS", "0.0.0.0", gconf->dns_port, NULL, IPPROTO_UDP, AF_UNSPEC );
+		net_add_handler( g_sock4, &dns_handler );
+
+		g_sock6 = net_bind( "DNS", "::1", gconf->dns_port, NULL, IPPROTO_UDP, AF_UNSPEC );
+		net_add_handler( g_sock6, &dns_handler );
+	}
+
+	g_tcp_sock4 = net_bind( "DNS", "0.0.0.0", gconf->dns_port, NULL, IPPROTO_TCP, AF_UNSPEC );
+	if( g_tcp_sock4 >= 0 ) {
+		net_add_handler( g_tcp_sock4, &dns_tcp_accept_handler );
+	}
+
+	g_tcp_sock6 = net_bind( "DNS", "::1", gconf->dns_port, NULL, IPPROTO_TCP, AF_UNSPEC );
+	if( g_tcp_sock6 >= 0 ) {
+		net_add_handler( g_tcp_sock6, &dns_tcp_accept_handler );
+	}
+
+	for( i = 0; i < N_ELEMS(g_dns_tcp); i++ ) {
+		g_dns_tcp[i].fd = -1;
+	}
+
+	for( i = 0; i < N_ELEMS(g_dns_pending); i++ ) {
+		g_dns_pending[i].sock = -1;
+	}
+
+	/* Answer or fail pending queries */
+	net_add_handler( -1, &dns_handle_pending );
+
+	for( i = 0; i < g_proxy_servers_num; i++ ) {
+		log_info( "DNS: Forward foreign requests to %s", str_addr( &g_proxy_servers[i].addr ) );
+
+		if( g_proxy_servers[i].addr.ss_family == AF_INET && g_proxy_sock4 < 0 ) {
+			g_proxy_sock4 = net_socket( "DNS", NULL, IPPROTO_UDP, AF_INET );
+			net_add_handler( g_proxy_sock4, &proxy_handler );
+		}
+
+		if( g_proxy_servers[i].addr.ss_family == AF_INET6 && g_proxy_sock6 < 0 ) {
+			g_proxy_sock6 = net_socket( "DNS", NULL, IPPROTO_UDP, AF_INET6 );
+			net_add_handler( g_proxy_sock6, &proxy_handler );
+		}
+	}
+
+	if( g_proxy_servers_num > 0 ) {
+		/* Retry or fail forwarded queries */
+		net_add_handler( -1, &proxy_handle_timeouts );
+	}
+
+	if( g_proxy_servers_num > 0 && gconf->dns_proxy_cache > 0 ) {
+		g_proxy_cache_table_size = 1;
+		while( g_proxy_cache_table_size < (size_t) gconf->dns_proxy_cache ) {
+			g_proxy_cache_table_size *= 2;
+		}
+		g_proxy_cache_table = (struct proxy_cache_t**) calloc( g_proxy_cache_table_size, sizeof(struct proxy_cache_t*) );
+	}
 
-	g_sock6 = net_bind( "DNS", "::1", gconf->dns_port, NULL, IPPROTO_UDP, AF_UNSPEC );
-	net_add_handler( g_sock6, &dns_handler );
+#ifdef DNS_WORKERS
+	if( gconf->dns_workers > 0 ) {
+		dns_workers_setup();
+	}
+#endif
 }
 
 void dns_free( void ) {
-	/* Nothing to do */
+	size_t i;
+
+#ifdef DNS_WORKERS
+	/* Workers read the caches */
+	dns_workers_free();
+#endif
+
+	for( i = 0; i < DNS_CACHE_SIZE; i++ ) {
+		dns_cache_clear( &g_dns_cache[i] );
+	}
+
+	for( i = 0; i < N_ELEMS(g_dns_tcp); i++ ) {
+		if( g_dns_tcp[i].fd >= 0 ) {
+			dns_tcp_close( &g_dns_tcp[i] );
+		}
+	}
+
+	while( g_proxy_oldest ) {
+		proxy_remove( g_proxy_oldest );
+	}
+
+	while( g_proxy_cache_oldest ) {
+		proxy_cache_remove( g_proxy_cache_oldest );
+	}
+	free( g_proxy_cache_table );
+	g_proxy_cache_table = NULL;
 }
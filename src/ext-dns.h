@@ -2,7 +2,16 @@
 #ifndef _EXT_DNS_H_
 #define _EXT_DNS_H_
 
+/* Maximum number of threads that answer cached queries */
+#define DNS_MAX_WORKERS 64
+
 void dns_setup( void );
 void dns_free( void );
 
+/* Add an external DNS server for foreign queries */
+void dns_add_server( const char addr_str[] );
+
+/* Print response counters */
+int dns_status( char *buf, int size );
+
 #endif /* _EXT_DNS_H_ */
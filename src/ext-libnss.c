@@ -1,11 +1,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <nss.h>
 
@@ -16,92 +23,402 @@
 #endif
 
 #include "main.h"
+#include "ext-nss.h"
+
+/* Milliseconds the daemon may wait for a search to find addresses */
+#define NSS_LOOKUP_TIMEOUT 3000
+
+/* Shared memory table published by the daemon */
+static struct nss_shm_t *g_shm = NULL;
+/* Inode of the mapped table and when it was last compared to the current one */
+static ino_t g_shm_ino = 0;
+static time_t g_shm_checked = 0;
+
+/* Every thread has its own socket, so replies cannot get mixed up */
+struct _nss_kadnode_conn_t {
+	int sock;
+	pid_t pid;
+	unsigned int id;
+	struct sockaddr_un local;
+};
+
+static pthread_key_t g_conn_key;
+static pthread_once_t g_conn_once = PTHREAD_ONCE_INIT;
+
+
+/* Must match the hash used in ext-nss.c */
+unsigned int _nss_kadnode_shm_hash( const char name[], int len ) {
+	unsigned int hash;
+	int i;
+
+	hash = 2166136261U;
+	for( i = 0; i < len; i++ ) {
+		hash = (hash ^ (UCHAR) name[i]) * 16777619U;
+	}
+
+	return hash;
+}
 
-#define MAX_ADDRS 32
+/* A table of a running daemon */
+int _nss_kadnode_shm_valid( const struct nss_shm_t *shm, time_t now ) {
+	return shm->magic == NSS_SHM_MAGIC
+		&& shm->slots_num == NSS_SHM_SLOTS
+		&& (now - shm->alive) <= NSS_SHM_STALE;
+}
 
+/*
+* Everybody can create objects in /dev/shm. Only trust a table
+* that was created by root or ourselves and that nobody else
+* can write to.
+*/
+int _nss_kadnode_shm_trusted( const struct stat *st ) {
+	return (st->st_uid == 0 || st->st_uid == geteuid())
+		&& (st->st_mode & (S_IWGRP | S_IWOTH)) == 0
+		&& st->st_size >= sizeof(struct nss_shm_t);
+}
 
 /*
-* Parse/Resolve an IP address.
-* The port must be specified separately.
+* Get the shared memory table. Once a second it is checked that
+* the mapped table is still the published one, it is mapped again
+* when the daemon has been restarted.
 */
-int _nss_kadnode_addr_parse( IP *addr, const char addr_str[], const char port_str[], int af ) {
-	struct addrinfo hints;
-	struct addrinfo *info = NULL;
-	struct addrinfo *p = NULL;
+struct nss_shm_t *_nss_kadnode_shm_get( void ) {
+	struct nss_shm_t *shm;
+	struct nss_shm_t *old;
+	struct stat st;
+	time_t now;
+	int fd;
+
+	now = time( NULL );
+	old = g_shm;
+	if( old && now == g_shm_checked && _nss_kadnode_shm_valid( old, now ) ) {
+		return old;
+	}
 
-	memset( &hints, '\0', sizeof(struct addrinfo) );
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_family = af;
+	if( (fd = shm_open( NSS_SHM_NAME, O_RDONLY, 0 )) < 0 ) {
+		return NULL;
+	}
 
-	if( getaddrinfo( addr_str, port_str, &hints, &info ) != 0 ) {
-		return -2;
+	if( fstat( fd, &st ) < 0 || !_nss_kadnode_shm_trusted( &st ) ) {
+		close( fd );
+		return NULL;
 	}
 
-	p = info;
-	while( p != NULL ) {
-		if( p->ai_family == AF_INET6 ) {
-			memcpy( addr, p->ai_addr, sizeof(IP6) );
-			freeaddrinfo( info );
-			return 0;
+	/* Still the same table */
+	if( old && st.st_ino == g_shm_ino && _nss_kadnode_shm_valid( old, now ) ) {
+		close( fd );
+		g_shm_checked = now;
+		return old;
+	}
+
+	shm = mmap( NULL, sizeof(struct nss_shm_t), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+
+	if( shm == MAP_FAILED ) {
+		return NULL;
+	}
+
+	if( !_nss_kadnode_shm_valid( shm, now ) ) {
+		munmap( shm, sizeof(struct nss_shm_t) );
+		return NULL;
+	}
+
+	/*
+	* Other threads might still read from the old table,
+	* so it stays mapped. This only happens on daemon restarts.
+	*/
+	if( !__sync_bool_compare_and_swap( &g_shm, old, shm ) ) {
+		munmap( shm, sizeof(struct nss_shm_t) );
+		return g_shm;
+	}
+
+	g_shm_ino = st.st_ino;
+	g_shm_checked = now;
+
+	return shm;
+}
+
+/* Keep the entries of the requested family only */
+int _nss_kadnode_filter( struct nss_entry_t entries[], int num, int af ) {
+	int n;
+	int i;
+
+	n = 0;
+	for( i = 0; i < num; i++ ) {
+		if( (af == AF_UNSPEC && (entries[i].family == AF_INET || entries[i].family == AF_INET6))
+				|| entries[i].family == af ) {
+			entries[n++] = entries[i];
 		}
-		if( p->ai_family == AF_INET ) {
-			memcpy( addr, p->ai_addr, sizeof(IP4) );
-			freeaddrinfo( info );
+	}
+
+	return n;
+}
+
+/*
+* Lookup a hostname in the shared memory table.
+* A hit needs no system call and no daemon.
+*/
+int _nss_kadnode_shm_lookup( const char hostname[], int hostlen, int af, struct nss_entry_t entries[] ) {
+	const struct nss_shm_slot_t *slot;
+	struct nss_shm_t *shm;
+	unsigned int seq;
+	unsigned int num;
+	time_t expire;
+	time_t now;
+	int match;
+	int tries;
+	int i;
+
+	if( hostlen >= NSS_SHM_NAME_SIZE || (shm = _nss_kadnode_shm_get()) == NULL ) {
+		return 0;
+	}
+
+	slot = &shm->slots[_nss_kadnode_shm_hash( hostname, hostlen ) % NSS_SHM_SLOTS];
+
+	for( tries = 0; tries < 8; tries++ ) {
+		seq = slot->seq;
+		if( seq & 1 ) {
+			/* Daemon is writing the slot */
+			continue;
+		}
+		__sync_synchronize();
+
+		match = (memcmp( slot->name, hostname, hostlen ) == 0 && slot->name[hostlen] == '\0');
+		num = slot->num;
+		expire = slot->expire;
+		if( num > NSS_SHM_ADDRS ) {
+			num = 0;
+		}
+		memcpy( entries, slot->entries, num * sizeof(struct nss_entry_t) );
+
+		__sync_synchronize();
+		if( slot->seq != seq ) {
+			continue;
+		}
+
+		now = time( NULL );
+		if( !match || num == 0 || expire <= now ) {
 			return 0;
 		}
+
+		/* Remaining lifetime of the entry */
+		for( i = 0; i < num; i++ ) {
+			entries[i].ttl = htonl( expire - now );
+		}
+
+		return _nss_kadnode_filter( entries, num, af );
 	}
 
-	freeaddrinfo( info );
-	return -3;
+	return 0;
 }
 
-int _nss_kadnode_addr_len( const IP *addr ) {
-	switch( addr->ss_family ) {
-		case AF_INET:
-			return sizeof(IP4);
-		case AF_INET6:
-			return sizeof(IP6);
-		default:
-			return 0;
+void _nss_kadnode_conn_close( struct _nss_kadnode_conn_t *conn ) {
+	close( conn->sock );
+
+	/* Remove the socket file, but not the one of the parent process */
+	if( conn->local.sun_path[0] != '\0' && conn->pid == getpid() ) {
+		unlink( conn->local.sun_path );
 	}
+
+	free( conn );
+}
+
+void _nss_kadnode_conn_destroy( void *ptr ) {
+	_nss_kadnode_conn_close( (struct _nss_kadnode_conn_t *) ptr );
+}
+
+void _nss_kadnode_conn_init( void ) {
+	pthread_key_create( &g_conn_key, &_nss_kadnode_conn_destroy );
+}
+
+/* A path starting with @ refers to the abstract namespace on Linux */
+socklen_t _nss_kadnode_unix_addr( struct sockaddr_un *addr, const char path[] ) {
+	size_t len;
+
+	len = strlen( path );
+	if( len >= sizeof(addr->sun_path) ) {
+		return 0;
+	}
+
+	memset( addr, '\0', sizeof(struct sockaddr_un) );
+	addr->sun_family = AF_UNIX;
+	memcpy( addr->sun_path, path, len );
+
+	if( path[0] == '@' ) {
+		addr->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	return sizeof(struct sockaddr_un);
 }
 
-int _nss_kadnode_lookup( const char hostname[], int hostlen, IP addrs[] ) {
-	IP sockaddr;
+/* Create a socket connected to the daemon */
+struct _nss_kadnode_conn_t *_nss_kadnode_conn_open( void ) {
+	struct _nss_kadnode_conn_t *conn;
+	struct sockaddr_un addr;
 	socklen_t addrlen;
-	int sockfd, size;
 	struct timeval tv;
 
-	if( _nss_kadnode_addr_parse( &sockaddr, "::1", NSS_PORT, AF_UNSPEC ) < 0 ) {
-		return 0;
+	if( (conn = calloc( 1, sizeof(struct _nss_kadnode_conn_t) )) == NULL ) {
+		return NULL;
 	}
 
-	/* Setup UDP socket */
-	if( (sockfd = socket( sockaddr.ss_family, SOCK_DGRAM, IPPROTO_UDP )) < 0 ) {
-		return 0;
+	conn->pid = getpid();
+
+	if( (conn->sock = socket( AF_UNIX, SOCK_DGRAM, 0 )) < 0 ) {
+		free( conn );
+		return NULL;
 	}
 
-	/* Set receive timeout to 0.1 seconds */
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
-	if( setsockopt( sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval) ) < 0 ) {
-		return 0;
+	fcntl( conn->sock, F_SETFD, FD_CLOEXEC );
+
+	/* A datagram socket needs an own address to receive replies */
+#ifdef __linux__
+	/* Let the kernel pick an abstract address */
+	addr.sun_family = AF_UNIX;
+	addrlen = offsetof(struct sockaddr_un, sun_path);
+#else
+	snprintf( conn->local.sun_path, sizeof(conn->local.sun_path),
+		"%s.%d.%d", NSS_PATH, (int) conn->pid, conn->sock );
+	conn->local.sun_family = AF_UNIX;
+	unlink( conn->local.sun_path );
+	memcpy( &addr, &conn->local, sizeof(addr) );
+	addrlen = sizeof(struct sockaddr_un);
+#endif
+
+	if( bind( conn->sock, (struct sockaddr *) &addr, addrlen ) < 0 ) {
+		conn->local.sun_path[0] = '\0';
+		_nss_kadnode_conn_close( conn );
+		return NULL;
 	}
 
-	addrlen = _nss_kadnode_addr_len( &sockaddr );
-	size = sendto( sockfd, hostname, hostlen, 0, (struct sockaddr *)&sockaddr, addrlen );
-	if( size != hostlen ) {
-		return 0;
+	/* Wait a bit longer than the daemon holds the request */
+	tv.tv_sec = (NSS_LOOKUP_TIMEOUT + 100) / 1000;
+	tv.tv_usec = ((NSS_LOOKUP_TIMEOUT + 100) % 1000) * 1000;
+
+	/* Fail fast if the daemon is not running */
+	addrlen = _nss_kadnode_unix_addr( &addr, NSS_PATH );
+	if( setsockopt( conn->sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval) ) < 0
+			|| connect( conn->sock, (struct sockaddr *) &addr, addrlen ) < 0 ) {
+		_nss_kadnode_conn_close( conn );
+		return NULL;
+	}
+
+	return conn;
+}
+
+/* Get the socket of this thread, a forked child creates its own */
+struct _nss_kadnode_conn_t *_nss_kadnode_conn_get( void ) {
+	struct _nss_kadnode_conn_t *conn;
+
+	pthread_once( &g_conn_once, &_nss_kadnode_conn_init );
+
+	conn = pthread_getspecific( g_conn_key );
+	if( conn && conn->pid != getpid() ) {
+		_nss_kadnode_conn_close( conn );
+		conn = NULL;
 	}
 
-	size = recvfrom( sockfd, addrs, MAX_ADDRS * sizeof(IP), 0, (struct sockaddr *)&sockaddr, &addrlen );
+	if( conn == NULL ) {
+		conn = _nss_kadnode_conn_open();
+		pthread_setspecific( g_conn_key, conn );
+	}
 
-	if( size > 0 && (size % sizeof(IP)) == 0 ) {
-		/* Return number of addresses */
-		return (size / sizeof(IP));
-	} else {
+	return conn;
+}
+
+void _nss_kadnode_conn_drop( struct _nss_kadnode_conn_t *conn ) {
+	_nss_kadnode_conn_close( conn );
+	pthread_setspecific( g_conn_key, NULL );
+}
+
+int _nss_kadnode_request( struct _nss_kadnode_conn_t *conn, const char hostname[], int hostlen, int af, struct nss_entry_t entries[] ) {
+	UCHAR buffer[sizeof(struct nss_reply_t) + NSS_MAX_ENTRIES * sizeof(struct nss_entry_t)];
+	struct nss_request_t *request;
+	struct nss_reply_t *reply;
+	int reqlen;
+	int size;
+
+	request = (struct nss_request_t *) buffer;
+	request->version = NSS_PROTOCOL_VERSION;
+	request->family = af;
+	request->timeout = htons( NSS_LOOKUP_TIMEOUT );
+	request->id = ++conn->id;
+	memcpy( request->hostname, hostname, hostlen );
+	reqlen = sizeof(struct nss_request_t) + hostlen;
+
+	if( send( conn->sock, buffer, reqlen, 0 ) != reqlen ) {
+		return -1;
+	}
+
+	while( 1 ) {
+		size = recv( conn->sock, buffer, sizeof(buffer), 0 );
+		if( size < 0 ) {
+			/* Timeout or the daemon is gone */
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		reply = (struct nss_reply_t *) buffer;
+		if( size < sizeof(struct nss_reply_t) || reply->version != NSS_PROTOCOL_VERSION
+				|| reply->num > NSS_MAX_ENTRIES
+				|| size != sizeof(struct nss_reply_t) + reply->num * sizeof(struct nss_entry_t) ) {
+			return 0;
+		}
+
+		/* Ignore a late reply to an earlier request */
+		if( reply->id == conn->id ) {
+			break;
+		}
+	}
+
+	memcpy( entries, reply->entries, reply->num * sizeof(struct nss_entry_t) );
+
+	return _nss_kadnode_filter( entries, reply->num, af );
+}
+
+int _nss_kadnode_lookup( const char hostname[], int hostlen, int af, struct nss_entry_t entries[] ) {
+	struct _nss_kadnode_conn_t *conn;
+	int num;
+
+	/* Try the shared memory table first */
+	if( (num = _nss_kadnode_shm_lookup( hostname, hostlen, af, entries )) > 0 ) {
+		return num;
+	}
+
+	if( (conn = _nss_kadnode_conn_get()) == NULL ) {
 		return 0;
 	}
+
+	if( (num = _nss_kadnode_request( conn, hostname, hostlen, af, entries )) < 0 ) {
+		/* The daemon might have been restarted, connect again */
+		_nss_kadnode_conn_drop( conn );
+		if( (conn = _nss_kadnode_conn_get()) == NULL ) {
+			return 0;
+		}
+		if( (num = _nss_kadnode_request( conn, hostname, hostlen, af, entries )) < 0 ) {
+			_nss_kadnode_conn_drop( conn );
+			return 0;
+		}
+	}
+
+	return num;
+}
+
+/* Smallest TTL of all entries */
+int32_t _nss_kadnode_ttl( const struct nss_entry_t entries[], int num ) {
+	unsigned int ttl;
+	unsigned int min;
+	int i;
+
+	min = 0;
+	for( i = 0; i < num; i++ ) {
+		ttl = ntohl( entries[i].ttl );
+		if( i == 0 || ttl < min ) {
+			min = ttl;
+		}
+	}
+
+	return min;
 }
 
 int _nss_kadnode_valid_hostname( const char hostname[], int hostlen ) {
@@ -133,14 +450,12 @@ enum nss_status _nss_kadnode_gaih_addrtuple(
 	const char *hostname, int hostlen, struct gaih_addrtuple **pat,
 	char *buf, size_t buflen, int *errnop, int *h_errnop, int32_t *ttlp ) {
 
-	IP addrs[MAX_ADDRS];
+	struct nss_entry_t entries[NSS_MAX_ENTRIES];
 	char *p_name;
 	char *p_idx;
 	struct gaih_addrtuple *p_tuple;
 	struct gaih_addrtuple *p_start;
 	int addrsnum;
-	int addrlen;
-	int af;
 	int i;
 
 	if( !_nss_kadnode_valid_hostname( hostname, hostlen ) ) {
@@ -149,17 +464,11 @@ enum nss_status _nss_kadnode_gaih_addrtuple(
 		return NSS_STATUS_NOTFOUND;
 	}
 
-	memset( addrs, '\0', sizeof(addrs) );
-	if( (addrsnum = _nss_kadnode_lookup( hostname, hostlen, addrs )) <= 0 ) {
+	/* Both address families at once */
+	if( (addrsnum = _nss_kadnode_lookup( hostname, hostlen, AF_UNSPEC, entries )) <= 0 ) {
 		*errnop = ENOENT;
 		*h_errnop = HOST_NOT_FOUND;
 		return NSS_STATUS_NOTFOUND;
-	} else if( addrs[0].ss_family == AF_INET6 ) {
-		af = AF_INET6;
-		addrlen = sizeof(struct in6_addr);
-	} else {
-		af = AF_INET;
-		addrlen = sizeof(struct in_addr);
 	}
 
 	/* Check upper bound */
@@ -181,11 +490,11 @@ enum nss_status _nss_kadnode_gaih_addrtuple(
 	for( i = 0; i < addrsnum; i++ ) {
 		p_tuple = (struct gaih_addrtuple*) p_idx;
 		p_tuple->name = p_name;
-		p_tuple->family = af;
-		if( af == AF_INET6 ) {
-			memcpy( p_tuple->addr, &((IP6 *)&addrs[i])->sin6_addr, addrlen );
+		p_tuple->family = entries[i].family;
+		if( entries[i].family == AF_INET6 ) {
+			memcpy( p_tuple->addr, entries[i].addr, sizeof(struct in6_addr) );
 		} else {
-			memcpy( p_tuple->addr, &((IP4 *)&addrs[i])->sin_addr, addrlen );
+			memcpy( p_tuple->addr, entries[i].addr, sizeof(struct in_addr) );
 		}
 		p_tuple->scopeid = 0;
 
@@ -203,19 +512,23 @@ enum nss_status _nss_kadnode_gaih_addrtuple(
 	*pat = p_start;
 
 	if( ttlp != NULL ) {
-		*ttlp = 0;
+		*ttlp = _nss_kadnode_ttl( entries, addrsnum );
 	}
 
 	return NSS_STATUS_SUCCESS;
 }
 #endif
 
+/*
+* Fill in a hostent for addresses of the given family.
+* For AF_UNSPEC the family of the first address is used.
+*/
 enum nss_status _nss_kadnode_hostent(
 		const char *hostname, int af, struct hostent *host,
 		char *buf, size_t buflen, int *errnop,
 		int *h_errnop, int32_t *ttlp, char **canonp ) {
 
-	IP addrs[MAX_ADDRS];
+	struct nss_entry_t entries[NSS_MAX_ENTRIES];
 	char *p_addr;
 	char *p_name;
 	char *p_aliases;
@@ -228,7 +541,7 @@ enum nss_status _nss_kadnode_hostent(
 
 	hostlen = strlen( hostname );
 
-	if( af != AF_INET6 && af != AF_INET ) {
+	if( af != AF_INET6 && af != AF_INET && af != AF_UNSPEC ) {
 		*errnop = EAFNOSUPPORT;
 		*h_errnop = NO_DATA;
 		return NSS_STATUS_UNAVAIL;
@@ -240,24 +553,28 @@ enum nss_status _nss_kadnode_hostent(
 		return NSS_STATUS_NOTFOUND;
 	}
 
-	memset( addrs, '\0', sizeof(addrs) );
-	if( (addrsnum = _nss_kadnode_lookup( hostname, hostlen, addrs )) <= 0 ) {
+	if( (addrsnum = _nss_kadnode_lookup( hostname, hostlen, af, entries )) <= 0 ) {
 		*errnop = ENOENT;
 		*h_errnop = HOST_NOT_FOUND;
 		return NSS_STATUS_NOTFOUND;
 	}
 
+	if( af == AF_UNSPEC ) {
+		af = entries[0].family;
+		addrsnum = _nss_kadnode_filter( entries, addrsnum, af );
+	}
+
+	if( af == AF_INET6 ) {
+		addrlen = sizeof(struct in6_addr);
+	} else {
+		addrlen = sizeof(struct in_addr);
+	}
+
 	/* Check upper bound */
-	if( buflen < ((hostlen + 1) + sizeof(char*) + (addrsnum * sizeof(struct in6_addr)) + (addrsnum + 1) * sizeof(char*)) ) {
+	if( buflen < ((hostlen + 1) + sizeof(char*) + (addrsnum * addrlen) + (addrsnum + 1) * sizeof(char*)) ) {
 		*errnop = ENOMEM;
 		*h_errnop = NO_RECOVERY;
 		return NSS_STATUS_TRYAGAIN;
-	} else if( addrs[0].ss_family == AF_INET6 ) {
-		af = AF_INET6;
-		addrlen = sizeof(struct in6_addr);
-	} else {
-		af = AF_INET;
-		addrlen = sizeof(struct in_addr);
 	}
 
 	memset( buf, '\0', buflen );
@@ -275,11 +592,7 @@ enum nss_status _nss_kadnode_hostent(
 	/* Address data */
 	p_addr = p_idx;
 	for( i = 0; i < addrsnum; i++ ) {
-		if( af == AF_INET6 ) {
-			memcpy( p_addr, &((IP6 *)&addrs[i])->sin6_addr, addrlen );
-		} else {
-			memcpy( p_addr, &((IP4 *)&addrs[i])->sin_addr, addrlen );
-		}
+		memcpy( p_addr + i * addrlen, entries[i].addr, addrlen );
 	}
 	p_idx += addrsnum * addrlen;
 
@@ -299,7 +612,7 @@ enum nss_status _nss_kadnode_hostent(
 	host->h_addr_list = (char**) p_addr_list;
 
 	if( ttlp != NULL ) {
-		*ttlp = 0;
+		*ttlp = _nss_kadnode_ttl( entries, addrsnum );
 	}
 
 	if( canonp != NULL ) {
@@ -313,7 +626,7 @@ enum nss_status _nss_kadnode_gethostbyname_r(
 		const char *hostname, struct hostent *host,
 		char *buf, size_t buflen, int *errnop, int *h_errnop ) {
 
-	return _nss_kadnode_hostent( hostname, AF_INET6, host,
+	return _nss_kadnode_hostent( hostname, AF_UNSPEC, host,
 		buf, buflen, errnop, h_errnop, NULL, NULL );
 }
 
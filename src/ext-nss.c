@@ -1,6 +1,15 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include "main.h"
 #include "conf.h"
@@ -8,79 +17,483 @@
 #include "utils.h"
 #include "kad.h"
 #include "net.h"
+#include "results.h"
+#include "history.h"
 #include "ext-nss.h"
 
-#define MAX_ADDRS 32
+/* Upper limit for how long a request is held, in milliseconds */
+#define NSS_MAX_TIMEOUT 10000
+#define NSS_MAX_PENDING 64
 
+/* Seconds the addresses of a running search can be cached */
+#define NSS_SEARCH_TTL 10
 
-void nss_lookup( int sock, IP *clientaddr, const char hostname[] ) {
-	socklen_t addrlen;
-	IP addrs[MAX_ADDRS];
+/* A request that waits for the search to find results */
+struct nss_pending_t {
+	int sock; /* -1 if the slot is unused */
+	struct sockaddr_un clientaddr;
+	socklen_t clientlen;
+	unsigned int id;
+	int family;
+	char hostname[QUERY_MAX_SIZE];
+	struct timeval deadline;
+};
+
+static struct nss_pending_t g_nss_pending[NSS_MAX_PENDING];
+
+/* Shared memory table of resolved names, NULL if not available */
+static struct nss_shm_t *g_nss_shm = NULL;
+
+
+/* Must match the hash used in ext-libnss.c */
+unsigned int nss_shm_hash( const char name[] ) {
+	unsigned int hash;
+
+	hash = 2166136261U;
+	while( *name ) {
+		hash = (hash ^ (UCHAR) *name++) * 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+* Write the addresses of a hostname into its slot. Readers
+* retry or ignore a slot while the sequence counter is odd
+* or has changed during their read.
+*/
+void nss_shm_publish( const char hostname[], const struct nss_entry_t entries[], size_t num, time_t expire ) {
+	struct nss_shm_slot_t *slot;
+	size_t len;
+
+	len = strlen( hostname );
+	if( g_nss_shm == NULL || len >= NSS_SHM_NAME_SIZE ) {
+		return;
+	}
+
+	slot = &g_nss_shm->slots[nss_shm_hash( hostname ) % NSS_SHM_SLOTS];
+
+	/* Nothing to remove */
+	if( num == 0 && strcmp( slot->name, hostname ) != 0 ) {
+		return;
+	}
+
+	if( num > NSS_SHM_ADDRS ) {
+		num = NSS_SHM_ADDRS;
+	}
+
+	slot->seq++;
+	__sync_synchronize();
+
+	memcpy( slot->name, hostname, len + 1 );
+	memcpy( slot->entries, entries, num * sizeof(struct nss_entry_t) );
+	slot->num = num;
+	slot->expire = expire;
+
+	__sync_synchronize();
+	slot->seq++;
+}
+
+/* Called before privileges are dropped, so the table is owned by root if possible */
+void nss_shm_setup( void ) {
+	struct nss_shm_t *shm;
+	int fd;
+
+	if( str_isZero( gconf->nss_path ) ) {
+		return;
+	}
+
+	/* Drop a table left behind by a previous instance */
+	if( shm_unlink( NSS_SHM_NAME ) < 0 && errno != ENOENT && errno != ENOSYS ) {
+		log_err( "NSS: Failed to remove shared memory %s: %s", NSS_SHM_NAME, strerror( errno ) );
+		exit( 1 );
+	}
+
+	fd = shm_open( NSS_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0644 );
+	if( fd < 0 && errno == EEXIST ) {
+		/* Another process created it in the meantime */
+		log_err( "NSS: Shared memory %s was created by another process.", NSS_SHM_NAME );
+		exit( 1 );
+	} else if( fd < 0 ) {
+		log_warn( "NSS: Failed to create shared memory %s: %s", NSS_SHM_NAME, strerror( errno ) );
+		return;
+	}
+
+	/* Not affected by the umask */
+	if( fchmod( fd, 0644 ) < 0 || ftruncate( fd, sizeof(struct nss_shm_t) ) < 0 ) {
+		log_warn( "NSS: Failed to resize shared memory: %s", strerror( errno ) );
+		close( fd );
+		shm_unlink( NSS_SHM_NAME );
+		return;
+	}
+
+	shm = mmap( NULL, sizeof(struct nss_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+
+	if( shm == MAP_FAILED ) {
+		log_warn( "NSS: Failed to map shared memory: %s", strerror( errno ) );
+		shm_unlink( NSS_SHM_NAME );
+		return;
+	}
+
+	/* Memory is zeroed, mark the table as ready last */
+	shm->slots_num = NSS_SHM_SLOTS;
+	shm->alive = time_now_sec();
+	__sync_synchronize();
+	shm->magic = NSS_SHM_MAGIC;
+
+	g_nss_shm = shm;
+}
+
+void nss_shm_free( void ) {
+	if( g_nss_shm == NULL ) {
+		return;
+	}
+
+	/* Tell readers to stop using this table */
+	g_nss_shm->magic = 0;
+	munmap( g_nss_shm, sizeof(struct nss_shm_t) );
+	shm_unlink( NSS_SHM_NAME );
+	g_nss_shm = NULL;
+}
+
+void nss_entry_set( struct nss_entry_t *entry, const IP *addr, unsigned int ttl ) {
+	memset( entry, '\0', sizeof(struct nss_entry_t) );
+	entry->family = addr->ss_family;
+	entry->ttl = htonl( ttl );
+	if( addr->ss_family == AF_INET6 ) {
+		entry->port = ((IP6 *)addr)->sin6_port;
+		memcpy( entry->addr, &((IP6 *)addr)->sin6_addr, 16 );
+	} else {
+		entry->port = ((IP4 *)addr)->sin_port;
+		memcpy( entry->addr, &((IP4 *)addr)->sin_addr, 4 );
+	}
+}
+
+/*
+* Lookup the addresses of a hostname. Returns the number of entries
+* of the requested family or -1 if the search is still running
+* without results.
+*/
+int nss_lookup( const char hostname[], int family, struct nss_entry_t entries[], int search ) {
+	struct results_t *results;
+	IP addrs[NSS_MAX_ENTRIES];
+	time_t ttl;
 	size_t num;
+	size_t i;
+	int n;
 
-	/* Return at most MAX_ADDRS addresses */
-	num = MAX_ADDRS;
+	/* Return at most NSS_MAX_ENTRIES addresses */
+	num = NSS_MAX_ENTRIES;
 
 	/* Lookup id. Starts search when not already started. */
-	if( kad_lookup_value( hostname, addrs, &num ) >= 0 && num > 0 ) {
-		/* Found addresses */
-		log_debug( "NSS: Send %lu addresses to %s. Packet has %d bytes.",
-		   num, str_addr( clientaddr ), sizeof(IP)
-		);
+	if( kad_lookup_value_bucket( hostname, addrs, &num, &results, search ) < 0 || results == NULL ) {
+		nss_shm_publish( hostname, entries, 0, 0 );
+		return 0;
+	}
+
+	if( num == 0 ) {
+		if( results->done ) {
+			nss_shm_publish( hostname, entries, 0, 0 );
+			return 0;
+		}
+		return -1;
+	}
+
+	/* Addresses of a finished search are valid until it is due to be searched again */
+	if( results->done ) {
+		ttl = results->start_time + (MAX_SEARCH_LIFETIME / 2) - time_now_sec();
+		if( ttl < 0 ) {
+			ttl = 0;
+		}
 	} else {
-		num = 0;
+		ttl = NSS_SEARCH_TTL;
+	}
+
+	for( i = 0; i < num; i++ ) {
+		nss_entry_set( &entries[i], &addrs[i], ttl );
+	}
+
+	/*
+	* Running searches might find more. Lookups from the shared memory
+	* table are not seen by the daemon, let clients ask again now and
+	* then so that the name is still counted in the history.
+	*/
+	if( results->done ) {
+		if( gconf->history_file && ttl > HISTORY_COUNT_INTERVAL ) {
+			ttl = HISTORY_COUNT_INTERVAL;
+		}
+		nss_shm_publish( hostname, entries, num, time_now_sec() + ttl );
+	}
+
+	/* Keep the requested family only */
+	n = 0;
+	for( i = 0; i < num; i++ ) {
+		if( family == AF_UNSPEC || entries[i].family == family ) {
+			entries[n++] = entries[i];
+		}
 	}
 
-	addrlen = addr_len( clientaddr );
-	sendto( sock, (UCHAR *) addrs, num * sizeof(IP), 0, (const struct sockaddr *) clientaddr, addrlen );
+	return n;
+}
+
+void nss_send( int sock, const struct sockaddr_un *clientaddr, socklen_t clientlen,
+		unsigned int id, const struct nss_entry_t entries[], size_t num ) {
+	UCHAR buffer[sizeof(struct nss_reply_t) + NSS_MAX_ENTRIES * sizeof(struct nss_entry_t)];
+	struct nss_reply_t *reply;
+	size_t size;
+
+	reply = (struct nss_reply_t *) buffer;
+	reply->version = NSS_PROTOCOL_VERSION;
+	reply->num = num;
+	reply->reserved = 0;
+	reply->id = id;
+	memcpy( reply->entries, entries, num * sizeof(struct nss_entry_t) );
+	size = sizeof(struct nss_reply_t) + num * sizeof(struct nss_entry_t);
+
+	if( num > 0 ) {
+		/* Found addresses */
+		log_debug( "NSS: Send %lu addresses. Packet has %lu bytes.", num, size );
+	}
+
+	sendto( sock, buffer, size, 0, (const struct sockaddr *) clientaddr, clientlen );
+}
+
+/* Milliseconds until the deadline, negative if it has passed */
+long nss_time_left( const struct timeval *deadline ) {
+	return (deadline->tv_sec - gconf->time_now.tv_sec) * 1000
+		+ (deadline->tv_usec - gconf->time_now.tv_usec) / 1000;
+}
+
+int nss_pending_add( int sock, const struct sockaddr_un *clientaddr, socklen_t clientlen,
+		unsigned int id, int family, const char hostname[], unsigned int timeout ) {
+	struct nss_pending_t *pending;
+	struct nss_pending_t *free_slot;
+	size_t i;
+
+	free_slot = NULL;
+	for( i = 0; i < N_ELEMS(g_nss_pending); i++ ) {
+		pending = &g_nss_pending[i];
+		if( pending->sock < 0 ) {
+			if( free_slot == NULL ) {
+				free_slot = pending;
+			}
+		} else if( pending->sock == sock && pending->id == id && pending->clientlen == clientlen
+				&& memcmp( &pending->clientaddr, clientaddr, clientlen ) == 0 ) {
+			/* Retransmission of a request we already wait for */
+			return 0;
+		}
+	}
+
+	if( free_slot == NULL || strlen( hostname ) >= sizeof(free_slot->hostname) ) {
+		return -1;
+	}
+
+	if( timeout > NSS_MAX_TIMEOUT ) {
+		timeout = NSS_MAX_TIMEOUT;
+	}
+
+	free_slot->sock = sock;
+	memcpy( &free_slot->clientaddr, clientaddr, clientlen );
+	free_slot->clientlen = clientlen;
+	free_slot->id = id;
+	free_slot->family = family;
+	strcpy( free_slot->hostname, hostname );
+	free_slot->deadline.tv_sec = gconf->time_now.tv_sec + (timeout / 1000);
+	free_slot->deadline.tv_usec = gconf->time_now.tv_usec + (timeout % 1000) * 1000;
+	if( free_slot->deadline.tv_usec >= 1000000 ) {
+		free_slot->deadline.tv_sec += 1;
+		free_slot->deadline.tv_usec -= 1000000;
+	}
+
+	return 0;
+}
+
+/* Answer held requests when results have changed, send an empty reply at the deadline */
+void nss_handle_pending( int _rc, int _sock ) {
+	static unsigned int version = 0;
+	struct nss_entry_t entries[NSS_MAX_ENTRIES];
+	struct nss_pending_t *pending;
+	int changed;
+	int num;
+	size_t i;
+
+	changed = (version != results_version());
+	version = results_version();
+
+	/* Tell readers of the shared memory table that we are still running */
+	if( g_nss_shm ) {
+		g_nss_shm->alive = time_now_sec();
+	}
+
+	for( i = 0; i < N_ELEMS(g_nss_pending); i++ ) {
+		pending = &g_nss_pending[i];
+		if( pending->sock < 0 ) {
+			continue;
+		}
+
+		if( changed && (num = nss_lookup( pending->hostname, pending->family, entries, 0 )) >= 0 ) {
+			nss_send( pending->sock, &pending->clientaddr, pending->clientlen, pending->id, entries, num );
+			pending->sock = -1;
+			continue;
+		}
+
+		/*
+		* The main loop might not wake up again for a second,
+		* the client must receive the reply before its deadline.
+		*/
+		if( nss_time_left( &pending->deadline ) < 1000 ) {
+			log_debug( "NSS: Failed to resolve hostname in time: %s", pending->hostname );
+			nss_send( pending->sock, &pending->clientaddr, pending->clientlen, pending->id, entries, 0 );
+			pending->sock = -1;
+		}
+	}
 }
 
 /*
-* Handle a local connection
+* Handle a local request
 */
 void nss_handler( int rc, int sock ) {
-	IP clientaddr;
-	socklen_t addrlen_ret;
-	char hostname[512];
+	struct nss_entry_t entries[NSS_MAX_ENTRIES];
+	struct nss_request_t *request;
+	struct sockaddr_un clientaddr;
+	socklen_t clientlen;
+	char buffer[sizeof(struct nss_request_t) + QUERY_MAX_SIZE];
+	char *hostname;
+	unsigned int timeout;
+	int family;
+	int num;
 
 	if( rc == 0 ) {
 		return;
 	}
 
-	addrlen_ret = sizeof(IP);
-	rc = recvfrom( sock, hostname, sizeof(hostname), 0, (struct sockaddr *) &clientaddr, &addrlen_ret );
+	clientlen = sizeof(clientaddr);
+	rc = recvfrom( sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &clientaddr, &clientlen );
 
-	if( rc <= 0 || rc >= sizeof(hostname) ) {
+	if( rc <= sizeof(struct nss_request_t) || rc >= sizeof(buffer) ) {
 		return;
 	}
 
 	/* Add missing null terminator */
-	hostname[rc] = '\0';
+	buffer[rc] = '\0';
+
+	request = (struct nss_request_t *) buffer;
+	hostname = request->hostname;
+	timeout = ntohs( request->timeout );
+	family = request->family;
 
-	if( !is_suffix( hostname, gconf->query_tld ) ) {
+	if( request->version != NSS_PROTOCOL_VERSION ) {
 		return;
 	}
 
-	/* Validate hostname */
-	if( !str_isValidHostname( hostname ) ) {
+	if( family != AF_UNSPEC && family != AF_INET && family != AF_INET6 ) {
+		num = 0;
+	} else if( !is_suffix( hostname, gconf->query_tld ) ) {
+		/* Do not let clients wait for names we do not handle */
+		num = 0;
+	} else if( !str_isValidHostname( hostname ) ) {
 		log_warn( "NSS: Invalid hostname for lookup: '%s'", hostname );
-		return;
+		num = 0;
+	} else {
+		num = nss_lookup( hostname, family, entries, 1 );
+	}
+
+	if( num < 0 && timeout > 0 ) {
+		/* Answer when results arrive or the deadline is near */
+		if( nss_pending_add( sock, &clientaddr, clientlen, request->id, family, hostname, timeout ) == 0 ) {
+			return;
+		}
+		log_debug( "NSS: Too many pending requests, answer request for: %s", hostname );
 	}
 
-	nss_lookup( sock, &clientaddr, hostname );
+	nss_send( sock, &clientaddr, clientlen, request->id, entries, (num < 0) ? 0 : num );
+}
+
+/* A path starting with @ refers to the abstract namespace on Linux */
+socklen_t nss_unix_addr( struct sockaddr_un *addr, const char path[] ) {
+	size_t len;
+
+	len = strlen( path );
+	if( len >= sizeof(addr->sun_path) ) {
+		return 0;
+	}
+
+	memset( addr, '\0', sizeof(struct sockaddr_un) );
+	addr->sun_family = AF_UNIX;
+	memcpy( addr->sun_path, path, len );
+
+	if( path[0] == '@' ) {
+		addr->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	return sizeof(struct sockaddr_un);
+}
+
+int nss_bind( const char path[] ) {
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int sock;
+
+	if( (addrlen = nss_unix_addr( &addr, path )) == 0 ) {
+		log_err( "NSS: Socket path too long: %s", path );
+		return -1;
+	}
+
+	if( (sock = socket( AF_UNIX, SOCK_DGRAM, 0 )) < 0 ) {
+		log_err( "NSS: Failed to create socket: %s", strerror( errno ) );
+		return -1;
+	}
+
+	if( net_set_nonblocking( sock ) < 0 ) {
+		close( sock );
+		log_err( "NSS: Failed to make socket nonblocking: '%s'", strerror( errno ) );
+		return -1;
+	}
+
+	/* Remove a socket file left behind by a previous instance */
+	if( path[0] != '@' ) {
+		unlink( path );
+	}
+
+	if( bind( sock, (struct sockaddr *) &addr, addrlen ) < 0 ) {
+		close( sock );
+		log_err( "NSS: Failed to bind socket to %s: %s", path, strerror( errno ) );
+		return -1;
+	}
+
+	/* All local users may resolve names */
+	if( path[0] != '@' && chmod( path, 0666 ) < 0 ) {
+		log_warn( "NSS: Failed to change permissions of %s: %s", path, strerror( errno ) );
+	}
+
+	log_info( "NSS: Bind to %s", path );
+
+	return sock;
 }
 
 void nss_setup( void ) {
+	size_t i;
 	int sock;
 
-	if( str_isZero( gconf->nss_port ) ) {
+	if( str_isZero( gconf->nss_path ) ) {
 		return;
 	}
 
-	sock = net_bind( "NSS", "::1", gconf->nss_port, NULL, IPPROTO_UDP, AF_UNSPEC );
+	for( i = 0; i < N_ELEMS(g_nss_pending); i++ ) {
+		g_nss_pending[i].sock = -1;
+	}
+
+	sock = nss_bind( gconf->nss_path );
 	net_add_handler( sock, &nss_handler );
+	net_add_handler( -1, &nss_handle_pending );
 }
 
 void nss_free( void ) {
-	/* Nothing to do */
+	nss_shm_free();
+
+	if( !str_isZero( gconf->nss_path ) && gconf->nss_path[0] != '@' ) {
+		unlink( gconf->nss_path );
+	}
 }
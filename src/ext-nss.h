@@ -2,6 +2,80 @@
 #ifndef _EXT_NSS_H_
 #define _EXT_NSS_H_
 
+#include <time.h>
+
+/*
+* libnss_kadnode sends requests over a Unix datagram socket.
+* The request asks for the addresses of both or one address family.
+* The daemon holds the request for up to timeout milliseconds while
+* the search runs and has no results yet. All integers are in network
+* byte order, the family is AF_UNSPEC, AF_INET or AF_INET6.
+*/
+#define NSS_PROTOCOL_VERSION 2
+#define NSS_MAX_ENTRIES 32
+
+struct nss_request_t {
+	unsigned char version;
+	unsigned char family;
+	unsigned short timeout;
+	unsigned int id;
+	char hostname[];
+};
+
+/* An address with the seconds it can be cached */
+struct nss_entry_t {
+	unsigned char family;
+	unsigned char reserved;
+	unsigned short port;
+	unsigned int ttl;
+	unsigned char addr[16];
+};
+
+/* The reply echoes the request id */
+struct nss_reply_t {
+	unsigned char version;
+	unsigned char num;
+	unsigned short reserved;
+	unsigned int id;
+	struct nss_entry_t entries[];
+};
+
+/*
+* Resolved names are published in a shared memory hash table.
+* libnss_kadnode maps it read only and answers hits without
+* asking the daemon. Every slot is protected by a sequence
+* counter that is odd while the daemon is writing the slot.
+* Readers only trust a table owned by root or by themselves
+* that cannot be written by others. The table is created
+* before privileges are dropped.
+*/
+#define NSS_SHM_NAME "/kadnode-nss"
+#define NSS_SHM_MAGIC 0x4b4e5333
+#define NSS_SHM_SLOTS 512
+#define NSS_SHM_ADDRS 16
+#define NSS_SHM_NAME_SIZE 256
+
+/* Readers ignore a table the daemon has not touched for this many seconds */
+#define NSS_SHM_STALE 5
+
+struct nss_shm_slot_t {
+	volatile unsigned int seq;
+	unsigned int num;
+	time_t expire;
+	char name[NSS_SHM_NAME_SIZE];
+	struct nss_entry_t entries[NSS_SHM_ADDRS];
+};
+
+struct nss_shm_t {
+	/* Reset when the daemon exits, readers map the table again */
+	volatile unsigned int magic;
+	unsigned int slots_num;
+	/* Updated every second, a crashed daemon stops updating it */
+	volatile time_t alive;
+	struct nss_shm_slot_t slots[NSS_SHM_SLOTS];
+};
+
+void nss_shm_setup( void );
 void nss_setup( void );
 void nss_free( void );
 
@@ -0,0 +1,259 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "kad.h"
+#include "results.h"
+#include "history.h"
+
+
+/* Number of names to remember, leave most searches to the clients */
+#define HISTORY_MAX_ENTRIES (MAX_SEARCHES / 2)
+
+/* Write the history file every 10 minutes, lookup counts are halved each time */
+#define HISTORY_EXPORT_INTERVAL (10*60)
+
+/* Forget names that have not been resolved for a week */
+#define HISTORY_MAX_AGE (7*24*60*60)
+
+/* Number of good nodes needed before names are searched again */
+#define HISTORY_MIN_NODES 8
+
+/* Seconds between two searches of imported names */
+#define HISTORY_LOOKUP_INTERVAL 2
+
+/* A name resolved by clients */
+struct history_t {
+	char query[QUERY_MAX_SIZE];
+	/* Lookups, decays over time */
+	unsigned int count;
+	/* Time of the last counted lookup */
+	time_t last;
+};
+
+static struct history_t g_history[HISTORY_MAX_ENTRIES];
+static size_t g_history_num = 0;
+
+/* Imported names not searched yet */
+static char *g_warmup[HISTORY_MAX_ENTRIES];
+static size_t g_warmup_num = 0;
+static size_t g_warmup_next = 0;
+static time_t g_warmup_time = 0;
+
+/* Lookups of imported names are not counted */
+static int g_warmup_running = 0;
+
+static time_t g_export_time = 0;
+
+
+/* More lookups first, more recent lookups on a tie */
+int history_cmp( const void *a, const void *b ) {
+	const struct history_t *ha = (const struct history_t *) a;
+	const struct history_t *hb = (const struct history_t *) b;
+
+	if( ha->count != hb->count ) {
+		return (ha->count > hb->count) ? -1 : 1;
+	}
+
+	if( ha->last != hb->last ) {
+		return (ha->last > hb->last) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+struct history_t *history_find( const char query[] ) {
+	size_t i;
+
+	for( i = 0; i < g_history_num; i++ ) {
+		if( strcmp( g_history[i].query, query ) == 0 ) {
+			return &g_history[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Add a name, it replaces the least used name if there is no space left */
+struct history_t *history_insert( const char query[], unsigned int count, time_t last ) {
+	struct history_t *entry;
+	size_t i;
+
+	if( strlen( query ) >= QUERY_MAX_SIZE ) {
+		return NULL;
+	}
+
+	if( g_history_num < HISTORY_MAX_ENTRIES ) {
+		entry = &g_history[g_history_num++];
+	} else {
+		entry = &g_history[0];
+		for( i = 1; i < g_history_num; i++ ) {
+			if( history_cmp( &g_history[i], entry ) > 0 ) {
+				entry = &g_history[i];
+			}
+		}
+
+		if( entry->count > count || (entry->count == count && entry->last >= last) ) {
+			return NULL;
+		}
+	}
+
+	strcpy( entry->query, query );
+	entry->count = count;
+	entry->last = last;
+
+	return entry;
+}
+
+void history_add( const char query[] ) {
+	struct history_t *entry;
+	time_t now;
+
+	if( gconf->history_file == NULL || g_warmup_running ) {
+		return;
+	}
+
+	now = time_now_sec();
+	if( (entry = history_find( query )) == NULL ) {
+		history_insert( query, 1, now );
+	} else if( (entry->last + HISTORY_COUNT_INTERVAL) <= now ) {
+		entry->count++;
+		entry->last = now;
+	}
+}
+
+void history_export( void ) {
+	const char *filename;
+	time_t now;
+	FILE *fp;
+	size_t i;
+
+	filename = gconf->history_file;
+	if( filename == NULL ) {
+		return;
+	}
+
+	now = time_now_sec();
+	qsort( g_history, g_history_num, sizeof(struct history_t), &history_cmp );
+
+	/* Drop old names from the end */
+	while( g_history_num > 0 && (g_history[g_history_num - 1].last + HISTORY_MAX_AGE) < now ) {
+		g_history_num--;
+	}
+
+	fp = fopen( filename, "w" );
+	if( fp == NULL ) {
+		log_warn( "HISTORY: Cannot open file '%s' for export: %s", filename, strerror( errno ) );
+		return;
+	}
+
+	/* Store the age, the clock might be different after a restart */
+	for( i = 0; i < g_history_num; i++ ) {
+		if( fprintf( fp, "%s %u %ld\n", g_history[i].query, g_history[i].count, (long) (now - g_history[i].last) ) < 0 ) {
+			break;
+		}
+	}
+
+	fclose( fp );
+
+	log_debug( "HISTORY: %d names exported: %s", (int) i, filename );
+}
+
+void history_import( const char filename[] ) {
+	char linebuf[QUERY_MAX_SIZE + 64];
+	char query[QUERY_MAX_SIZE];
+	unsigned int count;
+	long age;
+	FILE *fp;
+
+	fp = fopen( filename, "r" );
+	if( fp == NULL ) {
+		if( errno != ENOENT ) {
+			log_warn( "HISTORY: Cannot open file '%s' for import: %s", filename, strerror( errno ) );
+		}
+		return;
+	}
+
+	while( fgets( linebuf, sizeof(linebuf), fp ) != NULL ) {
+		if( sscanf( linebuf, "%511s %u %ld", query, &count, &age ) != 3 || age < 0 ) {
+			continue;
+		}
+
+		if( history_find( query ) || history_insert( query, count, time_now_sec() - age ) == NULL ) {
+			continue;
+		}
+
+		if( g_warmup_num < N_ELEMS(g_warmup) && age < HISTORY_MAX_AGE ) {
+			g_warmup[g_warmup_num++] = strdup( query );
+		}
+	}
+
+	fclose( fp );
+
+	log_info( "HISTORY: Imported %d names from: %s", (int) g_warmup_num, filename );
+}
+
+void history_handle( int _rc, int _sock ) {
+	IP addrs[8];
+	size_t num;
+	time_t now;
+	size_t i;
+
+	now = time_now_sec();
+
+	/* Search one imported name at a time once the routing table is usable */
+	if( g_warmup_next < g_warmup_num && g_warmup_time <= now ) {
+		if( kad_count_nodes( 1 ) < HISTORY_MIN_NODES ) {
+			g_warmup_time = now + 1;
+		} else {
+			log_debug( "HISTORY: Search for %s", g_warmup[g_warmup_next] );
+
+			g_warmup_running = 1;
+			num = N_ELEMS(addrs);
+			kad_lookup_value( g_warmup[g_warmup_next], addrs, &num );
+			g_warmup_running = 0;
+
+			g_warmup_next++;
+			g_warmup_time = now + HISTORY_LOOKUP_INTERVAL;
+		}
+	}
+
+	if( g_export_time <= now ) {
+		history_export();
+
+		/* Names that are not resolved anymore move to the end */
+		for( i = 0; i < g_history_num; i++ ) {
+			g_history[i].count /= 2;
+		}
+
+		g_export_time = now + HISTORY_EXPORT_INTERVAL;
+	}
+}
+
+void history_setup( void ) {
+	if( gconf->history_file == NULL ) {
+		return;
+	}
+
+	history_import( gconf->history_file );
+
+	g_export_time = time_now_sec() + HISTORY_EXPORT_INTERVAL;
+	net_add_handler( -1, &history_handle );
+}
+
+void history_free( void ) {
+	size_t i;
+
+	for( i = 0; i < g_warmup_num; i++ ) {
+		free( g_warmup[i] );
+	}
+	g_warmup_num = 0;
+	g_warmup_next = 0;
+}
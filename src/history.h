@@ -0,0 +1,23 @@
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+/*
+* Remember the names clients resolve most and write them to a file.
+* After a restart, the names are searched again as soon as enough
+* nodes are known, so results are ready before clients ask.
+*/
+
+/* Lookups of a name within this many seconds count once, e.g. retries of a pending query */
+#define HISTORY_COUNT_INTERVAL 60
+
+void history_setup( void );
+void history_free( void );
+
+/* Write names to the history file */
+void history_export( void );
+
+/* Count a lookup of a (sanitized) query */
+void history_add( const char query[] );
+
+#endif /* _HISTORY_H_ */
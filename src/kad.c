@@ -1,6 +1,7 @@
 
 #define _GNU_SOURCE
 
+#include <stdlib.h>
 #include <sys/time.h>
 
 #include "log.h"
@@ -12,10 +13,16 @@
 #include "results.h"
 #include "net.h"
 #include "values.h"
+#include "history.h"
 #ifdef AUTH
 #include "ext-auth.h"
 #endif
 
+#ifndef _WIN32
+/* Transaction ids and timer jitter of the DHT come from our generator */
+#define random() ((long) (uint_random() >> 1))
+#endif
+
 #include "dht.c"
 
 
@@ -23,6 +30,9 @@
 The interface that is used to interact with the DHT.
 */
 
+/* Tokens are valid for at least 5 minutes on the remote side */
+#define KAD_BATCH_MAX_AGE (5*60)
+
 /* Next time to do DHT maintenance */
 static time_t g_dht_maintenance = 0;
 
@@ -77,12 +87,34 @@ typedef struct {
 } dht_addr4_t;
 
 
+/* Find the running or finished DHT search of an id */
+struct search *kad_find_search( const UCHAR id[], int af ) {
+	struct search *sr;
+
+	for( sr = searches; sr != NULL; sr = sr->next ) {
+		if( sr->af == af && id_equal( sr->id, id ) ) {
+			return sr;
+		}
+	}
+
+	return NULL;
+}
+
 /* This callback is called when a search result arrives or a search completes */
 void dht_callback_func( void *closure, int event, const UCHAR *info_hash, const void *data, size_t data_len ) {
 	struct results_t *results;
+	struct search *sr;
 	IP addr;
 	size_t i;
 
+	if( event == DHT_EVENT_SEARCH_DONE || event == DHT_EVENT_SEARCH_DONE6 ) {
+		/* Only a search that announced a port finishes an announcement, not a lookup of the same id */
+		sr = kad_find_search( info_hash, (event == DHT_EVENT_SEARCH_DONE) ? AF_INET : AF_INET6 );
+		if( sr && sr->port != 0 ) {
+			values_announce_done( info_hash );
+		}
+	}
+
 	results = results_find( info_hash );
 	if( results == NULL ) {
 		return;
@@ -303,6 +335,11 @@ int kad_status( char *buf, int size ) {
 	int numstorage = 0;
 	int numstorage_peers = 0;
 	int numvalues = 0;
+	int numqueued = 0;
+	int numannounces = 0;
+	int lag = 0;
+	unsigned int numsearched = 0;
+	unsigned int numgrouped = 0;
 	int written = 0;
 
 	/* count searches */
@@ -323,6 +360,7 @@ int kad_status( char *buf, int size ) {
 	}
 
 	numvalues = values_count();
+	values_announce_status( &numqueued, &numannounces, &lag, &numsearched, &numgrouped );
 
 	bprintf( "Version: %s\n", kadnode_version_str );
 	bprintf( "DHT id: %s\n", str_id( myid, hexbuf ) );
@@ -341,6 +379,9 @@ int kad_status( char *buf, int size ) {
 	bprintf( "DHT Blacklist: %d (max %d)\n",
 		(next_blacklisted % DHT_MAX_BLACKLISTED), DHT_MAX_BLACKLISTED );
 	bprintf( "DHT Values to announce: %d\n", numvalues );
+	bprintf( "DHT Announcements: %d queued, %d active (max %d), %d s lag\n",
+		numqueued, numannounces, ANNOUNCE_MAX_SEARCHES, lag );
+	bprintf( "DHT Announcements sent: %u by search, %u grouped\n", numsearched, numgrouped );
 
 	return written;
 }
@@ -372,6 +413,109 @@ int kad_announce_once( const UCHAR id[], int port ) {
 	return 0;
 }
 
+/* A finished announcement search with a full set of recent nodes */
+int kad_search_usable( struct search *sr ) {
+	return (sr->af == gconf->af && sr->port != 0 && sr->done
+		&& sr->numnodes >= 8 && sr->step_time >= (now.tv_sec - KAD_BATCH_MAX_AGE));
+}
+
+/* Send an announcement to the closest nodes of a search using its tokens */
+int kad_announce_search( struct search *sr, const UCHAR id[], int port ) {
+	struct search_node *n;
+	unsigned char tid[4];
+	int sent;
+	int i;
+
+	sent = 0;
+	make_tid( tid, "ap", sr->tid );
+	for( i = 0; i < sr->numnodes && sent < 8; i++ ) {
+		n = &sr->nodes[i];
+		if( n->pinged >= 3 || !n->acked || n->token_len == 0 ) {
+			continue;
+		}
+		send_announce_peer( (struct sockaddr*) &n->ss, n->sslen, tid, 4,
+			(unsigned char*) id, port, n->token, n->token_len, 0 );
+		sent++;
+	}
+
+	return sent;
+}
+
+/*
+* Find a recent announcement search whose closest nodes are
+* also the closest nodes of id. Send the announcement to these
+* nodes using the tokens of that search. No new search is started.
+*/
+int kad_announce_nearby( const UCHAR id[], int port ) {
+	struct search *sr;
+	struct search *best;
+	int best_bits;
+	int bits;
+	int sent;
+
+	if( port < 1 || port > 65535 ) {
+		return -1;
+	}
+
+	dht_lock();
+
+	best = NULL;
+	best_bits = -1;
+	for( sr = searches; sr != NULL; sr = sr->next ) {
+		if( !kad_search_usable( sr ) ) {
+			continue;
+		}
+
+		bits = common_bits( sr->id, id );
+
+		/* The id must be closer to the search id than its 8th closest node */
+		if( bits > best_bits && bits >= common_bits( sr->id, sr->nodes[7].id ) ) {
+			best = sr;
+			best_bits = bits;
+		}
+	}
+
+	sent = best ? kad_announce_search( best, id, port ) : 0;
+
+	dht_unlock();
+
+	return sent;
+}
+
+/*
+* Number of leading bits an id must share with the id of a finished
+* announcement search to be covered by the closest nodes of that search.
+* Returns -1 if there is no such search or it is not usable anymore.
+*/
+int kad_announce_radius( const UCHAR search_id[] ) {
+	struct search *sr;
+	int bits;
+
+	dht_lock();
+	sr = kad_find_search( search_id, gconf->af );
+	bits = (sr && kad_search_usable( sr )) ? common_bits( sr->id, sr->nodes[7].id ) : -1;
+	dht_unlock();
+
+	return bits;
+}
+
+/* Announce id to the closest nodes of the announcement search for search_id */
+int kad_announce_via( const UCHAR search_id[], const UCHAR id[], int port ) {
+	struct search *sr;
+	int sent;
+
+	if( port < 1 || port > 65535 ) {
+		return -1;
+	}
+
+	dht_lock();
+	sr = kad_find_search( search_id, gconf->af );
+	sent = (sr && kad_search_usable( sr )) ? kad_announce_search( sr, id, port ) : 0;
+	dht_unlock();
+
+	return sent;
+}
+
 /*
 * Add a new value to the announcement list or refresh an announcement.
 */
@@ -390,7 +534,7 @@ int kad_announce( const char _query[], int port, time_t lifetime ) {
 /*
 * Lookup known nodes that are nearest to the given id.
 */
-int kad_lookup_value( const char _query[], IP addr_array[], size_t *addr_num ) {
+int kad_lookup_value_bucket( const char _query[], IP addr_array[], size_t *addr_num, struct results_t **results_return, int search ) {
 	char query[QUERY_MAX_SIZE];
 	struct results_t *results;
 	int is_new;
@@ -402,10 +546,20 @@ int kad_lookup_value( const char _query[], IP addr_array[], size_t *addr_num ) {
 
 	log_debug( "KAD: Lookup string: %s", query );
 
+	/* Lookups without search only check on results of earlier lookups */
+	if( search ) {
+		history_add( query );
+	}
+
 	dht_lock();
 
 	/* Find existing or create new item */
-	results = results_add( query, &is_new );
+	if( search ) {
+		results = results_add( query, &is_new );
+	} else {
+		results = results_find_query( query );
+		is_new = 0;
+	}
 
 	if( results && is_new ) {
 		/* Search own announced values */
@@ -421,16 +575,18 @@ int kad_lookup_value( const char _query[], IP addr_array[], size_t *addr_num ) {
 		* no results have been found or more than half of the searches lifetime
 		* has expired.
 		*/
-		if( results_entries_count( results ) == 0 ||
-			(time_now_sec() - results->start_time) > (MAX_SEARCH_LIFETIME / 2)
+		if( search && (results_entries_count( results ) == 0 ||
+			(time_now_sec() - results->start_time) > (MAX_SEARCH_LIFETIME / 2))
 		) {
 			/* Mark search as in progress */
 			results_done( results, 0 );
 
 			/* Start another search for this id */
 			dht_search( results->id, 0, gconf->af, dht_callback_func, NULL );
+			rc = 1;
+		} else {
+			rc = 2;
 		}
-		rc = 2;
 	} else if( is_new ) {
 		/* Start a new DHT search */
 		dht_search( results->id, 0, gconf->af, dht_callback_func, NULL );
@@ -443,11 +599,19 @@ int kad_lookup_value( const char _query[], IP addr_array[], size_t *addr_num ) {
 	/* Collect addresses to be returned */
 	*addr_num = results_collect( results, addr_array, *addr_num );
 
+	if( results_return ) {
+		*results_return = results;
+	}
+
 	dht_unlock();
 
 	return rc;
 }
 
+int kad_lookup_value( const char query[], IP addr_array[], size_t *addr_num ) {
+	return kad_lookup_value_bucket( query, addr_array, addr_num, NULL, 1 );
+}
+
 /*
 * Lookup the address of the node that has the given id.
 * The port refers to the kad instance.
@@ -648,4 +812,7 @@ void kad_debug_constants( int fd ) {
 
 	/* maximum number of blacklisted nodes */
 	dprintf( fd, "DHT_MAX_BLACKLISTED: %d\n", DHT_MAX_BLACKLISTED );
+
+	/* maximum number of concurrent announcement searches */
+	dprintf( fd, "ANNOUNCE_MAX_SEARCHES: %d\n", ANNOUNCE_MAX_SEARCHES );
 }
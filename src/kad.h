@@ -29,6 +29,15 @@ int kad_lookup_node( const char query[], IP *addr_return );
 */
 int kad_lookup_value( const char query[], IP addr_array[], size_t *addr_num );
 
+/*
+* Same as kad_lookup_value(), but also return the results bucket
+* the addresses were taken from. Valid until the next lookup.
+* Without search, only existing results are returned and no search
+* is started. Returns 1 if a search was started.
+*/
+struct results_t;
+int kad_lookup_value_bucket( const char query[], IP addr_array[], size_t *addr_num, struct results_t **results_return, int search );
+
 /* Export good nodes */
 int kad_export_nodes( IP addr_array[], size_t *addr_num );
 
@@ -44,6 +53,21 @@ int kad_count_nodes( int good );
 */
 int kad_announce_once( const UCHAR id[], int port );
 
+/*
+* Announce to the nodes of a recent announcement of a nearby id.
+* Returns the number of nodes the announcement was sent to.
+*/
+int kad_announce_nearby( const UCHAR id[], int port );
+
+/*
+* Leading bits an id must share with a finished announcement
+* search to be covered by its closest nodes, -1 if unusable.
+*/
+int kad_announce_radius( const UCHAR search_id[] );
+
+/* Announce to the closest nodes of a finished announcement search */
+int kad_announce_via( const UCHAR search_id[], const UCHAR id[], int port );
+
 /* Announce query until lifetime expires. */
 int kad_announce( const char query[], int port, time_t lifetime );
 
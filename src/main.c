@@ -18,6 +18,7 @@
 #include "values.h"
 #include "results.h"
 #include "peerfile.h"
+#include "history.h"
 #ifdef __CYGWIN__
 #include "windows.h"
 #endif
@@ -77,6 +78,8 @@ void main_cleanup( void ) {
 
 	peerfile_free();
 
+	history_free();
+
 	results_free();
 
 	values_free();
@@ -113,6 +116,9 @@ int main_start( void ) {
 	/* Setup import of peerfile  */
 	peerfile_setup();
 
+	/* Setup import and export of resolved names */
+	history_setup();
+
 	/* Setup extensions */
 #ifdef LPD
 	lpd_setup();
@@ -139,6 +145,9 @@ int main_start( void ) {
 	/* Export peers if a file is provided */
 	peerfile_export();
 
+	/* Export resolved names if a file is provided */
+	history_export();
+
 	return 0;
 }
 
@@ -240,6 +249,11 @@ int main( int argc, char **argv ) {
 		unix_write_pidfile( getpid(), gconf->pidfile );
 	}
 
+#ifdef NSS
+	/* Readers only trust a shared memory table owned by root */
+	nss_shm_setup();
+#endif
+
 	/* Drop privileges */
 	unix_dropuid0();
 
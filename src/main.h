@@ -19,9 +19,24 @@
 
 #define CMD_PORT "1700"
 #define DNS_PORT "3535"
-#define NSS_PORT "4053"
 #define WEB_PORT "8053"
 
+/* Unix socket of the NSS interface, a leading @ refers to the abstract namespace */
+#ifdef __linux__
+#define NSS_PATH "@kadnode-nss"
+#else
+#define NSS_PATH "/tmp/kadnode-nss"
+#endif
+
+/* Seconds to wait for results before a DNS query fails */
+#define DNS_TIMEOUT "3"
+
+/* Upper limit for the time answers of external DNS servers are cached */
+#define DNS_PROXY_MAX_TTL "86400"
+
+/* Authentication packets per second accepted from a source address */
+#define AUTH_RATE_LIMIT "20"
+
 #define QUERY_TLD_DEFAULT ".p2p"
 #define QUERY_MAX_SIZE 512
 
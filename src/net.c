@@ -20,36 +20,61 @@
 #include "net.h"
 
 
+#define MAX_TASKS 128
+
 struct task_t {
 	int fd;
+	/* Wait for the socket to become writable instead of readable */
+	int is_write;
 	net_callback *callback;
 };
 
-struct task_t g_tasks[16] = { {0} };
+struct task_t g_tasks[MAX_TASKS] = { {0} };
 int g_tasks_num = 0;
 int g_tasks_changed = 1;
 
-void net_add_handler( int fd, net_callback *callback ) {
+/* Earliest time in milliseconds a callback asked to be called, 0 if none */
+static long long g_wakeup_ms = 0;
 
-	if( g_tasks_num >= 16 ) {
+void net_add_task( int fd, int is_write, net_callback *callback ) {
+
+	if( g_tasks_num >= MAX_TASKS ) {
 		log_err( "NET: Too many file descriptors registered." );
 		exit( 1 );
 	}
 
 	g_tasks[g_tasks_num].fd = fd;
+	g_tasks[g_tasks_num].is_write = is_write;
 	g_tasks[g_tasks_num].callback = callback;
 	g_tasks_num++;
 	g_tasks_changed = 1;
 }
 
+void net_add_handler( int fd, net_callback *callback ) {
+	net_add_task( fd, 0, callback );
+}
+
+void net_add_write_handler( int fd, net_callback *callback ) {
+	net_add_task( fd, 1, callback );
+}
+
+void net_wakeup_ms( long long time_ms ) {
+	if( g_wakeup_ms == 0 || time_ms < g_wakeup_ms ) {
+		g_wakeup_ms = time_ms;
+	}
+}
+
+/*
+* Handlers might be removed from inside a callback.
+* The entry is only marked and removed later.
+*/
 void net_remove_handler( int fd, net_callback *callback ) {
 	int i;
 
 	for( i = 0; i < g_tasks_num; ++i ) {
 		struct task_t *task = &g_tasks[i];
 		if( task->fd == fd && task->callback == callback ) {
-			g_tasks_num--;
-			memmove( &g_tasks[i], &g_tasks[i+1], sizeof(struct task_t) * (g_tasks_num - i) );
+			task->callback = NULL;
 			g_tasks_changed = 1;
 			return;
 		}
@@ -59,6 +84,19 @@ void net_remove_handler( int fd, net_callback *callback ) {
 	exit( 1 );
 }
 
+/* Remove entries marked by net_remove_handler() */
+void net_compact_tasks( void ) {
+	int i, j;
+
+	for( i = 0, j = 0; i < g_tasks_num; ++i ) {
+		if( g_tasks[i].callback ) {
+			g_tasks[j++] = g_tasks[i];
+		}
+	}
+
+	g_tasks_num = j;
+}
+
 /* Set a socket non-blocking */
 int net_set_nonblocking( int sock ) {
 	int rc;
@@ -180,10 +218,14 @@ int net_bind(
 }
 
 void net_loop( void ) {
+	long long wait_ms;
+	int tasks_num;
 	int i;
 	int rc;
 	fd_set fds_working;
+	fd_set fds_write_working;
 	fd_set fds;
+	fd_set fds_write;
 	int max_fd = -1;
 	struct timeval tv;
 
@@ -192,16 +234,28 @@ void net_loop( void ) {
 
 	while( gconf->is_running ) {
 
-		/* Wait one second for inconing traffic */
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-
 		/* Update clock */
 		gettimeofday( &gconf->time_now, NULL );
 
+		/* Wait one second for incoming traffic, or less if a callback asked for it */
+		wait_ms = 1000;
+		if( g_wakeup_ms > 0 ) {
+			wait_ms = g_wakeup_ms - ((long long) gconf->time_now.tv_sec * 1000 + gconf->time_now.tv_usec / 1000);
+			if( wait_ms < 0 ) {
+				wait_ms = 0;
+			} else if( wait_ms > 1000 ) {
+				wait_ms = 1000;
+			}
+		}
+		tv.tv_sec = wait_ms / 1000;
+		tv.tv_usec = (wait_ms % 1000) * 1000;
+
 		if( g_tasks_changed ) {
+			net_compact_tasks();
+
 			/* Genreate new file descriptor set */
 			FD_ZERO( &fds );
+			FD_ZERO( &fds_write );
 			max_fd = -1;
 
 			for( i = 0; i < g_tasks_num; ++i ) {
@@ -210,7 +264,7 @@ void net_loop( void ) {
 					if( task->fd > max_fd ) {
 						max_fd = task->fd;
 					}
-					FD_SET( task->fd, &fds );
+					FD_SET( task->fd, task->is_write ? &fds_write : &fds );
 				}
 			}
 			g_tasks_changed = 0;
@@ -218,8 +272,9 @@ void net_loop( void ) {
 
 		/* Get a fresh copy */
 		memcpy( &fds_working, &fds, sizeof(fd_set) );
+		memcpy( &fds_write_working, &fds_write, sizeof(fd_set) );
 
-		rc = select( max_fd + 1, &fds_working, NULL, NULL, &tv );
+		rc = select( max_fd + 1, &fds_working, &fds_write_working, NULL, &tv );
 
 		if( rc < 0 ) {
 			if( errno == EINTR ) {
@@ -230,11 +285,27 @@ void net_loop( void ) {
 			}
 		}
 
-		/* Call all callbacks */
-		for( i = 0; i < g_tasks_num; ++i ) {
+		/* The callbacks should see the time after waiting */
+		gettimeofday( &gconf->time_now, NULL );
+
+		/* Callbacks ask again if they still need to */
+		g_wakeup_ms = 0;
+
+		/*
+		* Call all callbacks. Tasks added by a callback were not part of
+		* the select() call, a new socket might reuse the file descriptor
+		* of a closed one and its result would be taken for its own.
+		*/
+		tasks_num = g_tasks_num;
+		for( i = 0; i < tasks_num; ++i ) {
 			struct task_t *task = &g_tasks[i];
 
-			if( task->fd >= 0 && FD_ISSET( task->fd, &fds_working ) ) {
+			if( task->callback == NULL ) {
+				/* Removed */
+				continue;
+			}
+
+			if( task->fd >= 0 && FD_ISSET( task->fd, task->is_write ? &fds_write_working : &fds_working ) ) {
 				task->callback( rc, task->fd );
 			} else {
 				task->callback( 0, task->fd );
@@ -248,6 +319,8 @@ void net_free( void ) {
 
 	/* Close sockets and FDs */
 	for( i = 0; i < g_tasks_num; ++i ) {
-		close( g_tasks[i].fd );
+		if( g_tasks[i].callback && g_tasks[i].fd >= 0 ) {
+			close( g_tasks[i].fd );
+		}
 	}
 }
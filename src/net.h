@@ -21,12 +21,21 @@ int net_bind(
 	int protocol, int af
 );
 
+/* Set a socket non-blocking */
+int net_set_nonblocking( int sock );
+
 /* Add callback with file descriptor to listen for packets */
 void net_add_handler( int fd, net_callback *callback );
 
+/* Add callback with file descriptor to wait until it becomes writable */
+void net_add_write_handler( int fd, net_callback *callback );
+
 /* Remove callback */
 void net_remove_handler( int fd, net_callback *callback );
 
+/* Wake up the loop at this time in milliseconds, the loop waits a second otherwise */
+void net_wakeup_ms( long long time_ms );
+
 /* Start loop for all network events */
 void net_loop( void );
 
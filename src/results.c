@@ -3,6 +3,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include "log.h"
 #include "main.h"
@@ -24,6 +27,31 @@
 static struct results_t *g_results[MAX_SEARCHES+1] = {NULL};
 /* Index of next slot to be used */
 static size_t g_results_idx = 0;
+/* Last version handed out to a bucket */
+static unsigned int g_results_version = 0;
+
+
+/*
+* Result addresses can be probed for reachability (TCP connect
+* or UDP packet) to hand out live and fast addresses first.
+*/
+
+/* Maximum number of probes in flight */
+#define MAX_PROBES 8
+/* Time after that a probe has failed (in milliseconds) */
+#define PROBE_TIMEOUT 2000
+/* Probe addresses again after this time (in seconds) */
+#define PROBE_REFRESH (5*60)
+
+struct probe_t {
+	int fd;
+	struct result_t *result;
+	struct timeval start;
+};
+
+static struct probe_t g_probes[MAX_PROBES];
+
+void results_probe_queue( void );
 
 struct results_t** results_get( void ) {
 	return &g_results[0];
@@ -46,6 +74,14 @@ struct results_t *results_find( const UCHAR id[] ) {
 	return NULL;
 }
 
+void results_changed( struct results_t *results ) {
+	results->version = ++g_results_version;
+}
+
+unsigned int results_version( void ) {
+	return g_results_version;
+}
+
 int results_entries_count( struct results_t *result ) {
 	struct result_t *entry;
 	int count;
@@ -67,6 +103,219 @@ int results_entries_count( struct results_t *result ) {
 	return count;
 }
 
+long probe_elapsed_ms( const struct timeval *start ) {
+	struct timeval now;
+
+	gettimeofday( &now, NULL );
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+struct probe_t *probe_find( int fd ) {
+	int i;
+
+	for( i = 0; i < MAX_PROBES; i++ ) {
+		if( g_probes[i].result && g_probes[i].fd == fd ) {
+			return &g_probes[i];
+		}
+	}
+
+	return NULL;
+}
+
+void results_probe_handler( int rc, int fd );
+
+/* Stop a probe and store the outcome */
+void probe_finish( struct probe_t *probe, int state ) {
+	struct result_t *result;
+
+	result = probe->result;
+	result->probe_state = state;
+	result->probe_rtt = (state == PROBE_ALIVE) ? probe_elapsed_ms( &probe->start ) : -1;
+	result->probe_time = time_now_sec();
+	results_changed( result->bucket );
+
+	log_debug( "Results: Probe of %s finished: %s (%d ms)",
+		str_addr( &result->addr ), (state == PROBE_ALIVE) ? "alive" : "failed", result->probe_rtt );
+
+	net_remove_handler( probe->fd, &results_probe_handler );
+	close( probe->fd );
+	probe->result = NULL;
+	probe->fd = -1;
+}
+
+/* Called for probe sockets in every loop iteration */
+void results_probe_handler( int rc, int fd ) {
+	struct probe_t *probe;
+	socklen_t len;
+	char buf[8];
+	int err;
+
+	if( (probe = probe_find( fd )) == NULL ) {
+		return;
+	}
+
+	if( rc > 0 ) {
+		if( gconf->probe_protocol == IPPROTO_TCP ) {
+			/* Non-blocking connect has finished */
+			err = 0;
+			len = sizeof(err);
+			if( getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 ) {
+				err = errno;
+			}
+			probe_finish( probe, (err == 0) ? PROBE_ALIVE : PROBE_DEAD );
+		} else {
+			/* Any reply counts, a closed port results in an ICMP error */
+			if( recv( fd, buf, sizeof(buf), 0 ) >= 0 ) {
+				probe_finish( probe, PROBE_ALIVE );
+			} else if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+				probe_finish( probe, PROBE_DEAD );
+			}
+		}
+	} else if( probe_elapsed_ms( &probe->start ) > PROBE_TIMEOUT ) {
+		/* A silent UDP port might be open and just ignore us */
+		probe_finish( probe, (gconf->probe_protocol == IPPROTO_TCP) ? PROBE_DEAD : PROBE_UNKNOWN );
+	}
+
+	if( probe->result == NULL ) {
+		/* Slot has become free */
+		results_probe_queue();
+	}
+}
+
+/* Start probing a result address, returns -1 if no probe slot is free */
+int results_probe_start( struct result_t *result ) {
+	struct probe_t *probe;
+	int fd;
+	int i;
+
+	probe = NULL;
+	for( i = 0; i < MAX_PROBES; i++ ) {
+		if( g_probes[i].result == NULL ) {
+			probe = &g_probes[i];
+			break;
+		}
+	}
+
+	if( probe == NULL ) {
+		return -1;
+	}
+
+	fd = net_socket( "Results", NULL, gconf->probe_protocol, result->addr.ss_family );
+	if( fd < 0 ) {
+		result->probe_state = PROBE_UNKNOWN;
+		result->probe_time = time_now_sec();
+		results_changed( result->bucket );
+		return 0;
+	}
+
+	probe->fd = fd;
+	probe->result = result;
+	gettimeofday( &probe->start, NULL );
+	result->probe_state = PROBE_PENDING;
+
+	if( connect( fd, (struct sockaddr *) &result->addr, addr_len( &result->addr ) ) < 0 && errno != EINPROGRESS ) {
+		net_add_handler( fd, &results_probe_handler );
+		probe_finish( probe, PROBE_DEAD );
+		return 0;
+	}
+
+	if( gconf->probe_protocol == IPPROTO_TCP ) {
+		/* Wait for the connection to be established */
+		net_add_write_handler( fd, &results_probe_handler );
+	} else {
+		/* An empty datagram is enough to provoke a reply or an ICMP error */
+		send( fd, "", 0, 0 );
+		net_add_handler( fd, &results_probe_handler );
+	}
+
+	return 0;
+}
+
+/* Abort a probe, e.g. if the result is about to be freed */
+void results_probe_cancel( struct result_t *result ) {
+	int i;
+
+	for( i = 0; i < MAX_PROBES; i++ ) {
+		if( g_probes[i].result == result ) {
+			net_remove_handler( g_probes[i].fd, &results_probe_handler );
+			close( g_probes[i].fd );
+			g_probes[i].result = NULL;
+			g_probes[i].fd = -1;
+		}
+	}
+}
+
+/* Start probes for results that need one until all probe slots are taken */
+void results_probe_queue( void ) {
+	struct results_t **results;
+	struct result_t *result;
+	time_t now;
+
+	if( gconf->probe_protocol == 0 ) {
+		return;
+	}
+
+	now = time_now_sec();
+	results = results_get();
+	while( *results != NULL ) {
+		result = (*results)->entries;
+		while( result ) {
+#ifdef AUTH
+			/* Wait for verification first */
+			if( result->challenge ) {
+				result = result->next;
+				continue;
+			}
+#endif
+			if( result->probe_state == PROBE_NONE
+				|| (result->probe_state != PROBE_PENDING && (result->probe_time + PROBE_REFRESH) < now) ) {
+				if( results_probe_start( result ) < 0 ) {
+					/* No free slot */
+					return;
+				}
+			}
+			result = result->next;
+		}
+		results++;
+	}
+}
+
+int results_probe_state( const IP *addr, int *rtt ) {
+	struct results_t **results;
+	struct result_t *result;
+
+	results = results_get();
+	while( *results != NULL ) {
+		result = (*results)->entries;
+		while( result ) {
+			if( addr_equal( &result->addr, addr ) && addr_port( &result->addr ) == addr_port( addr ) ) {
+				*rtt = result->probe_rtt;
+				return result->probe_state;
+			}
+			result = result->next;
+		}
+		results++;
+	}
+
+	*rtt = -1;
+	return PROBE_NONE;
+}
+
+const char *probe_state_str( int state ) {
+	switch( state ) {
+		case PROBE_PENDING:
+			return "pending";
+		case PROBE_ALIVE:
+			return "alive";
+		case PROBE_UNKNOWN:
+			return "unknown";
+		case PROBE_DEAD:
+			return "dead";
+		default:
+			return "none";
+	}
+}
+
 /* Free a results_t item and all its result_t entries */
 void results_item_free( struct results_t *bucket ) {
 	struct result_t *cur;
@@ -75,7 +324,11 @@ void results_item_free( struct results_t *bucket ) {
 	cur = bucket->entries;
 	while( cur ) {
 		next = cur->next;
+		if( cur->probe_state == PROBE_PENDING ) {
+			results_probe_cancel( cur );
+		}
 #ifdef AUTH
+		auth_challenge_cancel( cur );
 		free( cur->challenge );
 #endif
 		free( cur );
@@ -112,6 +365,9 @@ void results_debug( int fd ) {
 		result = bucket->entries;
 		while( result ) {
 			dprintf( fd, "   addr: %s\n", str_addr_buf( &result->addr, buf ) );
+			if( gconf->probe_protocol ) {
+				dprintf( fd, "    probe: %s (%d ms)\n", probe_state_str( result->probe_state ), result->probe_rtt );
+			}
 #ifdef AUTH
 			if( bucket->pkey ) {
 				dprintf( fd, "    challenge: %s\n",  result->challenge ? bytes_to_hex( buf, result->challenge, CHALLENGE_BIN_LENGTH ) : "done" );
@@ -128,6 +384,20 @@ void results_debug( int fd ) {
 	dprintf( fd, " Found %d result buckets.\n", results_counter );
 }
 
+/* Find the bucket of a query without creating it */
+struct results_t *results_find_query( const char query[] ) {
+	UCHAR id[SHA1_BIN_LENGTH];
+
+#ifdef AUTH
+	UCHAR pkey[crypto_sign_PUBLICKEYBYTES];
+	auth_handle_pkey( pkey, id, query );
+#else
+	id_compute( id, query );
+#endif
+
+	return results_find( id );
+}
+
 /* Add a new bucket to collect results */
 struct results_t* results_add( const char query[], int *is_new ) {
 	char hexbuf[SHA1_HEX_LENGTH+1];
@@ -158,6 +428,7 @@ struct results_t* results_add( const char query[], int *is_new ) {
 	}
 #endif
 	new->start_time = time_now_sec();
+	results_changed( new );
 
 	log_debug( "Results: Add results bucket for query '%s', id '%s'.", query, str_id( id, hexbuf ) );
 
@@ -200,12 +471,16 @@ int results_add_addr( struct results_t *results, const IP *addr ) {
 	}
 
 	new = calloc( 1, sizeof(struct result_t) );
+	new->bucket = results;
 	memcpy( &new->addr, addr, sizeof(IP) );
+	new->probe_rtt = -1;
 #ifdef AUTH
-	if( results->pkey ) {
+	new->challenge_idx = -1;
+	if( results->pkey && !auth_verified_find( results->pkey, addr ) ) {
 		/* Create a new challenge if needed */
 		new->challenge = calloc( 1, CHALLENGE_BIN_LENGTH );
 		bytes_random( new->challenge, CHALLENGE_BIN_LENGTH );
+		auth_challenge_schedule( new );
 	}
 #endif
 
@@ -216,10 +491,15 @@ int results_add_addr( struct results_t *results, const IP *addr ) {
 		results->entries = new;
 	}
 
+	results_changed( results );
+	results_probe_queue();
+
 	return 0;
 }
 
 int results_done( struct results_t *results, int done ) {
+	results_changed( results );
+
 	if( done ) {
 		results->done = 1;
 		/* Remove search if no results have been found */
@@ -234,17 +514,44 @@ int results_done( struct results_t *results, int done ) {
 	return 0;
 }
 
+/* Order of probe states: alive first, then unknown and dead last */
+int probe_rank( const struct result_t *result ) {
+	switch( result->probe_state ) {
+		case PROBE_ALIVE:
+			return 0;
+		case PROBE_DEAD:
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+int probe_cmp( const struct result_t *a, const struct result_t *b ) {
+	int ra = probe_rank( a );
+	int rb = probe_rank( b );
+
+	if( ra != rb ) {
+		return ra - rb;
+	} else if( ra == 0 ) {
+		return a->probe_rtt - b->probe_rtt;
+	} else {
+		return 0;
+	}
+}
+
 int results_collect( struct results_t *results, IP addr_array[], size_t addr_num ) {
+	struct result_t *sorted[MAX_RESULTS_PER_SEARCH+1];
 	struct result_t *result;
-	size_t i;
+	size_t num;
+	size_t i, j;
 
 	if( results == NULL ) {
 		return 0;
 	}
 
-	i = 0;
+	num = 0;
 	result = results->entries;
-	while( result && i < addr_num ) {
+	while( result && num < N_ELEMS(sorted) ) {
 #ifdef AUTH
 		/* If there is a challenge - then the address is not verified yet */
 		if( results->pkey && result->challenge ) {
@@ -252,17 +559,44 @@ int results_collect( struct results_t *results, IP addr_array[], size_t addr_num
 			continue;
 		}
 #endif
-		memcpy( &addr_array[i], &result->addr, sizeof(IP) );
-		i++;
+		/* Insertion sort, keeps the order of equal entries */
+		for( j = num; j > 0 && probe_cmp( sorted[j-1], result ) > 0; j-- ) {
+			sorted[j] = sorted[j-1];
+		}
+		sorted[j] = result;
+		num++;
 		result = result->next;
 	}
 
+	for( i = 0; i < num && i < addr_num; i++ ) {
+		memcpy( &addr_array[i], &sorted[i]->addr, sizeof(IP) );
+	}
+
 	return i;
 }
 
+void results_handle( int _rc, int _sock ) {
+	static time_t probe_time = 0;
+
+	/* Look for results to probe (again) every second */
+	if( probe_time < time_now_sec() ) {
+		results_probe_queue();
+		probe_time = time_now_sec();
+	}
+}
 
 void results_setup( void ) {
-	/* Nothing to do */
+	int i;
+
+	for( i = 0; i < MAX_PROBES; i++ ) {
+		g_probes[i].fd = -1;
+		g_probes[i].result = NULL;
+	}
+
+	if( gconf->probe_protocol ) {
+		/* Cause the callback to be called in intervals */
+		net_add_handler( -1, &results_handle );
+	}
 }
 
 void results_free( void ) {
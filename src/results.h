@@ -11,13 +11,30 @@
 #define MAX_SEARCHES 64
 #define MAX_SEARCH_LIFETIME (20*60)
 
+/* Reachability of a result address, see --probe-mode */
+enum {
+	PROBE_NONE = 0, /* Not probed (yet) */
+	PROBE_PENDING, /* Probe in progress */
+	PROBE_ALIVE, /* Port has answered */
+	PROBE_UNKNOWN, /* No answer, port may be open or filtered (UDP) */
+	PROBE_DEAD /* Port is closed or host is unreachable */
+};
+
 /* An address that was received as a result of an id search */
 struct result_t {
 	struct result_t *next;
+	struct results_t *bucket; /* The bucket this entry belongs to */
 	IP addr;
+	int probe_state;
+	int probe_rtt; /* Round trip time in milliseconds, -1 if unknown */
+	time_t probe_time; /* Time the last probe was finished */
 #ifdef AUTH
 	UCHAR *challenge;
 	int challenges_send;
+	/* Time of the next send in milliseconds */
+	long long challenge_due;
+	/* Position in the challenge timer heap, -1 if not scheduled */
+	int challenge_idx;
 #endif
 };
 
@@ -32,6 +49,8 @@ struct results_t {
 	time_t start_time;
 	struct result_t *entries;
 	int done;
+	/* Changes whenever the collected addresses change, unique across buckets */
+	unsigned int version;
 };
 
 struct results_t **results_get( void );
@@ -41,15 +60,27 @@ struct results_t *results_find( const UCHAR id[] );
 void results_setup( void );
 void results_free( void );
 
+/* Find the results item of a query, NULL if it has not been searched */
+struct results_t *results_find_query( const char query[] );
+
 /* Create and append a new results item */
 struct results_t *results_add( const char query[], int *is_new );
 
 /* Add an address to a result bucket */
 int results_add_addr( struct results_t *results, const IP *addr );
 
-/* Collect addresses */
+/* Collect addresses, sorted by reachability and round trip time */
 int results_collect( struct results_t *results, IP addr_array[], size_t addr_num );
 
+/* Get the probe state and round trip time of a result address */
+int results_probe_state( const IP *addr, int *rtt );
+
+/* Mark the bucket as modified */
+void results_changed( struct results_t *results );
+
+/* Increases on every change of any bucket */
+unsigned int results_version( void );
+
 /* Mark as done */
 int results_done( struct results_t *results, int done );
 
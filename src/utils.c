@@ -9,6 +9,17 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <sys/random.h>
+#define HAVE_GETRANDOM
+#endif
+
+#ifdef AUTH
+#include <sodium.h>
+#endif
 
 #include "main.h"
 #include "log.h"
@@ -113,10 +124,42 @@ int port_set( IP *addr, unsigned short port ) {
 	}
 }
 
-/* Fill buffer with random bytes */
-int bytes_random( UCHAR buffer[], size_t size ) {
+/*
+* Random bytes are taken from a ChaCha20 key stream. The first 32 bytes
+* of every refill become the next key and served bytes are erased, so
+* earlier output cannot be recovered from the state. The state is only
+* used by the main thread.
+*/
+
+/* Bytes of key stream per refill, a multiple of 64 */
+#define RANDOM_BUFFER_SIZE 512
+#define RANDOM_KEY_SIZE 32
+/* Seconds until fresh entropy is mixed into the key */
+#define RANDOM_RESEED_INTERVAL (10*60)
+
+struct random_state_t {
+	/* Cleared in a forked child if the kernel wipes the page */
+	int seeded;
+	pid_t pid;
+	time_t reseed;
+	size_t pos;
+	UCHAR key[RANDOM_KEY_SIZE];
+	UCHAR buf[RANDOM_BUFFER_SIZE];
+};
+
+static struct random_state_t *g_random = NULL;
+static int g_random_wipeonfork = 0;
+
+/* Read entropy from the kernel */
+void random_entropy( UCHAR buffer[], size_t size ) {
+	ssize_t rc;
 	int fd;
-	int rc;
+
+#ifdef HAVE_GETRANDOM
+	if( getrandom( buffer, size, 0 ) == (ssize_t) size ) {
+		return;
+	}
+#endif
 
 	fd = open( "/dev/urandom", O_RDONLY );
 	if( fd < 0 ) {
@@ -124,11 +167,163 @@ int bytes_random( UCHAR buffer[], size_t size ) {
 		exit( 1 );
 	}
 
-	if( (rc = read( fd, buffer, size )) >= 0 ) {
-		close( fd );
+	rc = read( fd, buffer, size );
+	close( fd );
+
+	if( rc != (ssize_t) size ) {
+		log_err( "Failed to read /dev/urandom" );
+		exit( 1 );
+	}
+}
+
+#ifndef AUTH
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+/* ChaCha20 key stream with a zero nonce, same as crypto_stream_chacha20() */
+void random_chacha20( UCHAR out[], size_t size, const UCHAR key[] ) {
+	uint32_t input[16];
+	uint32_t x[16];
+	size_t i;
+	int r;
+
+	input[0] = 0x61707865;
+	input[1] = 0x3320646e;
+	input[2] = 0x79622d32;
+	input[3] = 0x6b206574;
+	for( i = 0; i < 8; i++ ) {
+		input[4 + i] = (uint32_t) key[4*i] | ((uint32_t) key[4*i+1] << 8)
+			| ((uint32_t) key[4*i+2] << 16) | ((uint32_t) key[4*i+3] << 24);
+	}
+	/* 64 bit block counter and nonce */
+	input[12] = 0;
+	input[13] = 0;
+	input[14] = 0;
+	input[15] = 0;
+
+	for( ; size >= 64; size -= 64, out += 64 ) {
+		memcpy( x, input, sizeof(x) );
+
+		for( r = 0; r < 10; r++ ) {
+			QUARTERROUND( x[0], x[4], x[8], x[12] )
+			QUARTERROUND( x[1], x[5], x[9], x[13] )
+			QUARTERROUND( x[2], x[6], x[10], x[14] )
+			QUARTERROUND( x[3], x[7], x[11], x[15] )
+			QUARTERROUND( x[0], x[5], x[10], x[15] )
+			QUARTERROUND( x[1], x[6], x[11], x[12] )
+			QUARTERROUND( x[2], x[7], x[8], x[13] )
+			QUARTERROUND( x[3], x[4], x[9], x[14] )
+		}
+
+		for( i = 0; i < 16; i++ ) {
+			x[i] += input[i];
+			out[4*i] = x[i] & 0xFF;
+			out[4*i+1] = (x[i] >> 8) & 0xFF;
+			out[4*i+2] = (x[i] >> 16) & 0xFF;
+			out[4*i+3] = (x[i] >> 24) & 0xFF;
+		}
+
+		if( ++input[12] == 0 ) {
+			input[13]++;
+		}
+	}
+}
+#endif
+
+/* Allocate the state, in a page that a forked child gets zeroed if possible */
+void random_setup( void ) {
+#ifdef MADV_WIPEONFORK
+	void *page;
+
+	page = mmap( NULL, sizeof(struct random_state_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( page != MAP_FAILED ) {
+		g_random = (struct random_state_t *) page;
+		g_random_wipeonfork = (madvise( page, sizeof(struct random_state_t), MADV_WIPEONFORK ) == 0);
+		return;
+	}
+#endif
+
+	g_random = (struct random_state_t *) calloc( 1, sizeof(struct random_state_t) );
+}
+
+void random_refill( void ) {
+#ifdef AUTH
+	static const UCHAR nonce[crypto_stream_chacha20_NONCEBYTES];
+
+	crypto_stream_chacha20( g_random->buf, sizeof(g_random->buf), nonce, g_random->key );
+#else
+	random_chacha20( g_random->buf, sizeof(g_random->buf), g_random->key );
+#endif
+
+	/* Take the next key from the key stream */
+	memcpy( g_random->key, g_random->buf, RANDOM_KEY_SIZE );
+	memset( g_random->buf, 0, RANDOM_KEY_SIZE );
+	g_random->pos = RANDOM_KEY_SIZE;
+}
+
+/* Mix fresh entropy into the key */
+void random_reseed( void ) {
+	UCHAR seed[RANDOM_KEY_SIZE];
+	size_t i;
+
+	random_entropy( seed, sizeof(seed) );
+	for( i = 0; i < RANDOM_KEY_SIZE; i++ ) {
+		g_random->key[i] ^= seed[i];
+	}
+	memset( seed, 0, sizeof(seed) );
+
+	g_random->seeded = 1;
+	g_random->pid = getpid();
+	g_random->reseed = time_now_sec() + RANDOM_RESEED_INTERVAL;
+
+	/* Drop the bytes of the old key */
+	random_refill();
+}
+
+/* Fill buffer with random bytes */
+int bytes_random( UCHAR buffer[], size_t size ) {
+	size_t n;
+	size_t i;
+
+	if( g_random == NULL ) {
+		random_setup();
+	}
+
+	/* A forked child must not repeat the bytes of the parent */
+	if( !g_random->seeded
+			|| time_now_sec() >= g_random->reseed
+			|| (!g_random_wipeonfork && getpid() != g_random->pid) ) {
+		random_reseed();
 	}
 
-	return rc;
+	for( i = 0; i < size; i += n ) {
+		if( g_random->pos == RANDOM_BUFFER_SIZE ) {
+			random_refill();
+		}
+
+		n = RANDOM_BUFFER_SIZE - g_random->pos;
+		if( n > (size - i) ) {
+			n = size - i;
+		}
+
+		memcpy( buffer + i, g_random->buf + g_random->pos, n );
+		memset( g_random->buf + g_random->pos, 0, n );
+		g_random->pos += n;
+	}
+
+	return size;
+}
+
+unsigned int uint_random( void ) {
+	unsigned int r;
+
+	bytes_random( (UCHAR*) &r, sizeof(r) );
+
+	return r;
 }
 
 void bytes_from_hex( UCHAR bin[], const char hex[], size_t length ) {
@@ -21,7 +21,9 @@ int port_random( void );
 int port_parse( const char pstr[], int err );
 int port_set( IP *addr, unsigned short port );
 
+/* Buffered ChaCha20 generator, seeded by the kernel */
 int bytes_random( UCHAR buffer[], size_t size );
+unsigned int uint_random( void );
 void bytes_from_hex( UCHAR bin[], const char hex[], size_t length );
 char *bytes_to_hex( char hex[], const UCHAR bin[], size_t length );
 
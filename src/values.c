@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 
 #include "log.h"
 #include "conf.h"
@@ -18,39 +19,310 @@
 /* Announce values every 20 minutes */
 #define ANNOUNCE_INTERVAL (20*60)
 
-static time_t g_values_expire = 0;
-static time_t g_values_announce = 0;
+/* Subtract up to 1/10 of the interval as jitter to spread out announcements */
+#define ANNOUNCE_JITTER (ANNOUNCE_INTERVAL / 10)
+
+/* Consider an announcement search as finished after this time */
+#define ANNOUNCE_SEARCH_TIMEOUT (2*60)
+
+/* Number of announcements that can be started at once */
+#define ANNOUNCE_BURST 8
+
+/* Initial number of hash table slots, a power of two */
+#define VALUES_TABLE_SIZE 64
+
+
+/*
+* All values are kept in a list, a hash table indexed
+* by id and a min-heap ordered by lifetime.
+*/
+
+/* Announcement searches in progress */
+struct announce_t {
+	UCHAR id[SHA1_BIN_LENGTH];
+	time_t start;
+};
+
+static struct announce_t g_announces[ANNOUNCE_MAX_SEARCHES];
+static int g_announces_count = 0;
+
+/* Finished announcement searches whose nodes can be used by nearby values */
+static UCHAR g_groups[ANNOUNCE_MAX_SEARCHES][SHA1_BIN_LENGTH];
+static int g_groups_count = 0;
+
+/* Announcements done by a search and by the nodes of a nearby search */
+static unsigned int g_announced_search = 0;
+static unsigned int g_announced_grouped = 0;
+
+/* Announcements we are allowed to start, refilled over time */
+static double g_announce_credit = ANNOUNCE_BURST;
+static time_t g_announce_credit_time = 0;
+
 static struct value_t *g_values = NULL;
+static int g_values_count = 0;
+
+static struct value_t **g_values_table = NULL;
+static size_t g_values_table_size = 0;
+
+/* All values ordered by id, rebuilt on demand after a change */
+static struct value_t **g_values_sorted = NULL;
+static int g_values_sorted_count = 0;
+static int g_values_sorted_dirty = 1;
+
 
 struct value_t* values_get( void ) {
 	return g_values;
 }
 
+/* Ids might be raw user input, mix all bytes */
+size_t values_hash( const UCHAR id[] ) {
+	size_t hash;
+	size_t i;
+
+	hash = 2166136261U;
+	for( i = 0; i < SHA1_BIN_LENGTH; i++ ) {
+		hash = (hash ^ id[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
 struct value_t* values_find( UCHAR id[] ) {
 	struct value_t *value;
 
-	value = g_values;
+	if( g_values_table == NULL ) {
+		return NULL;
+	}
+
+	value = g_values_table[values_hash( id ) & (g_values_table_size - 1)];
 	while( value ) {
 		if( id_equal( id, value->id ) ) {
 			return value;
 		}
-		value = value->next;
+		value = value->hnext;
 	}
 	return NULL;
 }
 
-int values_count( void ) {
+void values_table_insert( struct value_t *value ) {
+	size_t idx;
+
+	idx = values_hash( value->id ) & (g_values_table_size - 1);
+	value->hnext = g_values_table[idx];
+	g_values_table[idx] = value;
+}
+
+void values_table_remove( struct value_t *value ) {
+	struct value_t **cur;
+
+	cur = &g_values_table[values_hash( value->id ) & (g_values_table_size - 1)];
+	while( *cur ) {
+		if( *cur == value ) {
+			*cur = value->hnext;
+			return;
+		}
+		cur = &(*cur)->hnext;
+	}
+}
+
+/* Double the hash table size when it becomes too crowded */
+void values_table_grow( void ) {
 	struct value_t *value;
-	int count;
 
-	count = 0;
+	if( g_values_count < g_values_table_size ) {
+		return;
+	}
+
+	free( g_values_table );
+	g_values_table_size = g_values_table_size ? (2 * g_values_table_size) : VALUES_TABLE_SIZE;
+	g_values_table = (struct value_t**) calloc( g_values_table_size, sizeof(struct value_t*) );
+
 	value = g_values;
 	while( value ) {
-		count++;
+		values_table_insert( value );
 		value = value->next;
 	}
+}
 
-	return count;
+int values_id_cmp( const void *a, const void *b ) {
+	return memcmp( (*(struct value_t**) a)->id, (*(struct value_t**) b)->id, SHA1_BIN_LENGTH );
+}
+
+void values_sorted_update( void ) {
+	struct value_t *value;
+	int i;
+
+	if( !g_values_sorted_dirty ) {
+		return;
+	}
+
+	g_values_sorted = (struct value_t**) realloc( g_values_sorted, (g_values_count + 1) * sizeof(struct value_t*) );
+
+	i = 0;
+	value = g_values;
+	while( value ) {
+		g_values_sorted[i++] = value;
+		value = value->next;
+	}
+	g_values_sorted_count = i;
+
+	qsort( g_values_sorted, g_values_sorted_count, sizeof(struct value_t*), &values_id_cmp );
+	g_values_sorted_dirty = 0;
+}
+
+/* Check if the first bits of both ids are equal */
+int values_prefix_equal( const UCHAR id1[], const UCHAR id2[], int bits ) {
+	int n = bits / 8;
+	int r = bits % 8;
+
+	if( memcmp( id1, id2, n ) != 0 ) {
+		return 0;
+	}
+
+	return (r == 0) || ((id1[n] ^ id2[n]) >> (8 - r)) == 0;
+}
+
+/*
+* Find the first value whose id starts with the first bits of prefix.
+* Values with the same prefix follow in the sorted index.
+*/
+int values_sorted_find( const UCHAR prefix[], int bits ) {
+	UCHAR lower[SHA1_BIN_LENGTH];
+	int lo, hi, mid;
+	int n;
+
+	/* Smallest id with this prefix */
+	memset( lower, 0, sizeof(lower) );
+	n = bits / 8;
+	memcpy( lower, prefix, n );
+	if( bits % 8 ) {
+		lower[n] = prefix[n] & (0xFF << (8 - (bits % 8)));
+	}
+
+	lo = 0;
+	hi = g_values_sorted_count;
+	while( lo < hi ) {
+		mid = lo + (hi - lo) / 2;
+		if( memcmp( g_values_sorted[mid]->id, lower, SHA1_BIN_LENGTH ) < 0 ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Min-heap of values, ordered by lifetime or refresh time */
+struct value_heap_t {
+	struct value_t **data;
+	size_t count;
+	size_t size;
+	int type;
+};
+
+enum {
+	HEAP_LIFETIME,
+	HEAP_REFRESH
+};
+
+static struct value_heap_t g_lifetime_heap = { NULL, 0, 0, HEAP_LIFETIME };
+static struct value_heap_t g_refresh_heap = { NULL, 0, 0, HEAP_REFRESH };
+
+time_t heap_key( struct value_heap_t *heap, size_t idx ) {
+	struct value_t *value = heap->data[idx];
+	return (heap->type == HEAP_LIFETIME) ? value->lifetime : value->refresh;
+}
+
+void heap_swap( struct value_heap_t *heap, size_t a, size_t b ) {
+	struct value_t *tmp;
+
+	tmp = heap->data[a];
+	heap->data[a] = heap->data[b];
+	heap->data[b] = tmp;
+
+	heap->data[a]->heap_idx[heap->type] = a;
+	heap->data[b]->heap_idx[heap->type] = b;
+}
+
+/* Restore the heap order for an item whose key has changed */
+void heap_update( struct value_heap_t *heap, size_t idx ) {
+	size_t parent, child;
+
+	while( idx > 0 ) {
+		parent = (idx - 1) / 2;
+		if( heap_key( heap, parent ) <= heap_key( heap, idx ) ) {
+			break;
+		}
+		heap_swap( heap, parent, idx );
+		idx = parent;
+	}
+
+	while( 1 ) {
+		child = 2 * idx + 1;
+		if( child >= heap->count ) {
+			break;
+		}
+		if( (child + 1) < heap->count && heap_key( heap, child + 1 ) < heap_key( heap, child ) ) {
+			child++;
+		}
+		if( heap_key( heap, idx ) <= heap_key( heap, child ) ) {
+			break;
+		}
+		heap_swap( heap, idx, child );
+		idx = child;
+	}
+}
+
+void heap_insert( struct value_heap_t *heap, struct value_t *value ) {
+
+	if( heap->count == heap->size ) {
+		heap->size = heap->size ? (2 * heap->size) : VALUES_TABLE_SIZE;
+		heap->data = (struct value_t**) realloc( heap->data, heap->size * sizeof(struct value_t*) );
+	}
+
+	value->heap_idx[heap->type] = heap->count;
+	heap->data[heap->count] = value;
+	heap->count++;
+	heap_update( heap, heap->count - 1 );
+}
+
+void heap_remove( struct value_heap_t *heap, struct value_t *value ) {
+	size_t idx;
+	size_t last;
+
+	idx = value->heap_idx[heap->type];
+	last = heap->count - 1;
+
+	if( idx != last ) {
+		heap_swap( heap, idx, last );
+		heap->count--;
+		heap_update( heap, idx );
+	} else {
+		heap->count--;
+	}
+}
+
+/* Count heap items with a key not later than time, visits only those */
+size_t heap_count_due( struct value_heap_t *heap, size_t idx, time_t time ) {
+
+	if( idx >= heap->count || heap_key( heap, idx ) > time ) {
+		return 0;
+	}
+
+	return 1 + heap_count_due( heap, 2 * idx + 1, time )
+		+ heap_count_due( heap, 2 * idx + 2, time );
+}
+
+void heap_free( struct value_heap_t *heap ) {
+	free( heap->data );
+	heap->data = NULL;
+	heap->count = 0;
+	heap->size = 0;
+}
+
+int values_count( void ) {
+	return g_values_count;
 }
 
 void values_debug( int fd ) {
@@ -92,29 +364,13 @@ void values_debug( int fd ) {
 	dprintf( fd, " Found %d values.\n", value_counter );
 }
 
-struct value_t *values_add( const char query[], int port, time_t lifetime ) {
+/* Add or refresh a value with an already computed id */
+struct value_t *values_insert( const UCHAR id[], const UCHAR *skey, int port, time_t lifetime ) {
 	char hexbuf[SHA1_HEX_LENGTH+1];
-	UCHAR id[SHA1_BIN_LENGTH];
 	struct value_t *cur;
 	struct value_t *new;
 	time_t now;
 
-#ifdef AUTH
-	UCHAR skey[crypto_sign_SECRETKEYBYTES];
-	UCHAR *skey_ptr = auth_handle_skey( skey, id, query );
-
-	if( skey_ptr ) {
-		if( port == 0 ) {
-			/* Authenticationis is done over the DHT port */
-			port = atoi( gconf->dht_port );
-		} else {
-			return NULL;
-		}
-	}
-#else
-	id_compute( id, query );
-#endif
-
 	if( port == 0 ) {
 		port = port_random();
 	}
@@ -126,16 +382,15 @@ struct value_t *values_add( const char query[], int port, time_t lifetime ) {
 	now = time_now_sec();
 
 	/* Value already exists - refresh */
-	if( (cur = values_find( id )) != NULL ) {
+	if( (cur = values_find( (UCHAR*) id )) != NULL ) {
 		cur->refresh = now - 1;
+		heap_update( &g_refresh_heap, cur->heap_idx[HEAP_REFRESH] );
 
 		if( lifetime > now ) {
 			cur->lifetime = lifetime;
+			heap_update( &g_lifetime_heap, cur->heap_idx[HEAP_LIFETIME] );
 		}
 
-		/* Trigger immediate handling */
-		g_values_announce= 0;
-
 		return cur;
 	}
 
@@ -143,8 +398,8 @@ struct value_t *values_add( const char query[], int port, time_t lifetime ) {
 	new = (struct value_t*) calloc( 1, sizeof(struct value_t) );
 	memcpy( new->id, id, SHA1_BIN_LENGTH );
 #ifdef AUTH
-	if( skey_ptr ) {
-		new->skey = memdup( skey_ptr, crypto_sign_SECRETKEYBYTES );
+	if( skey ) {
+		new->skey = memdup( skey, crypto_sign_SECRETKEYBYTES );
 	}
 #endif
 	new->port = port;
@@ -155,14 +410,185 @@ struct value_t *values_add( const char query[], int port, time_t lifetime ) {
 
 	/* Prepend to list */
 	new->next = g_values;
+	if( g_values ) {
+		g_values->prev = new;
+	}
 	g_values = new;
+	g_values_count++;
 
-	/* Trigger immediate handling */
-	g_values_announce= 0;
+	heap_insert( &g_lifetime_heap, new );
+	heap_insert( &g_refresh_heap, new );
+
+	if( g_values_table ) {
+		values_table_insert( new );
+	}
+	values_table_grow();
+	g_values_sorted_dirty = 1;
 
 	return new;
 }
 
+/*
+* Compute the id of a query and the port to announce.
+* Returns -1 if the port cannot be used with this query.
+*/
+int values_compute_id( UCHAR id[], UCHAR **skey_ptr, UCHAR skey[], const char query[], int *port ) {
+#ifdef AUTH
+	*skey_ptr = auth_handle_skey( skey, id, query );
+
+	if( *skey_ptr ) {
+		if( *port == 0 ) {
+			/* Authenticationis is done over the DHT port */
+			*port = atoi( gconf->dht_port );
+		} else {
+			return -1;
+		}
+	}
+#else
+	*skey_ptr = NULL;
+	id_compute( id, query );
+#endif
+
+	return 0;
+}
+
+struct value_t *values_add( const char query[], int port, time_t lifetime ) {
+	UCHAR id[SHA1_BIN_LENGTH];
+	UCHAR *skey_ptr;
+#ifdef AUTH
+	UCHAR skey[crypto_sign_SECRETKEYBYTES];
+#else
+	UCHAR *skey = NULL;
+#endif
+
+	if( values_compute_id( id, &skey_ptr, skey, query, &port ) < 0 ) {
+		return NULL;
+	}
+
+	return values_insert( id, skey_ptr, port, lifetime );
+}
+
+/* A line of a values file */
+struct value_entry_t {
+	char query[QUERY_MAX_SIZE];
+	int port;
+	time_t lifetime;
+};
+
+/*
+* Parse a line of the form <query>[:<port>] [<minutes>].
+* Without minutes or with negative minutes the value never expires.
+*/
+int values_parse_line( struct value_entry_t *entry, char line[], time_t now ) {
+	char *query;
+	char *minutes;
+	char *p;
+
+	query = strtok( line, " \t" );
+	minutes = strtok( NULL, " \t" );
+
+	if( query == NULL || strtok( NULL, " \t" ) != NULL ) {
+		return -1;
+	}
+
+	/* Find <query>:<port> delimiter */
+	p = strchr( query, ':' );
+	if( p ) {
+		*p = '\0';
+		entry->port = port_parse( p + 1, -1 );
+		if( entry->port < 1 ) {
+			return -1;
+		}
+	} else {
+		/* A random port will be choosen */
+		entry->port = 0;
+	}
+
+	if( minutes == NULL || atoi( minutes ) < 0 ) {
+		entry->lifetime = LONG_MAX;
+	} else {
+		entry->lifetime = now + 60 * atoi( minutes );
+	}
+
+	/* Remove .p2p suffix and convert to lowercase */
+	return query_sanitize( entry->query, sizeof(entry->query), query );
+}
+
+/* Add the value of a parsed line, warn about values that cannot be added */
+int values_load_entry( struct value_entry_t *entry, const char filename[], int lineno ) {
+	UCHAR id[SHA1_BIN_LENGTH];
+	UCHAR *skey_ptr;
+#ifdef AUTH
+	UCHAR skey[crypto_sign_SECRETKEYBYTES];
+#else
+	UCHAR *skey = NULL;
+#endif
+
+	if( values_compute_id( id, &skey_ptr, skey, entry->query, &entry->port ) < 0 ) {
+		log_warn( "VAL: No port allowed for value with secret key in '%s' line %d.", filename, lineno );
+		return -1;
+	}
+
+	if( values_insert( id, skey_ptr, entry->port, entry->lifetime ) == NULL ) {
+		log_warn( "VAL: Invalid port for value in '%s' line %d.", filename, lineno );
+		return -1;
+	}
+
+	return 0;
+}
+
+int values_load_file( const char filename[] ) {
+	struct value_entry_t entry;
+	char linebuf[QUERY_MAX_SIZE + 32];
+	int count;
+	int lineno;
+	int c;
+	time_t now;
+	FILE *fp;
+
+	fp = fopen( filename, "r" );
+	if( fp == NULL ) {
+		log_warn( "VAL: Cannot open file '%s' for value import: %s", filename, strerror( errno ) );
+		return -1;
+	}
+
+	now = time_now_sec();
+	count = 0;
+	lineno = 0;
+
+	while( fgets( linebuf, sizeof(linebuf), fp ) != NULL ) {
+		lineno++;
+
+		/* Skip the rest of a line that does not fit into the buffer */
+		if( strchr( linebuf, '\n' ) == NULL && !feof( fp ) ) {
+			while( (c = fgetc( fp )) != EOF && c != '\n' );
+			log_warn( "VAL: Line too long in '%s' line %d.", filename, lineno );
+			continue;
+		}
+
+		linebuf[strcspn( linebuf, "#\n\r" )] = '\0';
+
+		if( strspn( linebuf, " \t" ) == strlen( linebuf ) ) {
+			continue;
+		}
+
+		if( values_parse_line( &entry, linebuf, now ) != 0 ) {
+			log_warn( "VAL: Invalid value in '%s' line %d.", filename, lineno );
+			continue;
+		}
+
+		if( values_load_entry( &entry, filename, lineno ) == 0 ) {
+			count++;
+		}
+	}
+
+	fclose( fp );
+
+	log_info( "VAL: Loaded %d values from '%s'.", count, filename );
+
+	return count;
+}
+
 void value_free( struct value_t *value ) {
 #ifdef AUTH
 	/* Secure erase */
@@ -174,88 +600,224 @@ void value_free( struct value_t *value ) {
 	free( value );
 }
 
-/* Remove an element from the list - internal use only */
+/* Remove an element from all indices - internal use only */
 void values_remove( struct value_t *value ) {
-	struct value_t *pre;
-	struct value_t *cur;
 
-	pre = NULL;
-	cur = g_values;
-	while( cur ) {
-		if( cur == value ) {
-			if( pre ) {
-				pre->next = cur->next;
-			} else {
-				g_values = cur->next;
-			}
-			value_free( cur );
-			return;
-		}
-		pre = cur;
-		cur = cur->next;
+	if( value->prev ) {
+		value->prev->next = value->next;
+	} else {
+		g_values = value->next;
+	}
+
+	if( value->next ) {
+		value->next->prev = value->prev;
 	}
+
+	values_table_remove( value );
+	heap_remove( &g_lifetime_heap, value );
+	heap_remove( &g_refresh_heap, value );
+	g_values_count--;
+	g_values_sorted_dirty = 1;
+
+	value_free( value );
 }
 
+/* Remove all values whose lifetime has expired */
 void values_expire( void ) {
-	struct value_t *pre;
-	struct value_t *cur;
 	time_t now;
 
 	now = time_now_sec();
-	pre = NULL;
-	cur = g_values;
-	while( cur ) {
-		if( cur->lifetime < now ) {
-			if( pre ) {
-				pre->next = cur->next;
-			} else {
-				g_values = cur->next;
+	while( g_lifetime_heap.count > 0 && g_lifetime_heap.data[0]->lifetime < now ) {
+		values_remove( g_lifetime_heap.data[0] );
+	}
+}
+
+/* Called when an announcement search has finished */
+void values_announce_done( const UCHAR id[] ) {
+	int i;
+
+	for( i = 0; i < g_announces_count; i++ ) {
+		if( id_equal( g_announces[i].id, id ) ) {
+			g_announces_count--;
+			g_announces[i] = g_announces[g_announces_count];
+
+			/* Called with the DHT lock held, use the nodes of the search later */
+			if( gconf->announce_batch && g_groups_count < ANNOUNCE_MAX_SEARCHES ) {
+				memcpy( g_groups[g_groups_count], id, SHA1_BIN_LENGTH );
+				g_groups_count++;
 			}
-			value_free( cur );
 			return;
 		}
-		pre = cur;
-		cur = cur->next;
 	}
 }
 
+/* Forget about searches that never seem to finish */
+void values_announce_timeout( time_t now ) {
+	int i;
+
+	i = 0;
+	while( i < g_announces_count ) {
+		if( (g_announces[i].start + ANNOUNCE_SEARCH_TIMEOUT) < now ) {
+			g_announces_count--;
+			g_announces[i] = g_announces[g_announces_count];
+		} else {
+			i++;
+		}
+	}
+}
+
+/*
+* The credit grows fast enough to announce every value
+* once per interval and is capped to limit bursts.
+*/
+void values_announce_credit( time_t now ) {
+	double rate;
+
+	if( g_announce_credit_time == 0 ) {
+		g_announce_credit_time = now;
+	}
+
+	rate = (double) g_values_count / (ANNOUNCE_INTERVAL - ANNOUNCE_JITTER);
+	g_announce_credit += rate * (now - g_announce_credit_time);
+	g_announce_credit_time = now;
+
+	if( g_announce_credit > ANNOUNCE_BURST ) {
+		g_announce_credit = ANNOUNCE_BURST;
+	}
+}
+
+time_t values_announce_jitter( void ) {
+	unsigned int r;
+
+	bytes_random( (UCHAR*) &r, sizeof(r) );
+	return r % (ANNOUNCE_JITTER + 1);
+}
+
+/*
+* Announce all values with an id covered by the closest nodes of a
+* finished announcement search to these nodes, even before they are due.
+* Values announced less than half an interval ago are skipped.
+*/
+void values_announce_group( const UCHAR search_id[], time_t now ) {
+	struct value_t *value;
+	int bits;
+	int i;
+
+	bits = kad_announce_radius( search_id );
+	if( bits < 0 ) {
+		return;
+	}
+
+	values_sorted_update();
+
+	for( i = values_sorted_find( search_id, bits ); i < g_values_sorted_count; i++ ) {
+		value = g_values_sorted[i];
+
+		if( !values_prefix_equal( value->id, search_id, bits ) ) {
+			break;
+		}
+
+		if( value->refresh > (now + ANNOUNCE_INTERVAL / 2) ) {
+			continue;
+		}
+
+		if( kad_announce_via( search_id, value->id, value->port ) > 0 ) {
+#ifdef DEBUG
+			char hexbuf[SHA1_HEX_LENGTH+1];
+			log_debug( "VAL: Announce %s:%hu (grouped)",  str_id( value->id, hexbuf ), value->port );
+#endif
+			g_announced_grouped++;
+			value->refresh = now + ANNOUNCE_INTERVAL - values_announce_jitter();
+			heap_update( &g_refresh_heap, value->heap_idx[HEAP_REFRESH] );
+		}
+	}
+}
+
+/* Start announcements that are due, but not too many at once */
 void values_announce( void ) {
 	struct value_t *value;
 	time_t now;
 
 	now = time_now_sec();
-	value = g_values;
-	while( value ) {
-		if( value->refresh < now ) {
+	values_announce_timeout( now );
+	values_announce_credit( now );
+
+	while( g_groups_count > 0 ) {
+		g_groups_count--;
+		values_announce_group( g_groups[g_groups_count], now );
+	}
+
+	while( g_refresh_heap.count > 0 ) {
+		value = g_refresh_heap.data[0];
+
+		if( value->refresh >= now ) {
+			break;
+		}
+
+		if( g_announce_credit < 1.0 ) {
+			break;
+		}
+
+		if( gconf->announce_batch && kad_announce_nearby( value->id, value->port ) > 0 ) {
+			/* Sent along with a previous announcement, no search needed */
+#ifdef DEBUG
+			char hexbuf[SHA1_HEX_LENGTH+1];
+			log_debug( "VAL: Announce %s:%hu (batched)",  str_id( value->id, hexbuf ), value->port );
+#endif
+			g_announced_grouped++;
+		} else if( g_announces_count < ANNOUNCE_MAX_SEARCHES ) {
 #ifdef DEBUG
 			char hexbuf[SHA1_HEX_LENGTH+1];
 			log_debug( "VAL: Announce %s:%hu",  str_id( value->id, hexbuf ), value->port );
 #endif
 			kad_announce_once( value->id, value->port );
-			value->refresh = now + ANNOUNCE_INTERVAL;
+			g_announced_search++;
+
+			memcpy( g_announces[g_announces_count].id, value->id, SHA1_BIN_LENGTH );
+			g_announces[g_announces_count].start = now;
+			g_announces_count++;
+		} else {
+			break;
 		}
-		value = value->next;
+
+		g_announce_credit -= 1.0;
+
+		value->refresh = now + ANNOUNCE_INTERVAL - values_announce_jitter();
+		heap_update( &g_refresh_heap, value->heap_idx[HEAP_REFRESH] );
 	}
 }
 
-void values_handle( int _rc, int _sock ) {
-	/* Expire search results */
-	if( g_values_expire <= time_now_sec() ) {
-		values_expire();
+void values_announce_status( int *queued, int *active, int *lag, unsigned int *searched, unsigned int *grouped ) {
+	time_t now;
 
-		/* Try again in ~1 minute */
-		g_values_expire = time_add_min( 1 );
+	now = time_now_sec();
+
+	*queued = heap_count_due( &g_refresh_heap, 0, now - 1 );
+	*active = g_announces_count;
+	*searched = g_announced_search;
+	*grouped = g_announced_grouped;
+
+	if( g_refresh_heap.count > 0 && g_refresh_heap.data[0]->refresh < now ) {
+		*lag = now - g_refresh_heap.data[0]->refresh;
+	} else {
+		*lag = 0;
 	}
+}
 
-	if( g_values_announce <= time_now_sec() && kad_count_nodes( 0 ) != 0 ) {
-		values_announce();
+void values_handle( int _rc, int _sock ) {
+	/* Expire values, the heap makes this cheap */
+	values_expire();
 
-		/* Try again in ~1 minute */
-		g_values_announce = time_add_min( 1 );
+	if( kad_count_nodes( 0 ) != 0 ) {
+		values_announce();
 	}
 }
 
 void values_setup( void ) {
+	if( gconf->values_file ) {
+		values_load_file( gconf->values_file );
+	}
+
 	/* Cause the callback to be called in intervals */
 	net_add_handler( -1, &values_handle );
 }
@@ -271,4 +833,19 @@ void values_free( void ) {
 		cur = next;
 	}
 	g_values = NULL;
+	g_values_count = 0;
+	g_announces_count = 0;
+	g_groups_count = 0;
+
+	free( g_values_sorted );
+	g_values_sorted = NULL;
+	g_values_sorted_count = 0;
+	g_values_sorted_dirty = 1;
+
+	free( g_values_table );
+	g_values_table = NULL;
+	g_values_table_size = 0;
+
+	heap_free( &g_lifetime_heap );
+	heap_free( &g_refresh_heap );
 }
@@ -7,13 +7,22 @@
 #include <sodium.h>
 #endif
 
+/* Maximum number of announcement searches at the same time */
+#define ANNOUNCE_MAX_SEARCHES 16
+
 /*
 * Announce a value id / port pair in regular
 * intervals until the lifetime expires.
 */
 
 struct value_t {
+	/* List of all values */
 	struct value_t *next;
+	struct value_t *prev;
+	/* Next value in the same hash table slot */
+	struct value_t *hnext;
+	/* Position in the lifetime and refresh heap */
+	size_t heap_idx[2];
 	UCHAR id[SHA1_BIN_LENGTH];
 #ifdef AUTH
 	UCHAR *skey;
@@ -32,11 +41,26 @@ struct value_t* values_find( UCHAR id[] );
 /* List all entries */
 void values_debug( int fd );
 
-/* Count all entries */
+/* Count all entries, O(1) */
 int values_count( void );
 
+/* Notify that the announcement search for this id has finished */
+void values_announce_done( const UCHAR id[] );
+
+/*
+* Number of due announcements, running announcement searches, delay in seconds
+* and the total of announcements sent by a search or with the nodes of a nearby search.
+*/
+void values_announce_status( int *queued, int *active, int *lag, unsigned int *searched, unsigned int *grouped );
+
 /* Add a value id / port that will be announced until lifetime is exceeded */
 struct value_t *values_add( const char query[], int port, time_t lifetime );
 
+/*
+* Add all values of a file with lines of the form <query>[:<port>] [<minutes>].
+* Returns the number of values added or -1 if the file cannot be read.
+*/
+int values_load_file( const char filename[] );
+
 
 #endif /* _EXT_VALUES_H_ */